@@ -2,17 +2,26 @@
  * Copyright (C) Andrey Pikas
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <systemd/sd-daemon.h>
 #include <uv.h>
 
 #include <pruv/http_pipelining_dispatcher.hpp>
@@ -20,13 +29,299 @@
 #include <pruv/log.hpp>
 #include <pruv/termination.hpp>
 
-std::unique_ptr<pruv::dispatcher> dispatcher;
+/// Dispatcher with its own loop. The first one runs in the main thread,
+/// others in separate threads.
+struct dispatcher_thread {
+    uv_loop_t loop;
+    /// Used to call dispatcher->stop() inside the dispatcher's thread.
+    uv_async_t stop_async;
+    uv_thread_t tid;
+    bool thread_started = false;
+    std::unique_ptr<pruv::dispatcher> dispatcher;
+    /// Listening socket after start. -1 if dispatcher failed to start.
+    int listen_fd = -1;
+    /// Requests of stop_async. uv_async_send() calls may be merged, so each
+    /// one has its own flag. Stop wins over drain.
+    std::atomic<bool> drain{false};
+    std::atomic<bool> stop{false};
+    /// Accessed only from the dispatcher's thread.
+    bool stopped = false;
+};
+
+std::vector<std::unique_ptr<dispatcher_thread>> dispatchers;
+
+/// Arguments of this process, passed to new process on upgrade.
+char * const *main_argv = nullptr;
+/// Absolute path of executable started on upgrade. It's resolved at start,
+/// because argv[0] may be relative to working directory or PATH.
+std::string exe_path;
+/// New process started by SIGHUP. 0 if upgrade isn't in progress.
+pid_t upgrade_pid = 0;
+/// Started processes, which are reaped if they exit before this one.
+std::vector<pid_t> upgrade_children;
+/// Pipe through which new process reports that it accepts connections.
+uv_poll_t upgrade_poll;
+int upgrade_fd = -1;
+/// Dispatchers are drained after successful upgrade or by the first
+/// SIGTERM or SIGINT, unless stop_at_once.
+std::atomic<bool> draining{false};
+/// SIGTERM and SIGINT stop dispatchers without draining. Set when
+/// --drain-timeout is 0 or less.
+bool stop_at_once = false;
+
+void stop_dispatchers() noexcept
+{
+    for (auto &t : dispatchers) {
+        t->stop = true;
+        int r = uv_async_send(&t->stop_async);
+        if (r < 0)
+            pruv::log_uv_err(LOG_ERR, "uv_async_send", r);
+    }
+}
+
+void drain_dispatchers() noexcept
+{
+    draining = true;
+    for (auto &t : dispatchers) {
+        t->drain = true;
+        int r = uv_async_send(&t->stop_async);
+        if (r < 0)
+            pruv::log_uv_err(LOG_ERR, "uv_async_send", r);
+    }
+}
 
 void stop_handler(uv_signal_t * /*handle*/, int signum)
 {
     pruv_log(LOG_NOTICE, "Received signal %d", signum);
-    if (dispatcher)
-        dispatcher->stop();
+    // The second signal closes connections being drained.
+    if (stop_at_once || draining)
+        return stop_dispatchers();
+    drain_dispatchers();
+}
+
+/// Path, by which exec finds argv0, made absolute. Symbolic links aren't
+/// resolved, so upgrade runs binary installed by the same path.
+std::string resolve_exe(const char *argv0)
+{
+    std::string cwd;
+    char buf[PATH_MAX];
+    if (getcwd(buf, sizeof(buf)))
+        cwd = buf;
+    else
+        pruv_log_syserr(LOG_WARNING, "getcwd");
+    auto absolute = [&](std::string path) {
+        return path[0] == '/' || cwd.empty() ? path : cwd + "/" + path;
+    };
+    if (strchr(argv0, '/'))
+        return absolute(argv0);
+    const char *path = getenv("PATH");
+    for (const char *dir = path; dir; ) {
+        const char *end = strchr(dir, ':');
+        std::string d(dir, end ? end - dir : strlen(dir));
+        std::string exe = (d.empty() ? "." : d) + "/" + argv0;
+        if (!access(exe.c_str(), X_OK))
+            return absolute(exe);
+        dir = end ? end + 1 : nullptr;
+    }
+    // Running binary is the best guess.
+    pruv_log(LOG_WARNING, "%s isn't found in PATH", argv0);
+    return "/proc/self/exe";
+}
+
+void reap_upgrade_children(uv_signal_t * /*handle*/, int /*signum*/)
+{
+    for (auto it = upgrade_children.begin(); it != upgrade_children.end();) {
+        int status;
+        pid_t r = waitpid(*it, &status, WNOHANG);
+        if (!r || (r == -1 && errno == EINTR)) {
+            ++it;
+            continue;
+        }
+        if (r == -1)
+            pruv_log_syserr(LOG_ERR, "waitpid");
+        else if (WIFEXITED(status))
+            pruv_log(LOG_NOTICE, "Process %d exited with code %d", r,
+                    WEXITSTATUS(status));
+        else if (WIFSIGNALED(status))
+            pruv_log(LOG_NOTICE, "Process %d killed by signal %d", r,
+                    WTERMSIG(status));
+        it = upgrade_children.erase(it);
+    }
+}
+
+void close_upgrade_poll() noexcept
+{
+    uv_close((uv_handle_t *)&upgrade_poll, nullptr);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+}
+
+void on_upgrade_ready(uv_poll_t * /*handle*/, int status, int /*events*/)
+{
+    pid_t pid = 0;
+    ssize_t n = 0;
+    if (status < 0)
+        pruv::log_uv_err(LOG_ERR, "Upgrade poll", status);
+    else if ((n = read(upgrade_fd, &pid, sizeof(pid))) == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        pruv_log_syserr(LOG_ERR, "read upgrade pipe");
+    }
+    close_upgrade_poll();
+    if (n != sizeof(pid)) {
+        // New process exited or failed to start its dispatchers.
+        pruv_log(LOG_ERR, "Upgrade failed. Connections are still accepted");
+        upgrade_pid = 0;
+        // Otherwise it's reaped by SIGCHLD handler.
+        return reap_upgrade_children(nullptr, SIGCHLD);
+    }
+    pruv_log(LOG_NOTICE, "Process %d accepts connections. Draining", pid);
+    sd_notifyf(0, "MAINPID=%d", (int)pid);
+    drain_dispatchers();
+}
+
+/// Execute binary of this process again with the same arguments and with
+/// listening sockets. This process drains when the new one is ready.
+void upgrade_handler(uv_signal_t *handle, int signum)
+{
+    pruv_log(LOG_NOTICE, "Received signal %d", signum);
+    if (upgrade_pid || draining) {
+        pruv_log(LOG_WARNING, "Upgrade is already in progress");
+        return;
+    }
+    for (auto &t : dispatchers)
+        if (t->listen_fd == -1) {
+            pruv_log(LOG_ERR, "Upgrade is impossible without listening "
+                    "socket in each dispatcher");
+            return;
+        }
+
+    int p[2];
+    if (pipe2(p, O_CLOEXEC | O_NONBLOCK) == -1) {
+        pruv_log_syserr(LOG_ERR, "pipe2");
+        return;
+    }
+    // Arguments are prepared before fork, child only execs. Sockets of
+    // previous upgrade are replaced by the current ones.
+    std::vector<std::string> fd_args;
+    for (auto &t : dispatchers)
+        fd_args.push_back("--listen-fd=" + std::to_string(t->listen_fd));
+    fd_args.push_back("--ready-fd=" + std::to_string(p[1]));
+    std::vector<const char *> args;
+    for (char * const *a = main_argv; *a; ++a) {
+        if (!strcmp(*a, "--listen-fd") || !strcmp(*a, "--ready-fd")) {
+            if (a[1])
+                ++a;
+            continue;
+        }
+        if (!strncmp(*a, "--listen-fd=", 12) || !strncmp(*a, "--ready-fd=", 11))
+            continue;
+        args.push_back(*a);
+    }
+    for (const std::string &a : fd_args)
+        args.push_back(a.c_str());
+    args.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Inherited descriptors must survive exec.
+        for (auto &t : dispatchers)
+            fcntl(t->listen_fd, F_SETFD, 0);
+        fcntl(p[1], F_SETFD, 0);
+        execv(exe_path.c_str(), const_cast<char * const *>(args.data()));
+        _exit(127);
+    }
+    close(p[1]);
+    if (pid == -1) {
+        pruv_log_syserr(LOG_ERR, "fork");
+        close(p[0]);
+        return;
+    }
+    upgrade_children.push_back(pid);
+    upgrade_fd = p[0];
+    int r;
+    if ((r = uv_poll_init(handle->loop, &upgrade_poll, upgrade_fd)) < 0) {
+        pruv::log_uv_err(LOG_ERR, "uv_poll_init", r);
+        // New process gets EPIPE and exits.
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        return;
+    }
+    if ((r = uv_poll_start(&upgrade_poll, UV_READABLE, on_upgrade_ready)) < 0) {
+        pruv::log_uv_err(LOG_ERR, "uv_poll_start", r);
+        return close_upgrade_poll();
+    }
+    uv_unref((uv_handle_t *)&upgrade_poll);
+    upgrade_pid = pid;
+    pruv_log(LOG_NOTICE, "Started process %d for upgrade", pid);
+}
+
+void on_stop_async(uv_async_t *handle)
+{
+    dispatcher_thread *t = reinterpret_cast<dispatcher_thread *>(handle->data);
+    if (t->stopped)
+        return;
+    if (t->stop) {
+        t->stopped = true;
+        return t->dispatcher->stop();
+    }
+    if (t->drain.exchange(false))
+        t->dispatcher->drain();
+}
+
+void run_dispatcher_thread(void *arg)
+{
+    dispatcher_thread *t = reinterpret_cast<dispatcher_thread *>(arg);
+    uv_run(&t->loop, UV_RUN_DEFAULT);
+    // Dispatcher can't be stopped after exit from loop.
+    t->stopped = true;
+    t->dispatcher->on_loop_exit();
+}
+
+/// Must be called only when loop of t is not running anymore.
+void close_dispatcher_thread(dispatcher_thread *t) noexcept
+{
+    uv_close((uv_handle_t *)&t->stop_async, nullptr);
+    // Do one loop iteration to remove async handle from loop.
+    uv_run(&t->loop, UV_RUN_NOWAIT);
+    int r;
+    if ((r = uv_loop_close(&t->loop)) < 0)
+        pruv::log_uv_err(LOG_ERR, "uv_loop_close dispatcher loop", r);
+}
+
+/// Read up to n numbers from file. Returns number of read values.
+int read_longs(const char *path, long *v, int n) noexcept
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    int cnt = 0;
+    while (cnt < n && fscanf(f, "%ld", &v[cnt]) == 1)
+        ++cnt;
+    fclose(f);
+    return cnt;
+}
+
+/// Number of CPUs available to the process, limited by cgroup CPU quota.
+int available_cpus() noexcept
+{
+    int cpus = 1;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = std::max(1, CPU_COUNT(&set));
+    else
+        pruv_log_syserr(LOG_WARNING, "sched_getaffinity");
+
+    // cgroup v2 cpu.max contains "quota period" or "max period".
+    // cgroup v1 has quota (-1 if unlimited) and period in separate files.
+    long v[2] = {-1, 0};
+    if (read_longs("/sys/fs/cgroup/cpu.max", v, 2) != 2 &&
+        (read_longs("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", &v[0], 1) != 1 ||
+         read_longs("/sys/fs/cgroup/cpu/cpu.cfs_period_us", &v[1], 1) != 1))
+        v[0] = -1;
+    if (v[0] > 0 && v[1] > 0)
+        cpus = std::min<long>(cpus, (v[0] + v[1] - 1) / v[1]);
+    return cpus;
 }
 
 int parse_int_arg(const char *s, const char *optname)
@@ -51,14 +346,57 @@ int parse_int_arg(const char *s, const char *optname)
 int main(int argc, char * const *argv)
 {
     uv_disable_stdio_inheritance();
+    main_argv = argv;
+    exe_path = resolve_exe(argv[0]);
 
     int daemon_or_worker = 0;
     int disable_timeouts = 0;
     int log_level = LOG_INFO;
     int log_locations = 1;
     const char *listen_addr = "::";
+    // Inherited listening sockets. ip:port isn't used if any.
+    std::vector<int> listen_fds;
+    // Write end of upgrade pipe of process which started this one.
+    int ready_fd = -1;
     int listen_port = 8000;
-    int workers_num = 1;
+    int workers_num = 0;
+    int workers_min = 0;
+    int workers_spare = 0;
+    int worker_idle_timeout = 0;
+    int dispatcher_threads = 1;
+    int ring_transport = 0;
+    int zygote = 0;
+    int memfd_buffers = 0;
+    int registered_buffers = 0;
+    int worker_buffers = 0;
+    int arena_slots = 0;
+    int arena_request_mb = 4;
+    int arena_response_mb = 64;
+    int inline_threshold = 4096;
+    int buffer_pool_mb = 64;
+    int buffers_max = 0;
+    int buffers_mb = 0;
+    int prefault_request_buffers = 0;
+    int prefault_response_buffers = 0;
+    int huge_pages = 0;
+    int contiguous_mb = 0;
+    int worker_queue_depth = 1;
+    int request_batch = 1;
+    int use_sendfile = 0;
+    int io_uring_entries = 0;
+    int io_uring_sqpoll = 0;
+    int drain_timeout = 30;
+    pruv::socket_options sock_opts;
+    int listen_backlog = sock_opts.backlog;
+    int defer_accept = 0;
+    int tcp_fastopen = 0;
+    int tcp_nodelay = 0;
+    int notsent_lowat = 0;
+    int busy_poll = 0;
+    int keepalive = 0;
+    int keepalive_idle = sock_opts.keepalive_idle;
+    int keepalive_interval = sock_opts.keepalive_interval;
+    int keepalive_cnt = sock_opts.keepalive_cnt;
     const char *worker_exe = argv[0];
     std::vector<const char *> worker_args;
     const option opts[] = {
@@ -68,8 +406,48 @@ int main(int argc, char * const *argv)
         {"loglevel", required_argument, &log_level, LOG_INFO},
         {"nologlocations", no_argument, &log_locations, 0},
         {"listen-addr", required_argument, nullptr, 1},
+        {"listen-fd", required_argument, nullptr, 4},
+        {"ready-fd", required_argument, &ready_fd, 1},
         {"listen-port", required_argument, &listen_port, 8000},
         {"workers-num", required_argument, &workers_num, 1},
+        {"workers-min", required_argument, &workers_min, 1},
+        {"workers-spare", required_argument, &workers_spare, 1},
+        {"worker-idle-timeout", required_argument, &worker_idle_timeout, 1},
+        {"dispatcher-threads", required_argument, &dispatcher_threads, 1},
+        {"ring-transport", no_argument, &ring_transport, 1},
+        {"zygote", no_argument, &zygote, 1},
+        {"memfd-buffers", no_argument, &memfd_buffers, 1},
+        {"registered-buffers", no_argument, &registered_buffers, 1},
+        {"worker-buffers", no_argument, &worker_buffers, 1},
+        {"arena-slots", required_argument, &arena_slots, 1},
+        {"arena-request-mb", required_argument, &arena_request_mb, 1},
+        {"arena-response-mb", required_argument, &arena_response_mb, 1},
+        {"inline-threshold", required_argument, &inline_threshold, 1},
+        {"buffer-pool-mb", required_argument, &buffer_pool_mb, 1},
+        {"buffers-max", required_argument, &buffers_max, 1},
+        {"buffers-mb", required_argument, &buffers_mb, 1},
+        {"prefault-request-buffers", required_argument,
+            &prefault_request_buffers, 1},
+        {"prefault-response-buffers", required_argument,
+            &prefault_response_buffers, 1},
+        {"huge-pages", no_argument, &huge_pages, 1},
+        {"contiguous-buffers-mb", required_argument, &contiguous_mb, 1},
+        {"worker-queue-depth", required_argument, &worker_queue_depth, 1},
+        {"request-batch", required_argument, &request_batch, 1},
+        {"sendfile", no_argument, &use_sendfile, 1},
+        {"io-uring-entries", required_argument, &io_uring_entries, 1},
+        {"io-uring-sqpoll", no_argument, &io_uring_sqpoll, 1},
+        {"drain-timeout", required_argument, &drain_timeout, 1},
+        {"listen-backlog", required_argument, &listen_backlog, 1},
+        {"defer-accept", required_argument, &defer_accept, 1},
+        {"tcp-fastopen", required_argument, &tcp_fastopen, 1},
+        {"tcp-nodelay", no_argument, &tcp_nodelay, 1},
+        {"notsent-lowat", required_argument, &notsent_lowat, 1},
+        {"busy-poll", required_argument, &busy_poll, 1},
+        {"keepalive", no_argument, &keepalive, 1},
+        {"keepalive-idle", required_argument, &keepalive_idle, 1},
+        {"keepalive-interval", required_argument, &keepalive_interval, 1},
+        {"keepalive-count", required_argument, &keepalive_cnt, 1},
         {"worker-executable", required_argument, nullptr, 2},
         {"worker-arg", required_argument, nullptr, 3},
         {0, 0, nullptr, 0}
@@ -90,6 +468,8 @@ int main(int argc, char * const *argv)
             worker_exe = optarg;
         else if (c == 3)
             worker_args.push_back(optarg);
+        else if (c == 4)
+            listen_fds.push_back(parse_int_arg(optarg, "listen-fd"));
         else if (c != '?') {
             pruv_log(LOG_EMERG, "Unknown option");
             exit(EXIT_FAILURE);
@@ -100,6 +480,25 @@ int main(int argc, char * const *argv)
         log_level);
     pruv::log_setup_locations(log_locations);
 
+    if (daemon_or_worker != 2) {
+        // Sockets passed by systemd socket activation. LISTEN_PID is
+        // checked, so it must be called before fork.
+        int n = sd_listen_fds(1);
+        if (n < 0) {
+            errno = -n;
+            pruv_log_syserr(LOG_ERR, "sd_listen_fds");
+        }
+        for (int i = 0; i < n; ++i)
+            listen_fds.push_back(SD_LISTEN_FDS_START + i);
+    }
+    for (int fd : listen_fds) {
+        if (sd_is_socket(fd, AF_UNSPEC, SOCK_STREAM, 1) <= 0) {
+            pruv_log(LOG_EMERG, "Descriptor %d isn't listening stream socket",
+                    fd);
+            return EXIT_FAILURE;
+        }
+    }
+
     if (daemon_or_worker == 2) {
         int r = pruv::worker_loop::setup(argc, argv);
         if (r)
@@ -141,46 +540,181 @@ int main(int argc, char * const *argv)
     }
 
     int r;
-    uv_loop_t loop;
-    if ((r = uv_loop_init(&loop)) < 0) {
-        pruv::log_uv_err(LOG_EMERG, "uv_loop_init main loop", r);
+    dispatcher_threads = std::max(1, dispatcher_threads);
+    if (workers_num <= 0) {
+        workers_num = available_cpus();
+        pruv_log(LOG_INFO, "Use %d workers.", workers_num);
+    }
+    if (dispatcher_threads > workers_num) {
+        // Each dispatcher needs at least one worker.
+        pruv_log(LOG_WARNING, "Use %d dispatcher threads for %d workers.",
+                workers_num, workers_num);
+        dispatcher_threads = workers_num;
+    }
+    if (listen_fds.size() > (size_t)dispatcher_threads) {
+        // Each dispatcher listens on one socket.
+        pruv_log(LOG_EMERG, "%d inherited sockets for %d dispatcher threads. "
+                "Use --dispatcher-threads=%d.", (int)listen_fds.size(),
+                dispatcher_threads, (int)listen_fds.size());
         return EXIT_FAILURE;
     }
+    for (int i = 0; i < dispatcher_threads; ++i) {
+        dispatchers.emplace_back(new (std::nothrow) dispatcher_thread);
+        dispatcher_thread *t = dispatchers.back().get();
+        if (!t) {
+            pruv_log(LOG_EMERG, "No memory for dispatcher thread.");
+            return EXIT_FAILURE;
+        }
+        if ((r = uv_loop_init(&t->loop)) < 0) {
+            pruv::log_uv_err(LOG_EMERG, "uv_loop_init dispatcher loop", r);
+            return EXIT_FAILURE;
+        }
+        if ((r = uv_async_init(&t->loop, &t->stop_async, on_stop_async)) < 0) {
+            pruv::log_uv_err(LOG_EMERG, "uv_async_init", r);
+            return EXIT_FAILURE;
+        }
+        t->stop_async.data = t;
+        uv_unref((uv_handle_t *)&t->stop_async);
+    }
+    uv_loop_t &loop = dispatchers.front()->loop;
+    // 0 seconds disables draining by signals. Upgrade still drains,
+    // limited only by connection timeouts.
+    stop_at_once = drain_timeout <= 0;
 
-    uv_signal_t sig[3];
-    int signum[3] = {SIGTERM, SIGINT, SIGHUP};
-    for (size_t i = 0; i < sizeof(sig) / sizeof(*sig); ++i)
+    uv_signal_t sig[4];
+    int signum[4] = {SIGTERM, SIGINT, SIGHUP, SIGCHLD};
+    uv_signal_cb sigcb[4] = {stop_handler, stop_handler, upgrade_handler,
+        reap_upgrade_children};
+    for (size_t i = 0; i < sizeof(sig) / sizeof(*sig); ++i) {
+        std::string handler = std::string(strsignal(signum[i])) + " handler";
         if ((r = uv_signal_init(&loop, &sig[i])) < 0) {
-            pruv::log_uv_err(LOG_ERR, "uv_signal_init SIGTERM handler", r);
+            pruv::log_uv_err(LOG_ERR, ("uv_signal_init " + handler).c_str(), r);
             uv_close((uv_handle_t *)&sig[i], nullptr);
         }
-        else if ((r = uv_signal_start(&sig[i], stop_handler, signum[i])) < 0) {
-            pruv::log_uv_err(LOG_ERR, "uv_signal_start SIGTERM handler", r);
+        else if ((r = uv_signal_start(&sig[i], sigcb[i], signum[i])) < 0) {
+            pruv::log_uv_err(LOG_ERR, ("uv_signal_start " + handler).c_str(),
+                    r);
             uv_close((uv_handle_t *)&sig[i], nullptr);
         }
         else
             uv_unref((uv_handle_t *)&sig[i]);
+    }
 
-    dispatcher.reset(new pruv::http_pipelining_dispatcher);
-    if (disable_timeouts)
-        dispatcher->set_timeouts(!disable_timeouts);
-    dispatcher->start(&loop, listen_addr, listen_port,
-            workers_num, worker_exe, worker_args.data());
+    sock_opts.backlog = std::max(1, listen_backlog);
+    sock_opts.reuse_port = dispatcher_threads > 1;
+    sock_opts.defer_accept = std::max(0, defer_accept);
+    sock_opts.fastopen = std::max(0, tcp_fastopen);
+    sock_opts.nodelay = tcp_nodelay;
+    sock_opts.notsent_lowat = std::max(0, notsent_lowat);
+    sock_opts.busy_poll = std::max(0, busy_poll);
+    sock_opts.keepalive = keepalive;
+    sock_opts.keepalive_idle = std::max(1, keepalive_idle);
+    sock_opts.keepalive_interval = std::max(1, keepalive_interval);
+    sock_opts.keepalive_cnt = std::max(1, keepalive_cnt);
 
-    uv_run(&loop, UV_RUN_DEFAULT);
+    // Workers are divided between dispatchers.
+    for (int i = 0; i < dispatcher_threads; ++i) {
+        dispatcher_thread *t = dispatchers[i].get();
+        int thread_workers = workers_num / dispatcher_threads +
+            (i < workers_num % dispatcher_threads);
+        int thread_min = workers_min / dispatcher_threads +
+            (i < workers_min % dispatcher_threads);
+        t->dispatcher.reset(new pruv::http_pipelining_dispatcher);
+        if (disable_timeouts)
+            t->dispatcher->set_timeouts(!disable_timeouts);
+        t->dispatcher->set_socket_options(sock_opts);
+        t->dispatcher->set_drain_timeout(std::max(0, drain_timeout) * 1000u);
+        if (!listen_fds.empty()) {
+            // Extra dispatchers share inherited sockets by duplicates.
+            int fd = listen_fds[i % listen_fds.size()];
+            if (i >= (int)listen_fds.size() &&
+                (fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+                pruv_log_syserr(LOG_EMERG, "fcntl(F_DUPFD_CLOEXEC)");
+                return EXIT_FAILURE;
+            }
+            t->dispatcher->set_listen_fd(fd);
+        }
+        t->dispatcher->set_ring_transport(ring_transport);
+        t->dispatcher->set_zygote(zygote);
+        t->dispatcher->set_memfd_buffers(memfd_buffers);
+        t->dispatcher->set_registered_buffers(registered_buffers);
+        t->dispatcher->set_worker_buffers(worker_buffers);
+        t->dispatcher->set_buffer_arena(arena_slots,
+                (size_t)arena_request_mb << 20,
+                (size_t)arena_response_mb << 20);
+        t->dispatcher->set_inline_threshold(inline_threshold);
+        t->dispatcher->set_buffer_pool_limit(
+                (size_t)std::max(0, buffer_pool_mb) << 20);
+        t->dispatcher->set_buffer_budget(std::max(0, buffers_max),
+                (size_t)std::max(0, buffers_mb) << 20);
+        t->dispatcher->set_buffer_prefault(
+                std::max(0, prefault_request_buffers),
+                std::max(0, prefault_response_buffers), huge_pages);
+        t->dispatcher->set_contiguous_buffers(
+                (size_t)std::max(0, contiguous_mb) << 20);
+        t->dispatcher->set_worker_queue_depth(std::max(1, worker_queue_depth));
+        t->dispatcher->set_request_batch(std::max(1, request_batch));
+        t->dispatcher->set_sendfile(use_sendfile);
+        t->dispatcher->set_io_uring(std::max(0, io_uring_entries),
+                io_uring_sqpoll);
+        // Each dispatcher keeps its own spare workers.
+        t->dispatcher->set_workers_pool(thread_min, workers_spare,
+                worker_idle_timeout * 1000u);
+        t->dispatcher->start(&t->loop, listen_addr, listen_port,
+                std::max(1, thread_workers), worker_exe, worker_args.data());
+        t->listen_fd = t->dispatcher->listen_socket();
+    }
 
-    dispatcher->on_loop_exit();
+    if (ready_fd != -1) {
+        // Process which started this one drains when all dispatchers
+        // listen. Otherwise it gets EOF and keeps accepting connections.
+        bool ready = true;
+        for (auto &t : dispatchers)
+            ready &= (t->listen_fd != -1);
+        pid_t pid = getpid();
+        if (ready && write(ready_fd, &pid, sizeof(pid)) != sizeof(pid))
+            pruv_log_syserr(LOG_ERR, "write ready descriptor");
+        close(ready_fd);
+    }
 
-    for (uv_signal_t & sigi : sig) {
-        if ((r = uv_signal_stop(&sigi)) < 0)
-            pruv::log_uv_err(LOG_ERR, "uv_signal_stop in SIGTERM handler", r);
-        uv_close((uv_handle_t *)&sigi, nullptr);
+    for (int i = 1; i < dispatcher_threads; ++i) {
+        dispatcher_thread *t = dispatchers[i].get();
+        if ((r = uv_thread_create(&t->tid, run_dispatcher_thread, t)) < 0) {
+            pruv::log_uv_err(LOG_EMERG, "uv_thread_create", r);
+            stop_dispatchers();
+            break;
+        }
+        t->thread_started = true;
     }
-    // Do one loop iteration to remove sigterm handler from loop.
-    uv_run(&loop, UV_RUN_NOWAIT);
 
-    if ((r = uv_loop_close(&loop)) < 0)
-        pruv::log_uv_err(LOG_ERR, "uv_loop_close main loop", r);
+    run_dispatcher_thread(dispatchers.front().get());
+
+    // Signals not handled anymore. If main dispatcher stopped not by signal,
+    // other dispatchers must be stopped too. Drained ones stop themselves.
+    if (!draining)
+        stop_dispatchers();
+    for (int i = 1; i < dispatcher_threads; ++i) {
+        dispatcher_thread *t = dispatchers[i].get();
+        if (!t->thread_started)
+            // Thread was not created. Finish its loop here.
+            run_dispatcher_thread(t);
+        else if ((r = uv_thread_join(&t->tid)) < 0)
+            pruv::log_uv_err(LOG_ERR, "uv_thread_join", r);
+    }
+
+    for (size_t i = 0; i < sizeof(sig) / sizeof(*sig); ++i) {
+        if ((r = uv_signal_stop(&sig[i])) < 0) {
+            std::string msg = std::string("uv_signal_stop of ") +
+                strsignal(signum[i]) + " handler";
+            pruv::log_uv_err(LOG_ERR, msg.c_str(), r);
+        }
+        uv_close((uv_handle_t *)&sig[i], nullptr);
+    }
+    if (upgrade_fd != -1)
+        close_upgrade_poll();
+    // Signal handles removed from loop in close_dispatcher_thread().
+    for (auto &t : dispatchers)
+        close_dispatcher_thread(t.get());
 
     if (daemon_or_worker == 1)
         pruv_log(LOG_NOTICE, "Daemon stopped.");
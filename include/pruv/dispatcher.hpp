@@ -11,8 +11,11 @@
 
 #include <pruv/process.hpp>
 #include <pruv/shmem_buffer.hpp>
+#include <pruv/shmem_ring.hpp>
 #include <pruv/tcp_con.hpp>
 #include <pruv/tcp_server.hpp>
+#include <pruv/uring.hpp>
+#include <pruv/worker_protocol.hpp>
 
 namespace pruv {
 
@@ -29,19 +32,222 @@ class dispatcher {
 public:
     virtual ~dispatcher();
     void set_timeouts(bool enable) noexcept;
+    /// Bind listening socket with SO_REUSEPORT. Must be called before start.
+    /// Allows to run several dispatchers (each in its own thread and loop)
+    /// on the same ip:port. Kernel balances connections between them.
+    void set_reuse_port(bool enable) noexcept;
+    /// Connections not drained in timeout milliseconds are closed by stop()
+    /// (see drain()). 0 waits for them without limit, they're still closed
+    /// by connection timeouts.
+    void set_drain_timeout(unsigned timeout) noexcept;
+    /// Options of listening socket and accepted connections. Replaces
+    /// set_reuse_port(). Must be called before start.
+    void set_socket_options(const socket_options &opts) noexcept;
+    /// Listen on inherited socket fd (for example, from systemd socket
+    /// activation) instead of binding ip:port passed to start. Connections
+    /// are queued by kernel while dispatcher starts. Dispatcher owns fd.
+    /// -1 disables. Must be called before start.
+    void set_listen_fd(int fd) noexcept;
+    /// Send requests and receive responses through rings in shared memory
+    /// instead of pipes. Must be called before start.
+    void set_ring_transport(bool enable) noexcept;
+    /// Maximum number of requests sent to one worker without waiting for
+    /// responses. Requests are queued to busy workers only when all workers
+    /// are busy and no more workers can be spawned. Must be called before
+    /// start.
+    void set_worker_queue_depth(size_t depth) noexcept;
+    /// Send up to max (at most 16) waiting requests to one worker in one
+    /// write, when there is no idle worker. Worker handles
+    /// them by worker_loop::handle_batch(). Limited by queue depth. Must be
+    /// called before start.
+    void set_request_batch(size_t max) noexcept;
+    /// workers_min workers are spawned at start and always kept running.
+    /// spare idle workers are kept ready ahead of demand. Workers idle longer
+    /// than idle_timeout milliseconds are terminated, unless they are needed
+    /// for workers_min or spare (0 disables). All limited by workers_max.
+    /// Must be called before start.
+    void set_workers_pool(size_t workers_min, size_t spare,
+            unsigned idle_timeout) noexcept;
+    /// Number of running and starting workers.
+    size_t workers_count() const noexcept { return workers_cnt; }
+    /// Create buffers with memfd_create() instead of named POSIX shared memory
+    /// objects. Buffers' descriptors are passed to workers through unix
+    /// socket and requests refer to buffers by ids. Nothing is left in
+    /// /dev/shm if dispatcher crashes. Must be called before start.
+    void set_memfd_buffers(bool enable) noexcept;
+    /// Register named buffers with workers by descriptors as memfd buffers
+    /// are. Requests refer to them by ids, so workers neither hash names nor
+    /// shm_open them. Must be called before start.
+    void set_registered_buffers(bool enable) noexcept;
+    /// Binary workers allocate response buffers themselves and pass their
+    /// descriptors once. Dispatcher writes response from worker's buffer and
+    /// gives it back. No response buffer is taken for a request, so workers
+    /// don't wait for dispatcher's buffers. Must be called before start.
+    void set_worker_buffers(bool enable) noexcept;
+    /// Carve buffers out of arena segments. Segment is memfd object split
+    /// into slots buffers, which is mapped once by dispatcher and by each
+    /// worker. Taking buffer doesn't make syscalls, but request and response
+    /// buffers can't grow beyond req_capacity and resp_capacity bytes.
+    /// 0 slots disables arena. Must be called before start.
+    void set_buffer_arena(size_t slots, size_t req_capacity,
+            size_t resp_capacity) noexcept;
+    /// Requests and responses not larger than bytes travel inside request
+    /// and response frames instead of shared memory buffers. Used only with
+    /// workers accepting binary frames. 0 disables. Limited by
+    /// RESPONSE_CHUNK. Must be called before start.
+    void set_inline_threshold(size_t bytes) noexcept;
+    /// Free buffers keep their grown size and are reused by size classes.
+    /// When free buffers hold more than bytes of memory, memory of the least
+    /// recently used ones is released beyond their first chunk. Memory of
+    /// buffers free for a timer period is released too. Must be called
+    /// before start.
+    void set_buffer_pool_limit(size_t bytes) noexcept;
+    /// Limit number (and so descriptors) and total size of request buffers
+    /// and of response buffers. Sizes of used buffers are known when
+    /// they're taken and returned. Free buffers are closed to fit into the
+    /// budget and after BUFFER_IDLE_TIMEOUT of not using. When budget is
+    /// exhausted, requests wait for response buffers in scheduling queue
+    /// (up to SCHEDULING_TIMEOUT) and connections without request buffer
+    /// stop reading until one is returned. 0 disables limit.
+    /// Must be called before start.
+    void set_buffer_budget(size_t max_buffers, size_t max_bytes) noexcept;
+    /// Create req_cnt request and resp_cnt response buffers at start with
+    /// memory allocated and mapped in advance, so the first requests don't
+    /// page fault. Workers map such buffers with MAP_POPULATE. These
+    /// buffers aren't closed as idle. huge_pages advises transparent huge
+    /// pages for arena segments (needs shmem_enabled=advise in
+    /// /sys/kernel/mm/transparent_hugepage and slots of 2 MB multiple).
+    /// Must be called before start.
+    void set_buffer_prefault(size_t req_cnt, size_t resp_cnt,
+            bool huge_pages) noexcept;
+    /// Map buffers contiguously in reserved reserve bytes of address space
+    /// instead of sliding windows of REQUEST_CHUNK and RESPONSE_CHUNK (see
+    /// shmem_buffer::set_contiguous()). Buffers can't grow beyond reserve.
+    /// Workers map memfd buffers the same way. Arena buffers are contiguous
+    /// anyway. 0 disables. Must be called before start.
+    void set_contiguous_buffers(size_t reserve) noexcept;
+    /// Write responses larger than RESPONSE_CHUNK by sendfile() from
+    /// buffer's descriptor instead of copying them from mapping. Socket
+    /// refers to buffer's pages, so buffer isn't reused until peer
+    /// acknowledges its data. Data is passed to parse_response() by mapped
+    /// windows before it's sent. Must be called before start.
+    void set_sendfile(bool enable) noexcept;
+    /// Write connections through io_uring with entries submission entries
+    /// instead of libuv. Writes made during loop iteration are submitted by
+    /// one syscall, with sqpoll by kernel thread without syscalls.
+    /// Connections are still accepted and read by libuv. libuv writes are
+    /// used if io_uring isn't available. Writes into one connection aren't
+    /// ordered by io_uring, so large responses are written by one window at
+    /// a time without double-buffering. 0 entries disables. Must be called
+    /// before start.
+    void set_io_uring(unsigned entries, bool sqpoll) noexcept;
+    /// Number of pages faulted in by prefaulting buffers at start.
+    size_t prefaulted_pages() const noexcept { return prefaulted; }
+    /// Number of connection writes of several ready responses.
+    size_t gathered_writes() const noexcept { return gathered_cnt; }
+    /// Number of responses written by double-buffered windows.
+    size_t streamed_responses() const noexcept { return streamed_cnt; }
+    /// Number of bytes written by sendfile().
+    size_t sendfile_bytes() const noexcept { return sendfile_sent; }
+    /// Number of connection writes made through io_uring.
+    size_t uring_sent() const noexcept { return uring_cnt; }
+    /// Spawn one zygote worker, which warms up once and forks all other
+    /// workers. Workers share warmed up state through copy-on-write memory
+    /// and start faster. Workers are spawned directly if zygote fails to
+    /// start. Must be called before start.
+    void set_zygote(bool enable) noexcept;
     /// new_loop, worker_name and worker_args must be valid until stop called.
     void start(uv_loop_t *new_loop, const char *ip, int port,
             size_t workers_max, const char *worker_name,
             const char * const *worker_args) noexcept;
     void stop() noexcept;
+    /// Stop accepting connections and close idle ones. Other connections
+    /// are closed after their current responses are written, instead of
+    /// waiting for next requests. Requests sent to workers while draining
+    /// have CMD_F_CLOSE. Dispatcher stops itself when no connections are
+    /// left or when drain timeout expires. stop() can be called during
+    /// draining.
+    void drain() noexcept;
+    /// Listening socket descriptor or -1. Valid between start and stop or
+    /// drain. Can be passed to another process to continue accepting
+    /// connections queued on it.
+    int listen_socket() noexcept { return server.fileno(); }
     /// Stop timer.
     void on_loop_exit() noexcept;
 
+protected:
+    class tcp_context;
+
 private:
-    struct shmem_buffer_node : shmem_buffer, auto_unlink_hook {};
+    /// Memfd object split into slots for buffers (set_buffer_arena()).
+    struct arena_segment : auto_unlink_hook {
+        ~arena_segment();
+        int fd = -1;
+        char *region = nullptr;
+        size_t size = 0;
+        size_t slot_size = 0;
+        size_t slots_cnt = 0;
+        /// Stack of free slots.
+        std::unique_ptr<uint32_t[]> free_slots;
+        size_t free_cnt = 0;
+        bool for_req = false;
+        /// Buffer id and generation.
+        uint32_t id = 0;
+        uint32_t gen = 0;
+    };
 
+    struct buffer_pool;
     struct worker_process;
 
+    struct shmem_buffer_node : shmem_buffer, auto_unlink_hook {
+        /// Name for text requests.
+        const char * ref_name() const noexcept { return gen ? ref : name(); }
+        /// Id and generation of memfd or registered named buffer or of arena
+        /// segment (see worker_protocol.hpp). gen is 0 for not registered
+        /// named buffer.
+        uint32_t id = 0;
+        uint32_t gen = 0;
+        /// Segment and slot of arena buffer.
+        arena_segment *segment = nullptr;
+        uint32_t slot = 0;
+        /// "#<id>.<gen>" or "#<id>.<gen>.<slot>"
+        char ref[40];
+        /// Bytes of memory, which free buffer may hold.
+        size_t resident = 0;
+        /// Time of returning into pool.
+        uint64_t returned_at = 0;
+        /// Pool, whose budget the buffer is accounted in, and accounted size.
+        buffer_pool *pool = nullptr;
+        size_t accounted = 0;
+        /// Buffer is worker's own. It's given back to owner instead of pool.
+        /// owner is nullptr after worker's exit.
+        bool foreign = false;
+        worker_process *owner = nullptr;
+        /// Connection, which sent the buffer by sendfile(), and its
+        /// sent_bytes after the buffer. Socket refers to buffer's pages
+        /// until they're acknowledged.
+        tcp_context *sender = nullptr;
+        uint64_t ack_end = 0;
+    };
+
+    static constexpr size_t BUFFER_CLASSES = 6;
+    /// Free buffers. Class i holds buffers of at least chunk << 2 * i bytes.
+    /// Each class is sorted by return time, recently returned first.
+    struct buffer_pool {
+        list<shmem_buffer_node> classes[BUFFER_CLASSES];
+        /// Sum of resident of all buffers.
+        size_t resident = 0;
+        /// Number and accounted size of free and used buffers.
+        size_t count = 0;
+        size_t bytes = 0;
+        /// Buffer wasn't given because of budget.
+        bool exhausted = false;
+        /// Number of buffers not closed as idle.
+        size_t reserved = 0;
+    };
+
+    struct worker_task;
+
 protected:
     /// Buffered tcp connection
     class tcp_context : private tcp_con, public auto_unlink_hook {
@@ -83,6 +289,7 @@ protected:
 
         bool read_start();
         using tcp_con::read_stop;
+        using tcp_con::fileno;
 
     private:
         friend dispatcher;
@@ -95,15 +302,46 @@ protected:
 
         /// Buffer for reading request.
         shmem_buffer_node *read_buffer = nullptr;
+        /// Reading is stopped until request buffer is returned into pool.
+        bool read_paused = false;
         /// Buffers with responses.
         list<shmem_buffer_node> resp_buffers;
-        /// Worker processing last request. On EOF there is no need to stop it,
-        /// but its result must be ignored. Stored in connection to break
-        /// reference worker->processed_con on EOF received.
-        worker_process *worker = nullptr;
+        /// Worker's task processing last request. On EOF there is no need to
+        /// stop worker, but its result must be ignored. Stored in connection
+        /// to break reference task->con on EOF received.
+        worker_task *task = nullptr;
         /// Parameters of last processed request
         request_meta request;
+        /// Size of previous response. Response buffer of this size is taken
+        /// for the next request.
+        size_t resp_size_hint = 0;
         uv_write_t write_req;
+        /// Number of response buffers and bytes in write_req.
+        size_t write_cnt = 0;
+        size_t write_bytes = 0;
+        /// Bytes written into socket.
+        uint64_t sent_bytes = 0;
+        /// Number of buffers sent by connection in unacked_buffers.
+        size_t unacked_cnt = 0;
+        /// Writes in io_uring. Closed connection is freed after them.
+        unsigned uring_writes = 0;
+        /// Response buffers of removed connection, which are returned after
+        /// its io_uring writes finish.
+        list<shmem_buffer_node> uring_held;
+        bool closed = false;
+        /// The last response in write_req is finished and connection must be
+        /// closed after it.
+        bool write_close = false;
+        /// Large response is written by windows of RESPONSE_CHUNK. Odd
+        /// windows are mapped in stream_buf and written by stream_req.
+        shmem_buffer stream_buf;
+        uv_write_t stream_req;
+        /// Offset of the next window and number of windows being written.
+        size_t stream_pos = 0;
+        unsigned stream_inflight = 0;
+        /// End of response part passed to parse_response() while it's sent
+        /// by sendfile().
+        size_t parsed_pos = 0;
         uint64_t timeout;
 
 #define LIST_ID_MAP(XX) \
@@ -129,39 +367,108 @@ protected:
     virtual void free_connection(tcp_context *con) noexcept = 0;
 
 private:
-    struct worker_process : public process, auto_unlink_hook {
-        /// Connection, whose request this worker process now.
-        /// It's needed because on exit connection must be closed.
-        tcp_context *processed_con = nullptr;
+    /// Request sent to worker. Index in worker's tasks is request's tag.
+    struct worker_task {
+        worker_process *worker = nullptr;
+        /// Connection, whose request this task is.
+        /// It's needed because on worker exit connection must be closed.
+        tcp_context *con = nullptr;
 
         /// Buffers with request and response.
         /// When connection closed, but worker still process request, buffers
-        /// can't be reused. Therefore buffers owned by worker for processing
+        /// can't be reused. Therefore buffers owned by task for processing
         /// time.
         shmem_buffer_node *in_buf = nullptr;
         shmem_buffer_node *out_buf = nullptr;
 
-        /// io_state used to protect single pipe_buf.
-        /// Buffer can be used for reading when IO_READ,
-        /// for writing when IO_WRITE, and can't be used when IO_IDLE.
-        /// Also it allows not stop polling pipe when worker has no work.
+        /// Request is written into pipe (TASK_WRITE) or waits response
+        /// (TASK_READ).
         enum {
-            IO_IDLE,
-            IO_READ,
-            IO_WRITE
-        } io_state = IO_IDLE;
-        /// Time when current operation must be finished.
+            TASK_FREE,
+            TASK_WRITE,
+            TASK_READ
+        } state = TASK_FREE;
+        /// Time when processing must be finished.
+        uint64_t timeout;
+
+        /// Binary request frame. Must be valid while writing into pipe.
+        request_cmd cmd;
+        /// Request for writing task into worker's pipe. Used by the first
+        /// task of batch.
+        uv_write_t write_req;
+        /// Next task written by the same write.
+        worker_task *batch_next = nullptr;
+    };
+
+    struct worker_process : public process, auto_unlink_hook {
+        ~worker_process();
+        /// Array of depth tasks.
+        std::unique_ptr<worker_task[]> tasks;
+        size_t depth = 0;
+        /// Number of tasks not in TASK_FREE state.
+        size_t inflight = 0;
+        /// Number of tasks in TASK_READ state. Pipe is read only when it's
+        /// not zero. Also it allows not stop polling pipe when worker has no
+        /// work.
+        size_t reading = 0;
+        /// Time when the oldest task must be finished.
         uint64_t timeout;
+        /// Time when worker became idle.
+        uint64_t idle_since;
 
-        /// Buffer for request to worker and for response from it.
+        /// Worker accepts binary request frames. Known from CMD_READY.
+        /// Only one text request can be sent at a time.
+        bool binary = false;
+        /// Buffer for text request to worker and for responses from it.
         char pipe_buf[256];
         /// Pointer inside to pipe_buf for reading response by chunks.
         char *pipe_buf_ptr = pipe_buf;
-        /// Request for writing task into worker's pipe.
-        uv_write_t write_req;
+        /// Inline response, which data is being read from pipe directly into
+        /// out buffer of the task.
+        response_cmd inline_cmd;
+        char *inline_ptr = nullptr;
+        size_t inline_left = 0;
+        /// Rings for requests and responses. Not opened if ring transport
+        /// disabled.
+        ring_channel ring;
+        /// Polls ring.resp_efd. Initialized if ring opened.
+        uv_poll_t ring_poll;
+        /// Ring setup frame was sent. Requests are sent through ring.
+        bool ring_active = false;
+        /// Ring setup frame. Must be valid while writing into pipe.
+        ring_setup_cmd ring_setup;
         /// Because waitpid() called before on_worker_exit(), it's must be
         /// stored that kill is not allowed inside on_worker_exit().
         bool exited = false;
+        /// kill_worker() was called.
+        bool killed = false;
+        /// Worker sent ready frame.
+        bool ready = false;
+        /// Cookie of fork request if worker is forked by zygote, else 0.
+        uint64_t cookie = 0;
+        /// Socket for passing descriptors of memfd buffers. Nonblocking.
+        /// Closed in destructor.
+        int buf_sock = -1;
+        /// Generations of buffers passed to worker indexed by buffer id.
+        std::unique_ptr<uint32_t[]> buf_sent_gen;
+        size_t buf_sent_cnt = 0;
+        /// Worker's own response buffers indexed by their ids.
+        std::unique_ptr<shmem_buffer_node *[]> own_bufs;
+        size_t own_bufs_cnt = 0;
+    };
+
+    /// Fork server of workers (set_zygote()). Its exit is watched by libuv.
+    /// Forked workers are its children, so their pids and exits are reported
+    /// through control socket.
+    struct zygote_process : public process {
+        ~zygote_process();
+        /// Control socket. Nonblocking. Closed in destructor.
+        int ctl_fd = -1;
+        /// Polls ctl_fd. Closed in on_zygote_exit with process::close_cb.
+        /// data is set if initialized.
+        uv_poll_t ctl_poll = {};
+        /// stop_zygote() was called.
+        bool terminated = false;
     };
 
     /// Start listening ip:port and initialize callbacks for accepting.
@@ -169,10 +476,35 @@ private:
     /// Stop listening.
     void stop_server() noexcept;
 
-    /// Spawn worker process and put it into free_workers list.
+    /// Spawn worker process and put it into starting_workers list.
     void spawn_worker() noexcept;
+    /// Ask zygote to fork worker with inherit_fds placed from descriptor 3.
+    /// -1 in inherit_fds leaves descriptor closed.
+    /// Has the same semantic of failure as process::start().
+    bool fork_worker(worker_process *w, const int *inherit_fds,
+            size_t inherit_cnt, void (*deleter)(void *)) noexcept;
+    /// Spawn zygote process. Sets zygote on success.
+    bool start_zygote() noexcept;
+    /// Terminate zygote. It's called when all forked workers exited.
+    void stop_zygote() noexcept;
+    /// Handle replies and exit notifications from zygote.
+    void on_zygote_read() noexcept;
+    /// Forked workers are lost with zygote.
+    void on_zygote_exit(int64_t exit_code, int signal) noexcept;
+    /// Find worker in any list by predicate.
+    template<typename Pred>
+    worker_process * find_worker(Pred pred) noexcept;
+    /// Spawn workers up to workers_min and spare idle workers.
+    void spawn_spares() noexcept;
+    /// Terminate workers idle longer than worker_idle_timeout.
+    void reap_idle_workers() noexcept;
+    /// Take idle worker, spawn new one or take busy worker which can accept
+    /// one more request. Returns nullptr if there is no such worker.
+    worker_process * take_worker() noexcept;
     /// Kill worker and stop reading it's pipe. Worker must be in some list.
     void kill_worker(worker_process *w) noexcept;
+    /// Start polling responses ring of the worker.
+    bool start_ring_poll(worker_process *w) noexcept;
     /// Release resources used by worker and close waiting connection.
     void on_worker_exit(worker_process *w, int64_t exit_code, int signal)
         noexcept;
@@ -187,31 +519,110 @@ private:
     /// If inplace response can be done then respond with it
     /// else enqueue for scheduling request to worker.
     void respond_or_enqueue(tcp_context *con) noexcept;
-    /// Take one request and one worker and send request into worker.
+    /// Take one worker and send one or batch of requests into worker.
     void schedule() noexcept;
+    /// Connect the first waiting request with free task of worker and add
+    /// its frames to bufs. Returns nullptr if request isn't taken.
+    worker_task * prepare_request(worker_process &w, uv_buf_t *bufs,
+            size_t &bn) noexcept;
+    /// Tasks of batch wait for responses.
+    void on_requests_written(worker_task *batch) noexcept;
     /// Read response from workers stdout pipe and enqueue it for sending.
     void on_worker_read(worker_process *w, ssize_t nread, const uv_buf_t *buf)
         noexcept;
-    /// Write data from con->resp_buffers.front() into connection by chunks.
+    /// Worker finished initialization. Move it to free_workers. Flags are
+    /// of CMD_READY frame. Returns false if worker was killed.
+    bool on_worker_ready(worker_process *w, uint32_t flags) noexcept;
+    /// Read responses from workers ring.
+    void on_worker_ring(worker_process *w) noexcept;
+    /// Check inline response and return pointer for its data in out buffer
+    /// of the task. Kills worker and returns nullptr on error.
+    char * inline_response_dst(worker_process *w, const response_cmd &cmd)
+        noexcept;
+    /// Pass response to connection and schedule next request.
+    /// Returns false if worker was killed.
+    bool on_worker_response(worker_process *w, const response_cmd &cmd)
+        noexcept;
+    /// Write data from con->resp_buffers into connection by chunks. Ready
+    /// responses are gathered into one write up to WRITE_BYTES_MAX.
     void write_con(tcp_context *con) noexcept;
     /// Called after writing last chunk of response to connection.
     /// Prepares connection for reading next request.
     void on_end_write_con(tcp_context *con) noexcept;
+    /// Write front response, which is larger than RESPONSE_CHUNK, keeping
+    /// two windows in flight.
+    void stream_con(tcp_context *con) noexcept;
+    /// Map window at con->stream_pos into win and write it by req.
+    bool write_window(tcp_context *con, shmem_buffer &win, uv_write_t &req)
+        noexcept;
+    /// Write front response by sendfile() starting from its first window.
+    /// Returns false if buffer's file doesn't support sendfile().
+    bool sendfile_con(tcp_context *con) noexcept;
+    /// sendfile() front response from con->stream_pos until socket is full.
+    /// Each window is parsed before it's sent. Then the rest of page is
+    /// written from mapping and sending continues after it. The last page is
+    /// written from mapping too.
+    bool send_file(tcp_context *con) noexcept;
+    /// Return buffers sent by con (all connections if nullptr), whose data
+    /// is acknowledged. force returns all of them with released memory, so
+    /// pages still referred by socket aren't overwritten. Returns true if
+    /// exhausted response pool got a buffer.
+    bool return_acked(tcp_context *con, bool force) noexcept;
+    /// uv_write() into connection or its io_uring counterpart.
+    int write_stream(tcp_context *con, uv_write_t *req, const uv_buf_t bufs[],
+            unsigned nbufs, uv_write_cb cb) noexcept;
+    /// Called for finished io_uring write.
+    static void on_uring_write(uv_write_t *req, int status) noexcept;
+    /// Return fully written and finished front response buffer. Returns
+    /// false if connection must be closed.
+    bool return_written(tcp_context *con) noexcept;
 
     /// Remove connection from current list and push_back to specified.
     /// Update connections timeout.
     void move_to(tcp_context::list_id_enum dst, tcp_context *con) noexcept;
 
-    /// Take buffer from cache or create new.
-    shmem_buffer_node * get_buffer(bool for_req) noexcept;
+    /// Take buffer from cache or create new. Buffer has at least size_hint
+    /// bytes, if it's possible.
+    shmem_buffer_node * get_buffer(bool for_req, size_t size_hint = 0)
+        noexcept;
     /// Return buffer into cache. Remove buffer from its current list.
     void return_buffer(shmem_buffer_node &buf, bool for_req) noexcept;
+    /// Restart reading of connections paused without request buffer.
+    void resume_reads() noexcept;
     /// Return buffer into cache. Remove buffer from its current list.
     void return_buffer(shmem_buffer_node **buf, bool for_req) noexcept;
-    /// Close all shared memory objects in list and free memory.
+    /// Give worker's buffer back to its owner.
+    void release_worker_buffer(shmem_buffer_node &buf) noexcept;
+    /// Worker's buffer by id. Receives its descriptor if needed.
+    shmem_buffer_node * worker_buffer(worker_process *w, uint32_t id)
+        noexcept;
+    /// Receive one descriptor of worker's buffer from w->buf_sock.
+    bool recv_worker_buffer(worker_process *w) noexcept;
+    /// Pass descriptor of memfd buffer to worker if it's not passed yet.
+    bool send_buffer_fd(worker_process &w, const shmem_buffer_node &buf)
+        noexcept;
+    /// Allocate id and generation for memfd buffer or arena segment.
+    bool alloc_buffer_id(uint32_t &id, uint32_t &gen) noexcept;
+    /// Create arena segment and put it into arena_segments.
+    arena_segment * create_segment(bool for_req) noexcept;
+    /// Close arena segments without used slots.
+    void close_arena() noexcept;
+    /// Close buffer, release its id or slot and free memory.
+    void free_buffer(shmem_buffer_node *buf) noexcept;
+    /// Release memory of free buffers returned before idle_before and of the
+    /// least recently used buffers while pool holds more than limit bytes.
+    void trim_pool(buffer_pool &pool, bool for_req, size_t limit,
+            uint64_t idle_before) noexcept;
+    /// Close the least recently used free buffers while pool has more than
+    /// max_bytes and buffers returned before idle_before.
+    void reap_buffers(buffer_pool &pool, size_t max_bytes,
+            uint64_t idle_before) noexcept;
+    /// Close all shared memory objects in pool and free memory.
     /// Must be called only when there is no references to any buffer
-    /// in the buf_list.
-    void close_buffers(list<shmem_buffer_node> &buf_list) noexcept;
+    /// in the pool.
+    void close_buffers(buffer_pool &pool) noexcept;
+    /// Create, prefault and put into pool cnt buffers.
+    void prefault_buffers(bool for_req, size_t cnt) noexcept;
 
     bool start_timer() noexcept;
     void close_timer() noexcept;
@@ -225,19 +636,81 @@ private:
 
     static constexpr unsigned IDLE_TIMEOUT = 30'000;
     static constexpr unsigned IO_TIMEOUT = 10'000;
+    static constexpr unsigned SCHEDULING_TIMEOUT = 10'000;
     static constexpr unsigned PROCESSING_TIMEOUT = 10'000;
     static constexpr unsigned KILL_TIMEOUT = 10'000;
+    static constexpr unsigned READY_TIMEOUT = 30'000;
     static constexpr unsigned TIMER_PERIOD = 5'000;
+    /// Timer period while connections are drained.
+    static constexpr unsigned DRAIN_PERIOD = 100;
+    static constexpr unsigned DRAIN_TIMEOUT = 30'000;
+    static constexpr unsigned BUFFER_IDLE_TIMEOUT = 60'000;
+    static constexpr size_t RING_CAPACITY = 64 * 1024;
+    static constexpr size_t REQUEST_BATCH_MAX = 16;
+    /// Limits of one write of ready responses into connection.
+    static constexpr size_t WRITE_BUFS_MAX = 16;
+    static constexpr size_t WRITE_BYTES_MAX = 4 * RESPONSE_CHUNK;
+    /// Maximum number of write buffers for one request.
+    static constexpr size_t REQUEST_BUFS = 5;
 
     uv_loop_t *loop = nullptr;
     const char *worker_name = nullptr;
     const char * const *worker_args = nullptr;
     size_t workers_cnt = 0;
+    /// Number of workers in starting_workers.
+    size_t starting_cnt = 0;
     size_t workers_max = 0;
+    size_t worker_queue_depth = 1;
+    size_t request_batch = 1;
+    size_t workers_min = 0;
+    size_t workers_spare = 0;
+    unsigned worker_idle_timeout = 0;
     bool timeouts_enabled = true;
+    bool draining = false;
+    unsigned drain_timeout = DRAIN_TIMEOUT;
+    uint64_t drain_deadline = 0;
+    socket_options sock_opts;
+    int listen_fd = -1;
+    bool ring_transport = false;
+    bool zygote_enabled = false;
+    bool memfd_buffers = false;
+    bool registered_buffers = false;
+    bool worker_buffers = false;
+    bool use_sendfile = false;
+    unsigned uring_entries = 0;
+    bool uring_sqpoll = false;
+    size_t arena_slots = 0;
+    size_t arena_req_capacity = 0;
+    size_t arena_resp_capacity = 0;
+    size_t inline_threshold = 0;
+    size_t buffer_pool_limit = 64 << 20;
+    /// Budget of each pool. 0 is unlimited.
+    size_t buffers_max = 0;
+    size_t buffer_bytes_max = 0;
+    size_t contiguous_reserve = 0;
+    size_t prefault_req = 0;
+    size_t prefault_resp = 0;
+    bool huge_pages = false;
+    size_t prefaulted = 0;
+    size_t gathered_cnt = 0;
+    size_t streamed_cnt = 0;
+    size_t sendfile_sent = 0;
+    size_t uring_cnt = 0;
+    /// Generation of the last created memfd buffer.
+    uint32_t buf_gen = 0;
+    /// Number of allocated buffer ids.
+    uint32_t buf_ids_cnt = 0;
+    /// Stack of released buffer ids. Has capacity for all ids.
+    uint32_t *free_buf_ids = nullptr;
+    size_t free_buf_ids_cnt = 0;
+    /// Running zygote or nullptr.
+    zygote_process *zygote = nullptr;
+    /// Last cookie of fork request.
+    uint64_t fork_cookie = 0;
 
     tcp_server server;
     uv_timer_t timer;
+    uring uring_io;
 
     /// Connections in this list are inactive.
     list<tcp_context> clients_idle;
@@ -251,17 +724,26 @@ private:
     /// Connections may be readed and writed, but parsing stopped for its.
     list<tcp_context> clients_processing;
 
-    /// Idle workers without job.
+    /// Spawned workers, which haven't sent ready frame yet. Sorted by
+    /// timeout.
+    list<worker_process> starting_workers;
+    /// Idle workers without job. Sorted by idle_since.
     list<worker_process> free_workers;
-    /// Workers serving some request now.
+    /// Workers serving some requests now. Not sorted by timeout.
     list<worker_process> in_use_workers;
     /// Workers to which SIGTERM signal is sent.
     list<worker_process> terminated_workers;
 
     /// Free buffers for reading request.
-    list<shmem_buffer_node> req_bufs;
+    buffer_pool req_pool;
+    /// Number of connections with read_paused.
+    size_t paused_reads = 0;
     /// Free buffers for writing response.
-    list<shmem_buffer_node> resp_bufs;
+    buffer_pool resp_pool;
+    /// Response buffers written by sendfile() waiting for acknowledgement.
+    /// Sorted by sending time.
+    list<shmem_buffer_node> unacked_buffers;
+    list<arena_segment> arena_segments;
 };
 
 } // namespace pruv
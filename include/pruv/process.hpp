@@ -4,14 +4,29 @@
 
 #pragma once
 
+#include <cstddef>
+
 #include <uv.h>
 
 namespace pruv {
 
 struct process : uv_process_t {
     process() noexcept;
+    /// inherit_fds are duplicated into child starting from descriptor 3.
+    /// -1 leaves descriptor closed in child.
+    /// env replaces environment of the child if not null.
     bool start(uv_loop_t *loop, const char *file, const char * const *args,
-            void *owner, uv_exit_cb on_exit, void (*deleter)(void *)) noexcept;
+            void *owner, uv_exit_cb on_exit, void (*deleter)(void *),
+            const int *inherit_fds = nullptr, size_t inherit_cnt = 0,
+            const char * const *env = nullptr) noexcept;
+    /// Use process started by somebody else (e.g. forked by zygote).
+    /// in_fd and out_fd are pipes connected to its stdin and stdout. Ownership
+    /// of them is taken even on failure. pid may be set later. Owner must
+    /// watch for exit itself.
+    bool adopt(uv_loop_t *loop, int in_fd, int out_fd, void *owner,
+            void (*deleter)(void *)) noexcept;
+    /// Send signal to the process. Does nothing if pid is not known yet.
+    int send_signal(int signum) noexcept;
     void stop() noexcept;
     static void close_cb(uv_handle_t *handle) noexcept;
 
@@ -20,6 +35,8 @@ struct process : uv_process_t {
     uv_pipe_t out;
     int wait_close;
     void (*deleter)(void *);
+    /// Process was adopted. uv_process_t part is not initialized.
+    bool adopted;
 };
 
 } // namespace pruv
@@ -16,12 +16,39 @@ public:
     /// Open existing (if name not null) or create new (if name is null)
     /// shared memory object.
     bool open(const char *name, bool for_write) noexcept;
+    /// Create anonymous shared memory object with memfd_create(). It has no
+    /// name and is accessible by other processes only through descriptor.
+    bool open_memfd() noexcept;
+    /// Use descriptor of shared memory object. Takes ownership of fd.
+    bool open_fd(int fd, bool for_write) noexcept;
+    /// Use part of shared memory object fd, which is mapped elsewhere at
+    /// mem, starting from offset base. Buffer never maps memory itself and
+    /// doesn't own fd. Its size is limited by capacity.
+    bool open_view(int fd, char *mem, size_t base, size_t capacity,
+            bool for_write) noexcept;
     /// Resize shared memory object. new_size automatically aligned.
     bool resize(size_t new_size) noexcept;
     /// Store new_file_size as a file size of this object.
     /// Usefull if shared memory object size was changed elsewhere without
     /// this object.
     void update_file_size(size_t new_file_size) noexcept;
+    /// Release memory of shared memory object from offset to its end.
+    /// File size is kept and released part reads as zeros. offset must be
+    /// aligned to page size.
+    bool release_memory(size_t offset) noexcept;
+    /// Allocate memory of whole shared memory object and fault in pages of
+    /// current mapping. Content isn't changed. Returns number of faulted in
+    /// pages or -1 on error.
+    ptrdiff_t prefault() noexcept;
+    /// Map with MAP_POPULATE, so pages are faulted in at mapping.
+    void set_populate(bool enable) { populate_ = enable; }
+    /// Reserve reserve bytes of address space and map object contiguously
+    /// from its beginning instead of sliding windows. map() extends mapping
+    /// in place, so all mapped data stays addressable, and unmap() keeps it.
+    /// Objects larger than reserve can't be mapped. Doesn't affect views.
+    /// Must be called before mapping.
+    void set_contiguous(size_t reserve) noexcept;
+    bool contiguous() const { return reserve_ && !view_; }
     bool unmap() noexcept;
     /// Unmaps previous mapped region and maps new.
     /// offset must be aligned to page size.
@@ -47,6 +74,8 @@ public:
         return map_offset_ + (map_ptr_ - map_begin_);
     }
     bool opened() const { return fd != -1; }
+    int get_fd() const { return fd; }
+    bool is_view() const { return view_; }
 
     void move_ptr(ptrdiff_t dif)
     {
@@ -60,6 +89,10 @@ public:
 
 private:
     char * map_impl(size_t offset, size_t size) const noexcept;
+    /// map() of contiguous buffer.
+    bool map_contiguous(size_t offset, size_t size) noexcept;
+    /// Release mapping of contiguous buffer beyond size.
+    bool shrink_contiguous(size_t size) noexcept;
 
     char *map_begin_ = nullptr;
     char *map_ptr_ = nullptr;
@@ -68,8 +101,17 @@ private:
     size_t file_size_ = 0;
     size_t data_size_ = 0;
     const char *name_ = nullptr;
+    /// View mode (open_view()).
+    char *view_ = nullptr;
+    size_t view_base_ = 0;
+    size_t view_capacity_ = 0;
     int fd = -1;
     bool writable = false;
+    bool populate_ = false;
+    /// Reserved address range of contiguous mapping and its mapped part.
+    char *region_ = nullptr;
+    size_t reserve_ = 0;
+    size_t region_mapped_ = 0;
 };
 
 constexpr size_t REQUEST_CHUNK = 64 * 1024;
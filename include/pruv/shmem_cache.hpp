@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 #include <pruv/hash_table.hpp>
 #include <pruv/shmem_buffer.hpp>
 
@@ -14,9 +16,36 @@ public:
     shmem_cache(bool for_write);
     ~shmem_cache();
     shmem_buffer * get(char const *name) noexcept;
+    /// Buffer passed by descriptor and referred by id (worker_protocol.hpp).
+    /// slot is used if id is arena segment. Returns nullptr if buffer id of
+    /// generation gen wasn't put yet.
+    shmem_buffer * get(uint32_t id, uint32_t gen, uint32_t slot) noexcept;
+    /// Set buffer id to shared memory object fd of generation gen. Previous
+    /// buffer with the same id is closed. Takes ownership of fd.
+    /// If slot_size isn't 0, then object is arena segment of size bytes.
+    /// It's mapped at once and split into slots. Flags are CMD_F_POPULATE,
+    /// CMD_F_HUGE_PAGES and CMD_F_CONTIGUOUS of buffer_fd_cmd.
+    bool put(uint32_t id, uint32_t gen, int fd, size_t size, size_t slot_size,
+            uint32_t flags = 0) noexcept;
 
 private:
+    struct id_entry {
+        ~id_entry();
+        /// Buffer or descriptor of arena segment.
+        shmem_buffer shm;
+        uint32_t gen = 0;
+        /// Mapping of arena segment.
+        char *region = nullptr;
+        size_t region_size = 0;
+        size_t slot_size = 0;
+        /// Views of slots. Opened on first use.
+        shmem_buffer *slots = nullptr;
+    };
+
     hash_table _name_to_buf;
+    /// Indexed by buffer id.
+    id_entry **_by_id = nullptr;
+    size_t _by_id_cnt = 0;
     bool _for_write;
 };
 
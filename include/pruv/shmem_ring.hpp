@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/uio.h>
+
+namespace pruv {
+
+/// Single producer single consumer ring of bytes in shared memory.
+/// Producer and consumer may be in different processes.
+/// Consumer, which is going to block, sets sleeping flag. Producer notifies
+/// consumer only if flag is set.
+class shmem_ring {
+public:
+    /// Shared part of the ring. Data follows it.
+    struct control {
+        alignas(64) std::atomic<uint64_t> write_pos;
+        alignas(64) std::atomic<uint64_t> read_pos;
+        alignas(64) std::atomic<uint32_t> sleeping;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+            "Ring in shared memory requires lock free atomics");
+
+    /// Size of memory for ring with capacity bytes of data.
+    static size_t region_size(size_t capacity) noexcept;
+    /// Use memory region. capacity must be a power of 2.
+    /// If init is true then control block initialized.
+    void attach(void *region, size_t capacity, bool init) noexcept;
+
+    /// Producer. Writes all buffers as one record. Returns false if there is
+    /// no space for it. notify is set if consumer sleeps and must be woken up.
+    bool write(const iovec *bufs, size_t cnt, bool &notify) noexcept;
+
+    /// Consumer. Number of bytes available for reading.
+    size_t readable() const noexcept;
+    /// Consumer. Copy len bytes without consuming. len <= readable().
+    void peek(void *dst, size_t len) const noexcept;
+    /// Consumer. Copy and consume len bytes. len <= readable().
+    void read(void *dst, size_t len) noexcept;
+    /// Consumer. Set sleeping flag. Returns false and clears flag if data
+    /// appeared, i.e. consumer must not sleep.
+    bool prepare_sleep() noexcept;
+    /// Consumer. Clear sleeping flag.
+    void wake_up() noexcept;
+
+    size_t capacity() const noexcept { return capacity_; }
+
+private:
+    void copy_out(uint64_t pos, void *dst, size_t len) const noexcept;
+
+    control *ctl_ = nullptr;
+    char *data_ = nullptr;
+    size_t capacity_ = 0;
+};
+
+/// Two rings between dispatcher and worker in one shared memory object
+/// and eventfds for notifications.
+struct ring_channel {
+    ring_channel() noexcept {}
+    ~ring_channel();
+    ring_channel(const ring_channel &) = delete;
+    void operator = (const ring_channel &) = delete;
+
+    /// Create shared memory and eventfds (dispatcher side).
+    bool create(size_t capacity) noexcept;
+    /// Map shared memory, created by other side (worker side).
+    /// Takes ownership of the file descriptors.
+    bool attach(int mem_fd, int cmd_efd, int resp_efd, size_t capacity)
+        noexcept;
+    void close() noexcept;
+    bool opened() const noexcept { return region; }
+
+    /// Wake up consumer blocked on eventfd.
+    static bool notify(int efd) noexcept;
+    /// Reset eventfd counter after wake up.
+    static void drain(int efd) noexcept;
+
+    /// Commands from dispatcher to worker.
+    shmem_ring cmd;
+    /// Responses from worker to dispatcher.
+    shmem_ring resp;
+    int mem_fd = -1;
+    /// Signaled by dispatcher when worker sleeps.
+    int cmd_efd = -1;
+    /// Signaled by worker when dispatcher sleeps.
+    int resp_efd = -1;
+
+private:
+    static size_t channel_size(size_t capacity) noexcept;
+    bool map(size_t capacity, bool init) noexcept;
+
+    void *region = nullptr;
+    size_t region_size = 0;
+};
+
+} // namespace pruv
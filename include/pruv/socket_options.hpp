@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#pragma once
+
+namespace pruv {
+
+/// Options of listening socket and of accepted connections. 0 keeps
+/// system default.
+struct socket_options {
+    /// Listening socket.
+    int backlog = 16384;
+    /// SO_REUSEPORT (see tcp_server::REUSEPORT).
+    bool reuse_port = false;
+    /// TCP_DEFER_ACCEPT. Connection is accepted when its first data arrives
+    /// or after this number of seconds.
+    int defer_accept = 0;
+    /// TCP_FASTOPEN queue length. Data of SYN is passed as first request.
+    int fastopen = 0;
+
+    /// Accepted connections.
+    /// TCP_NODELAY. Responses are written by one write, so Nagle's algorithm
+    /// only delays tails of them. Disabled by default.
+    bool nodelay = false;
+    /// TCP_NOTSENT_LOWAT. Socket is writable when unsent data is below this
+    /// number of bytes, so less data waits in socket.
+    int notsent_lowat = 0;
+    /// SO_BUSY_POLL microseconds of busy polling device on blocking reads
+    /// and on poll with busy polling enabled.
+    int busy_poll = 0;
+    /// SO_KEEPALIVE with idle time, probes interval (seconds) and count.
+    bool keepalive = false;
+    unsigned keepalive_idle = 20;
+    unsigned keepalive_interval = 5;
+    unsigned keepalive_cnt = 3;
+};
+
+} // namespace pruv
@@ -6,6 +6,8 @@
 
 #include <uv.h>
 
+#include <pruv/socket_options.hpp>
+
 namespace pruv {
 
 class tcp_con : private uv_tcp_t {
@@ -16,9 +18,14 @@ public:
 
     bool set_tcp_keepalive(int enable, unsigned delay, unsigned interval,
             unsigned cnt) noexcept;
+    /// Apply options of accepted connections. Failed options are logged and
+    /// skipped.
+    bool set_options(const socket_options &opts) noexcept;
 
     bool read_start(uv_alloc_cb alloc_cb, uv_read_cb read_cb) noexcept;
     bool read_stop() noexcept;
+    /// Socket descriptor or -1 if connection isn't opened.
+    int fileno() noexcept;
 
     template<typename T>
     T base() { return reinterpret_cast<T>(this); }
@@ -6,13 +6,28 @@
 
 #include <uv.h>
 
+#include <pruv/socket_options.hpp>
+
 namespace pruv {
 
 class tcp_server : private uv_tcp_t {
 public:
+    /// Flag for bind(). Set SO_REUSEPORT on socket before binding. It allows
+    /// several loops (in different threads) to listen the same address.
+    static constexpr unsigned int REUSEPORT = 1u << 16;
+
     bool init(uv_loop_t *loop) noexcept;
+    /// Use inherited bound socket fd instead of bind(). Takes ownership of
+    /// fd and sets close-on-exec on it, so workers don't inherit it.
+    bool open(int fd) noexcept;
+    /// flags is a combination of uv_tcp_flags and REUSEPORT.
     bool bind(sockaddr *addr, unsigned int flags) noexcept;
+    /// Set TCP_DEFER_ACCEPT and TCP_FASTOPEN. Must be called after bind()
+    /// and before listen().
+    bool set_options(const socket_options &opts) noexcept;
     bool listen(int backlog, uv_connection_cb cb) noexcept;
+    /// Socket descriptor or -1 if server isn't opened.
+    int fileno() noexcept;
     /// Can be called only after init().
     void close(uv_close_cb close_cb);
 
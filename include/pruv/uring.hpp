@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/intrusive/list.hpp>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <uv.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace pruv {
+
+/// io_uring for writing into streams of libuv loop. Writes are queued and
+/// submitted together by one syscall before loop polls for events. Writes
+/// finished by submission are completed before polling too, as libuv
+/// completes its writes. Other completions are signaled through eventfd
+/// polled by loop. Loop is kept
+/// alive while writes are in flight.
+class uring {
+public:
+    uring() noexcept {}
+    ~uring();
+    uring(const uring &) = delete;
+    void operator = (const uring &) = delete;
+
+    /// Create ring with entries submission queue entries. With sqpoll kernel
+    /// thread takes submissions, so submitting doesn't make syscalls while
+    /// the thread is awake. done is called for each finished write instead
+    /// of its callback, which is stored in req->cb.
+    bool init(uv_loop_t *loop, unsigned entries, bool sqpoll,
+            uv_write_cb done) noexcept;
+    /// Close loop handles and ring. Handles are removed from loop by its
+    /// next iteration. Writes must be finished.
+    void close() noexcept;
+    bool opened() const noexcept { return ring_fd != -1; }
+
+    /// As uv_write(), but bufs are written by io_uring. Data is written
+    /// fully or write finishes with error. At most MAX_BUFS buffers.
+    /// Writes into one stream aren't ordered, so the next one must be made
+    /// after the previous one finishes.
+    int write(uv_write_t *req, uv_stream_t *stream, const uv_buf_t bufs[],
+            unsigned nbufs, uv_write_cb cb) noexcept;
+    /// Cancel writes into stream. They finish with UV_ECANCELED.
+    void cancel(uv_stream_t *stream) noexcept;
+
+    static constexpr unsigned MAX_BUFS = 16;
+
+private:
+    struct op : boost::intrusive::list_base_hook<
+            boost::intrusive::link_mode<boost::intrusive::auto_unlink>> {
+        uv_write_t *req = nullptr;
+        msghdr msg;
+        iovec iov[MAX_BUFS];
+        op *next_free = nullptr;
+    };
+
+    /// Queue sendmsg of op's remaining data.
+    bool send(op *o) noexcept;
+    /// Handle completion of op's sendmsg with result res.
+    void complete(op *o, int res) noexcept;
+    void finish(op *o, int status) noexcept;
+    /// Free submission queue entry or nullptr if queue is full.
+    io_uring_sqe * get_sqe() noexcept;
+    /// Pass queued entries to kernel.
+    void submit() noexcept;
+    void reap() noexcept;
+
+    uv_loop_t *loop = nullptr;
+    uv_write_cb done = nullptr;
+    int ring_fd = -1;
+    int efd = -1;
+    bool sqpoll = false;
+    uv_poll_t poll = {};
+    uv_prepare_t prepare = {};
+
+    /// Mapped rings.
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_flags = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    /// Tail with queued, but not published entries.
+    unsigned sq_local_tail = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    boost::intrusive::list<op, boost::intrusive::constant_time_size<false>>
+        inflight;
+    op *free_ops = nullptr;
+};
+
+} // namespace pruv
@@ -6,13 +6,16 @@
 
 #include <pruv/shmem_buffer.hpp>
 #include <pruv/shmem_cache.hpp>
+#include <pruv/shmem_ring.hpp>
 #include <pruv/termination.hpp>
+#include <pruv/worker_protocol.hpp>
 
 namespace pruv {
 
 class worker_loop {
 public:
     worker_loop();
+    virtual ~worker_loop();
     static int setup(int argc, char const * const *argv) noexcept;
     static int argc() noexcept;
     static char const * const * argv() noexcept;
@@ -22,35 +25,215 @@ public:
 
 protected:
     virtual int handle_request() noexcept = 0;
+    /// Handle requests received together (dispatcher::set_request_batch()).
+    /// Each request must be selected by select_request() and then answered
+    /// or deferred. Responses are sent to dispatcher together after return.
+    /// Default calls handle_request() for each request.
+    virtual int handle_batch() noexcept;
+    /// Called once before the first request. Dispatcher sends requests only
+    /// after it, so here may be loaded data, filled caches and so on.
+    /// If returns false, worker exits.
+    virtual bool warm_up() noexcept;
+    /// Called when wakeup descriptor becomes readable while waiting for the
+    /// next request. Usually resumes and completes deferred requests.
+    virtual int on_wakeup() noexcept;
 
     bool send_last_response() noexcept;
-    char * request() const { return _request; }
-    size_t request_len() const { return _request_len; }
-    shmem_buffer * response_buf() const { return _response_buf; }
-    char const * req_meta() const { return _req_meta; }
+    /// Keep current request in flight after handle_request() returns, so
+    /// next requests are received while its response is produced.
+    /// Dispatcher sends several requests to worker only if it's configured
+    /// by dispatcher::set_worker_queue_depth(). req_meta() isn't kept.
+    bool defer_request(uint32_t &id) noexcept;
+    /// Make deferred request current. Response for previous current request
+    /// must be already sent.
+    bool resume_request(uint32_t id) noexcept;
+    /// Descriptor polled together with the input while waiting for the next
+    /// request. For example eventfd or epoll descriptor of worker's own
+    /// asynchronous I/O. -1 disables it.
+    void set_wakeup_fd(int fd) noexcept;
+    char * request() const { return _cur.request; }
+    size_t request_len() const { return _cur.request_len; }
+    shmem_buffer * response_buf() const { return _cur.response_buf; }
+    /// Dispatcher closes connection after response of current request, for
+    /// example while it's draining (CMD_F_CLOSE).
+    bool close_requested() const { return _cur.close; }
+    char const * req_meta() const
+    {
+        return _cur.meta_copy ? _cur.meta_copy : _meta;
+    }
+    size_t batch_size() const { return _batch_cnt; }
+    /// Request of batch, which isn't selected yet.
+    char * batch_request(size_t i) const { return _batch[i].request; }
+    size_t batch_request_len(size_t i) const { return _batch[i].request_len; }
+    char const * batch_req_meta(size_t i) const
+    {
+        return _batch[i].meta_copy ? _batch[i].meta_copy : _meta;
+    }
+    /// Make i-th request of batch current. Previous current request is
+    /// finished.
+    bool select_request(size_t i) noexcept;
 
 private:
+    /// Text protocol commands. Worker, which overrides any of them, must
+    /// override binary_protocol() to return false. Otherwise binary frames
+    /// from worker_protocol.hpp are used.
+    virtual bool binary_protocol() const noexcept;
     virtual bool emit_last_response_cmd() noexcept;
     virtual bool recv_request_cmd(
             char (&buf_in_name)[256], size_t &buf_in_pos, size_t &buf_in_len,
             char (&buf_out_name)[256], size_t &buf_out_file_size,
             char *meta, size_t meta_len) noexcept;
 
+    /// Zygote mode (worker_protocol.hpp). Forks workers by requests from
+    /// control socket ctl. Returns in zygote on exit and in forked worker,
+    /// in which case child is set.
+    int zygote_loop(int ctl, bool &child) noexcept;
     bool read_line() noexcept;
+    /// Read exactly len bytes from stdin.
+    bool read_all(void *dst, size_t len) noexcept;
+    /// Write all len bytes into stdout.
+    bool write_all(const void *src, size_t len) noexcept;
+    /// Wait for frame in ring or in stdin. Sets _from_ring.
+    /// Calls on_wakeup() while waiting.
+    bool wait_frame() noexcept;
+    /// Read exactly len bytes of current frame.
+    bool read_frame(void *dst, size_t len) noexcept;
+    /// Read the rest of ring setup frame and attach ring.
+    bool setup_ring(const cmd_header &hdr) noexcept;
+    /// Receive binary request frame. Fills the same values as
+    /// recv_request_cmd(). Meta length is not limited.
+    bool recv_request_frame(size_t &buf_in_pos, size_t &buf_in_len,
+            size_t &buf_out_file_size) noexcept;
+    /// Receive one buffer descriptor or buffer release from BUF_SOCK_FD.
+    /// Returns 0 if there is no frame and wait is false, -1 on error.
+    int recv_buffer_frame(bool wait) noexcept;
+    /// Buffer passed by descriptor. Waits for its descriptor if needed.
+    shmem_buffer * buffer_by_id(uint32_t id, uint32_t gen, uint32_t slot)
+        noexcept;
+    /// Buffer by name from text request or by ids if name is empty.
+    shmem_buffer * find_buffer(shmem_cache &cache, const char *name,
+            uint32_t id, uint32_t gen, uint32_t slot) noexcept;
     bool next_request() noexcept;
     bool clean_after_request() noexcept;
+    /// Receive request and requests, which already wait in input, into
+    /// _batch.
+    bool next_batch() noexcept;
+    /// Frame can be read without waiting.
+    bool frame_pending() noexcept;
+    /// Clean requests of batch and send collected responses.
+    bool finish_batch() noexcept;
+    bool append_response(const iovec *v, size_t cnt) noexcept;
+    bool flush_responses() noexcept;
+    /// Worker's own buffer for response.
+    struct own_buffer : shmem_buffer {
+        /// Index in _own_bufs.
+        uint32_t id = 0;
+        /// Descriptor is sent to dispatcher.
+        bool registered = false;
+    };
+    /// Worker's own buffer for inline response or response from worker's
+    /// buffer.
+    shmem_buffer * take_local_buffer() noexcept;
+    bool release_local_buffer(shmem_buffer *buf) noexcept;
+    /// Send descriptor of buffer to dispatcher if it isn't sent yet.
+    bool register_own_buffer(own_buffer &buf) noexcept;
+    /// Copy response, which is too big to be inline, into shared buffer.
+    static bool spill_response(shmem_buffer &local, shmem_buffer &out)
+        noexcept;
 
     shmem_cache _buf_in_cache {true};
     shmem_cache _buf_out_cache {true};
-    char *_request = nullptr;
-    size_t _request_len = 0;
-    shmem_buffer *_request_buf = nullptr;
-    shmem_buffer *_response_buf = nullptr;
+    /// Buffers passed by descriptors.
+    shmem_cache _buf_fd_cache {true};
+    struct request_state {
+        char *request = nullptr;
+        size_t request_len = 0;
+        shmem_buffer *request_buf = nullptr;
+        shmem_buffer *response_buf = nullptr;
+        /// response_buf is local buffer and out_buf is shared buffer for
+        /// response, which doesn't fit into frame.
+        bool local_response = false;
+        /// Shared buffer or nullptr if response may be sent from worker's
+        /// buffer.
+        shmem_buffer *out_buf = nullptr;
+        /// Response is sent from worker's buffer response_buf.
+        bool own_response = false;
+        /// Maximum size of inline response.
+        size_t inline_max = 0;
+        /// Copy of inline request owned by deferred or batch's request.
+        char *inline_copy = nullptr;
+        /// Copy of meta owned by batch's request.
+        char *meta_copy = nullptr;
+        /// Tag from request frame. Used as id of deferred request.
+        uint32_t tag = 0;
+        /// Request frame has CMD_F_CLOSE.
+        bool close = false;
+    };
+    /// Copy inline request into heap, because _inline_req is reused.
+    static bool copy_inline_request(request_state &r) noexcept;
+    /// Request being handled.
+    request_state _cur;
+    /// Deferred requests.
+    request_state *_deferred = nullptr;
+    size_t _deferred_cnt = 0;
+    size_t _deferred_cap = 0;
+    /// Received batch. Selected requests are moved into _cur.
+    request_state *_batch = nullptr;
+    size_t _batch_cnt = 0;
+    size_t _batch_cap = 0;
+    /// Response frames are collected into _resp_out while batch is handled.
+    bool _coalesce = false;
+    char *_resp_out = nullptr;
+    size_t _resp_out_len = 0;
+    size_t _resp_out_cap = 0;
+    int _wakeup_fd = -1;
+
+    /// Dispatcher sends binary request frames.
+    bool _binary_requests = false;
+
+    static constexpr unsigned MIN_SPIN = 64;
+    static constexpr unsigned MAX_SPIN = 1u << 16;
+    /// Requests and responses ring. Opened by dispatcher's setup frame.
+    ring_channel _ring;
+    /// Current frame is read from ring.
+    bool _from_ring = false;
+    /// Number of ring checks before going to sleep.
+    unsigned _spin_limit = MIN_SPIN;
 
     char _ln[1024];
     char _req_meta[1024];
+    /// Points to _req_meta or to _long_meta.
+    char *_meta = _req_meta;
+    /// Heap buffer for meta which doesn't fit into _req_meta.
+    char *_long_meta = nullptr;
+    size_t _long_meta_cap = 0;
     char _buf_in_name[256];
     char _buf_out_name[256];
+    /// Buffers of binary request with CMD_F_BUFFER_IDS. Names are empty.
+    uint32_t _buf_in_id = 0;
+    uint32_t _buf_in_gen = 0;
+    uint32_t _buf_out_id = 0;
+    uint32_t _buf_out_gen = 0;
+    uint32_t _buf_in_slot = 0;
+    uint32_t _buf_out_slot = 0;
+    /// Inline request and response of last request frame.
+    bool _inline_request = false;
+    bool _inline_response = false;
+    size_t _inline_max = 0;
+    /// Last request frame has no out buffer.
+    bool _worker_response = false;
+    /// Heap buffer for inline request.
+    char *_inline_req = nullptr;
+    size_t _inline_req_cap = 0;
+    /// Local buffers by id. Null for destroyed buffers.
+    own_buffer **_own_bufs = nullptr;
+    size_t _own_cnt = 0;
+    /// Stack of free local buffers. Both arrays have capacity _own_cap.
+    own_buffer **_local_bufs = nullptr;
+    size_t _local_cnt = 0;
+    size_t _own_cap = 0;
+    /// Some buffers were sent to dispatcher and may be released by it.
+    bool _own_registered = false;
 
     static int _argc;
     static char const * const *_argv;
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pruv {
+
+/// Binary frames of dispatcher <-> worker protocol.
+/// Text commands always start with printable character. Binary frame starts
+/// with CMD_MAGIC, which is not printable. So reader can distinguish them by
+/// the first byte.
+///
+/// Worker sends CMD_READY frame (only header) after start and warm up.
+/// Dispatcher sends requests to worker only after it. Workers, which don't
+/// use binary frames, may send "READY" line instead.
+///
+/// Protocol negotiation. Worker, which uses default recv_request_cmd() and
+/// emit_last_response_cmd(), sets CMD_F_BINARY_REQUESTS flag in CMD_READY
+/// frame. Dispatcher sends binary request frames to this worker from the
+/// first request. Other workers get text request commands. Dispatcher accepts
+/// both text and binary responses.
+///
+/// Dispatcher may send several binary requests to a worker without waiting
+/// for responses. Response carries tag of its request and responses may come
+/// in any order.
+///
+/// Small messages may travel inline. Request with CMD_F_INLINE_REQUEST
+/// carries in_len bytes of request after meta and has no in buffer. Request
+/// with CMD_F_INLINE_RESPONSE allows worker to answer with response having
+/// the same flag and data_size bytes of response after it, if data_size
+/// doesn't exceed inline_max. Out buffer is used otherwise.
+constexpr uint8_t CMD_MAGIC = 0xb7;
+constexpr uint8_t CMD_VERSION = 1;
+
+enum cmd_type : uint8_t {
+    CMD_REQUEST = 1,
+    CMD_RESPONSE = 2,
+    CMD_RING_SETUP = 3,
+    CMD_READY = 4,
+    CMD_ZYGOTE_FORK = 5,
+    CMD_ZYGOTE_FORKED = 6,
+    CMD_ZYGOTE_EXITED = 7,
+    CMD_BUFFER_FD = 8,
+    CMD_BUFFER_RELEASE = 9
+};
+
+enum cmd_flags : uint32_t {
+    /// Ready flag. Worker accepts binary request frames.
+    CMD_F_BINARY_REQUESTS = 1u << 0,
+    /// Request flag. Buffers are referred by ids instead of names.
+    CMD_F_BUFFER_IDS = 1u << 1,
+    /// Request flag. Request data follows meta.
+    CMD_F_INLINE_REQUEST = 1u << 2,
+    /// Request flag: response may be inline. Response flag: response data
+    /// follows frame.
+    CMD_F_INLINE_RESPONSE = 1u << 3,
+    /// Buffer fd flag. Memory of buffer is allocated, map it with
+    /// MAP_POPULATE.
+    CMD_F_POPULATE = 1u << 4,
+    /// Buffer fd flag. Advise transparent huge pages for arena segment.
+    CMD_F_HUGE_PAGES = 1u << 5,
+    /// Buffer fd flag. Map single buffer contiguously in reserved address
+    /// range of size bytes.
+    CMD_F_CONTIGUOUS = 1u << 6,
+    /// Request flag: there is no out buffer, worker responds from its own
+    /// buffer. Response flag: response is in worker's buffer buf_id.
+    CMD_F_WORKER_BUFFER = 1u << 7,
+    /// Request flag. Dispatcher closes connection after the response, so
+    /// response should tell it to client (Connection: close in HTTP).
+    CMD_F_CLOSE = 1u << 8
+};
+
+struct cmd_header {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t flags;
+    /// Size of the whole frame including header and variable length tail.
+    uint32_t size;
+};
+
+/// Followed by in buffer name, out buffer name and meta without zero
+/// terminators and by inline request. With CMD_F_BUFFER_IDS names are empty
+/// and buffers are referred by ids.
+struct request_cmd {
+    cmd_header hdr;
+    uint64_t in_pos;
+    uint64_t in_len;
+    uint64_t out_file_size;
+    uint32_t in_name_len;
+    uint32_t out_name_len;
+    uint32_t meta_len;
+    /// Returned in response.
+    uint32_t tag;
+    uint32_t in_id;
+    uint32_t in_gen;
+    uint32_t out_id;
+    uint32_t out_gen;
+    /// Slots of buffers if ids refer to arena segments.
+    uint32_t in_slot;
+    uint32_t out_slot;
+    /// Maximum size of inline response.
+    uint32_t inline_max;
+    uint32_t reserved;
+};
+
+/// Followed by inline response.
+struct response_cmd {
+    cmd_header hdr;
+    uint64_t data_size;
+    uint64_t file_size;
+    uint32_t tag;
+    /// Worker's buffer with CMD_F_WORKER_BUFFER.
+    uint32_t buf_id;
+};
+
+/// Sent through pipe to switch worker to shared memory rings (shmem_ring.hpp).
+/// After it dispatcher sends requests through ring, and worker sends
+/// responses through ring. Both sides still accept frames from pipes.
+/// Descriptors are inherited by worker at spawn.
+struct ring_setup_cmd {
+    cmd_header hdr;
+    uint32_t capacity;
+    int32_t mem_fd;
+    int32_t cmd_efd;
+    int32_t resp_efd;
+};
+
+/// Descriptors of ring channel in worker process.
+constexpr int RING_MEM_FD = 3;
+constexpr int RING_CMD_EFD = 4;
+constexpr int RING_RESP_EFD = 5;
+
+/// Buffers created with memfd_create() have no names. Dispatcher passes
+/// buffer's descriptor to a worker once through SOCK_SEQPACKET socket
+/// BUF_SOCK_FD before the first request using the buffer. Requests refer to
+/// it by small id and generation. Id is reused by newer buffers with other
+/// generation. Text requests use names "#<id>.<gen>" for such buffers.
+/// Named buffers may be registered the same way to not be looked up by name.
+///
+/// Arena segment is one memfd object split into slots of equal size. Each
+/// slot is a buffer. Segment is passed and mapped once, requests refer to
+/// buffer by segment's id and generation and by slot. Names are
+/// "#<id>.<gen>.<slot>".
+///
+/// Worker's own response buffers travel the other way. Worker sends
+/// buffer_fd_cmd with gen 0 before the first response from the buffer, and
+/// the buffer belongs to dispatcher until it sends CMD_BUFFER_RELEASE back.
+constexpr int BUF_SOCK_FD = 6;
+
+/// Sent through BUF_SOCK_FD with buffer's descriptor in SCM_RIGHTS.
+struct buffer_fd_cmd {
+    cmd_header hdr;
+    uint32_t id;
+    uint32_t gen;
+    /// Size of arena segment. For single buffer 0 or address range reserved
+    /// for it with CMD_F_CONTIGUOUS.
+    uint64_t size;
+    /// Size of arena segment's slot. 0 for single buffer.
+    uint64_t slot_size;
+};
+
+/// Dispatcher -> worker through BUF_SOCK_FD. Response from worker's buffer
+/// is written, worker may reuse the buffer.
+struct buffer_release_cmd {
+    cmd_header hdr;
+    uint32_t id;
+    uint32_t reserved;
+};
+
+/// Zygote is a worker, which warms up once and then forks new workers on
+/// dispatcher's requests. Forked workers share warmed up state with zygote
+/// through copy-on-write pages. Zygote is started with ZYGOTE_ENV variable
+/// set to number of its control socket (SOCK_SEQPACKET). Zygote is parent
+/// of forked workers, so it reports their pids and exits to dispatcher.
+constexpr char ZYGOTE_ENV[] = "PRUV_ZYGOTE_FD";
+/// Maximum number of descriptors passed with fork request.
+constexpr size_t ZYGOTE_MAX_FDS = 8;
+
+/// Dispatcher -> zygote. Descriptors are passed with SCM_RIGHTS: stdin and
+/// stdout of new worker, then descriptors to be placed from 3 (ring, buffers
+/// socket).
+struct zygote_fork_cmd {
+    cmd_header hdr;
+    /// Returned in CMD_ZYGOTE_FORKED reply.
+    uint64_t cookie;
+    /// Bit i is set if descriptor 3 + i is passed.
+    uint32_t inherit_mask;
+    uint32_t reserved;
+};
+
+/// Zygote -> dispatcher. Reply to fork request (CMD_ZYGOTE_FORKED) or
+/// notification about exited worker (CMD_ZYGOTE_EXITED).
+/// Worker's CMD_ZYGOTE_EXITED always comes after its CMD_ZYGOTE_FORKED.
+struct zygote_child_cmd {
+    cmd_header hdr;
+    /// Cookie of fork request. 0 for exit notification.
+    uint64_t cookie;
+    /// Pid of the worker or -errno if fork failed.
+    int32_t pid;
+    int32_t exit_code;
+    int32_t term_signal;
+    int32_t reserved;
+};
+
+inline cmd_header make_cmd_header(cmd_type type, uint32_t flags, size_t size)
+    noexcept
+{
+    return cmd_header{CMD_MAGIC, CMD_VERSION, type, 0, flags, (uint32_t)size};
+}
+
+/// Check magic, version and type of the frame.
+inline bool valid_cmd_header(const cmd_header &hdr, cmd_type type) noexcept
+{
+    return hdr.magic == CMD_MAGIC && hdr.version == CMD_VERSION &&
+        hdr.type == type;
+}
+
+} // namespace pruv
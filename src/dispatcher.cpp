@@ -8,7 +8,15 @@
 #include <cassert>
 #include <cstring>
 #include <cinttypes>
-
+#include <initializer_list>
+
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <pruv/cleanup_helpers.hpp>
@@ -16,6 +24,24 @@
 
 namespace pruv {
 
+namespace {
+
+size_t chunk_size(bool for_req)
+{
+    return for_req ? REQUEST_CHUNK : RESPONSE_CHUNK;
+}
+
+/// Size class holding buffer of size bytes.
+size_t buffer_class(size_t size, size_t chunk, size_t classes)
+{
+    size_t c = 0;
+    while (c + 1 < classes && chunk << 2 * (c + 1) <= size)
+        ++c;
+    return c;
+}
+
+} // namespace
+
 ///
 /// dispatcher
 ///
@@ -32,11 +58,16 @@ dispatcher::~dispatcher()
     assert(clients_scheduling.empty());
     assert(clients_processing.empty());
 
+    assert(starting_workers.empty());
     assert(free_workers.empty());
     assert(in_use_workers.empty());
 
-    assert(req_bufs.empty());
-    assert(resp_bufs.empty());
+    for (size_t c = 0; c < BUFFER_CLASSES; ++c) {
+        assert(req_pool.classes[c].empty());
+        assert(resp_pool.classes[c].empty());
+    }
+    assert(arena_segments.empty());
+    free(free_buf_ids);
 }
 
 void dispatcher::set_timeouts(bool enable) noexcept
@@ -44,6 +75,121 @@ void dispatcher::set_timeouts(bool enable) noexcept
     timeouts_enabled = enable;
 }
 
+void dispatcher::set_drain_timeout(unsigned timeout) noexcept
+{
+    drain_timeout = timeout;
+}
+
+void dispatcher::set_reuse_port(bool enable) noexcept
+{
+    sock_opts.reuse_port = enable;
+}
+
+void dispatcher::set_socket_options(const socket_options &opts) noexcept
+{
+    sock_opts = opts;
+}
+
+void dispatcher::set_listen_fd(int fd) noexcept
+{
+    listen_fd = fd;
+}
+
+void dispatcher::set_ring_transport(bool enable) noexcept
+{
+    ring_transport = enable;
+}
+
+void dispatcher::set_worker_queue_depth(size_t depth) noexcept
+{
+    worker_queue_depth = std::max<size_t>(depth, 1);
+}
+
+void dispatcher::set_request_batch(size_t max) noexcept
+{
+    request_batch = std::min(std::max<size_t>(max, 1), REQUEST_BATCH_MAX);
+}
+
+void dispatcher::set_inline_threshold(size_t bytes) noexcept
+{
+    inline_threshold = std::min(bytes, RESPONSE_CHUNK);
+}
+
+void dispatcher::set_buffer_pool_limit(size_t bytes) noexcept
+{
+    buffer_pool_limit = bytes;
+}
+
+void dispatcher::set_buffer_budget(size_t max_buffers, size_t max_bytes)
+    noexcept
+{
+    buffers_max = max_buffers;
+    buffer_bytes_max = max_bytes;
+}
+
+void dispatcher::set_buffer_prefault(size_t req_cnt, size_t resp_cnt,
+        bool huge_pages) noexcept
+{
+    prefault_req = req_cnt;
+    prefault_resp = resp_cnt;
+    this->huge_pages = huge_pages;
+}
+
+void dispatcher::set_registered_buffers(bool enable) noexcept
+{
+    registered_buffers = enable;
+}
+
+void dispatcher::set_worker_buffers(bool enable) noexcept
+{
+    worker_buffers = enable;
+}
+
+void dispatcher::set_contiguous_buffers(size_t reserve) noexcept
+{
+    contiguous_reserve = reserve;
+}
+
+void dispatcher::set_sendfile(bool enable) noexcept
+{
+    use_sendfile = enable;
+}
+
+void dispatcher::set_io_uring(unsigned entries, bool sqpoll) noexcept
+{
+    uring_entries = entries;
+    uring_sqpoll = sqpoll;
+}
+
+void dispatcher::set_memfd_buffers(bool enable) noexcept
+{
+    memfd_buffers = enable;
+}
+
+void dispatcher::set_buffer_arena(size_t slots, size_t req_capacity,
+        size_t resp_capacity) noexcept
+{
+    const size_t mask = shmem_buffer::PAGE_SIZE_MASK;
+    arena_slots = slots;
+    arena_req_capacity =
+        (std::max(req_capacity, REQUEST_CHUNK) + mask) & ~mask;
+    arena_resp_capacity =
+        (std::max(resp_capacity, RESPONSE_CHUNK) + mask) & ~mask;
+}
+
+void dispatcher::set_zygote(bool enable) noexcept
+{
+    zygote_enabled = enable;
+}
+
+void dispatcher::set_workers_pool(size_t workers_min, size_t spare,
+        unsigned idle_timeout) noexcept
+{
+    this->workers_min = workers_min;
+    workers_spare = spare;
+    worker_idle_timeout = idle_timeout;
+}
+
 void dispatcher::start(uv_loop_t *new_loop, const char *ip, int port,
         size_t workers_max, const char *worker_name,
         const char * const *worker_args) noexcept
@@ -56,12 +202,22 @@ void dispatcher::start(uv_loop_t *new_loop, const char *ip, int port,
     ok &= start_server(ip, port);
     ok &= start_timer(); // Initialize timer before stop it.
     if (!ok)
-        stop();
+        return stop();
+    if (uring_entries && !uring_io.init(loop, uring_entries, uring_sqpoll,
+                on_uring_write))
+        pruv_log(LOG_WARNING, "Connections are written by libuv");
+    prefault_buffers(true, prefault_req);
+    prefault_buffers(false, prefault_resp);
+    spawn_spares();
 }
 
 void dispatcher::stop() noexcept
 {
     assert(loop);
+    if (draining) {
+        draining = false;
+        uv_timer_set_repeat(&timer, TIMER_PERIOD);
+    }
     close_connections(clients_idle);
     close_connections(clients_io);
     close_connections(clients_scheduling);
@@ -69,20 +225,41 @@ void dispatcher::stop() noexcept
     stop_server();
     // Don't close timer.
     // It will helps to kill workers with SIGKILL if they not respond.
+    starting_workers.clear_and_dispose([this](auto *w) { kill_worker(w); });
     free_workers.clear_and_dispose([this](auto *w) { kill_worker(w); });
     in_use_workers.clear_and_dispose([this](auto *w) { kill_worker(w); });
-    close_buffers(req_bufs);
-    close_buffers(resp_bufs);
+    // Otherwise zygote is stopped after exit of the last forked worker.
+    if (!workers_cnt)
+        stop_zygote();
+    close_buffers(req_pool);
+    close_buffers(resp_pool);
     worker_args = nullptr;
     worker_name = nullptr;
 }
 
+void dispatcher::drain() noexcept
+{
+    assert(loop);
+    if (draining || !worker_name)
+        return; // Already draining or stopped.
+    draining = true;
+    drain_deadline = uv_now(loop) + drain_timeout;
+    stop_server();
+    close_connections(clients_idle);
+    pruv_log(LOG_NOTICE, "Draining connections");
+    // Timer stops dispatcher when the last connection is closed.
+    uv_timer_set_repeat(&timer, DRAIN_PERIOD);
+    uv_timer_again(&timer);
+}
+
 void dispatcher::on_loop_exit() noexcept
 {
     assert(loop);
+    if (uring_io.opened())
+        uring_io.close();
     close_timer();
-    close_buffers(req_bufs);
-    close_buffers(resp_bufs);
+    close_buffers(req_pool);
+    close_buffers(resp_pool);
     loop = nullptr;
 }
 
@@ -95,6 +272,24 @@ bool dispatcher::start_server(const char *ip, int port) noexcept
         return false;
     }
 
+    auto on_conn = [](uv_stream_t *server, int status) {
+        dispatcher *d = reinterpret_cast<dispatcher *>(server->data);
+        d->on_connection(server, status);
+    };
+
+    if (listen_fd != -1) {
+        // Socket is already bound and may have queued connections.
+        int fd = listen_fd;
+        listen_fd = -1; // Owned by server.
+        if (!server.open(fd) || !server.set_options(sock_opts) ||
+            !server.listen(sock_opts.backlog, on_conn)) {
+            server.close(nullptr);
+            return false;
+        }
+        pruv_log(LOG_NOTICE, "Server started on descriptor %d", fd);
+        return true;
+    }
+
     int r;
     sockaddr_in addr4;
     sockaddr_in6 addr6;
@@ -111,12 +306,10 @@ bool dispatcher::start_server(const char *ip, int port) noexcept
     else
         addr = (sockaddr *)&addr4;
 
-    auto on_conn = [](uv_stream_t *server, int status) {
-        dispatcher *d = reinterpret_cast<dispatcher *>(server->data);
-        d->on_connection(server, status);
-    };
-
-    if (!server.bind(addr, 0) || !server.listen(16384, on_conn)) {
+    unsigned int bind_flags =
+        sock_opts.reuse_port ? tcp_server::REUSEPORT : 0;
+    if (!server.bind(addr, bind_flags) || !server.set_options(sock_opts) ||
+        !server.listen(sock_opts.backlog, on_conn)) {
         server.close(nullptr);
         return false;
     }
@@ -138,6 +331,15 @@ void dispatcher::spawn_worker() noexcept
         pruv_log(LOG_EMERG, "Not enough memory for worker");
         return;
     }
+    worker->tasks.reset(new (std::nothrow) worker_task[worker_queue_depth]);
+    if (!worker->tasks) {
+        pruv_log(LOG_EMERG, "Not enough memory for worker");
+        delete worker;
+        return;
+    }
+    worker->depth = worker_queue_depth;
+    for (size_t i = 0; i < worker->depth; ++i)
+        worker->tasks[i].worker = worker;
     auto delcb = [](void *w) { delete reinterpret_cast<worker_process *>(w); };
     auto on_exit = [](uv_process_t *p, int64_t exit_code, int signal) {
         worker_process *worker = static_cast<worker_process *>(p);
@@ -145,15 +347,57 @@ void dispatcher::spawn_worker() noexcept
         d->on_worker_exit(worker, exit_code, signal);
     };
 
-    if (!worker->start(loop, worker_name, worker_args, this, on_exit, delcb))
+    // Placed from descriptor 3 in worker: ring, then buffers socket.
+    int inherit_fds[4] = {-1, -1, -1, -1};
+    size_t inherit_cnt = 0;
+    if (ring_transport) {
+        // Worker works through pipe if ring can't be created.
+        if (worker->ring.create(RING_CAPACITY)) {
+            inherit_fds[0] = worker->ring.mem_fd;
+            inherit_fds[1] = worker->ring.cmd_efd;
+            inherit_fds[2] = worker->ring.resp_efd;
+            inherit_cnt = 3;
+        }
+    }
+    int buf_sock[2] = {-1, -1};
+    if (memfd_buffers || arena_slots || registered_buffers || worker_buffers) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, buf_sock)
+                == -1 || fcntl(buf_sock[0], F_SETFL, O_NONBLOCK) == -1) {
+            pruv_log_syserr(LOG_ERR, "buffers socket");
+            for (int fd : buf_sock)
+                if (fd != -1)
+                    close(fd);
+            delete worker;
+            return;
+        }
+        worker->buf_sock = buf_sock[0];
+        inherit_fds[BUF_SOCK_FD - 3] = buf_sock[1];
+        inherit_cnt = BUF_SOCK_FD - 2;
+    }
+
+    if (zygote_enabled && !zygote)
+        // Workers are spawned directly, if zygote can't be started.
+        start_zygote();
+    bool started = zygote && !zygote->terminated ?
+        fork_worker(worker, inherit_fds, inherit_cnt, delcb) :
+        worker->start(loop, worker_name, worker_args, this, on_exit, delcb,
+                inherit_fds, inherit_cnt);
+    if (buf_sock[1] != -1)
+        close(buf_sock[1]);
+    if (!started)
         // deleter will be called sometime later, or already called.
         return;
 
-    pruv_log(LOG_NOTICE, "Worker process %d started.", worker->pid);
+    if (worker->adopted)
+        pruv_log(LOG_INFO, "Worker fork requested from zygote.");
+    else
+        pruv_log(LOG_NOTICE, "Worker process %d started.", worker->pid);
     // on_worker_exit callback can be called only on next loop iteration
     // after exit from this function.
     // Therefore allowed to call push_back after worker->start.
-    free_workers.push_back(*worker);
+    worker->timeout = uv_now(loop) + READY_TIMEOUT;
+    starting_workers.push_back(*worker);
+    ++starting_cnt;
     ++workers_cnt;
 
     auto alloc_cb = [](uv_handle_t *h, size_t /*sz*/, uv_buf_t *buf) {
@@ -161,9 +405,13 @@ void dispatcher::spawn_worker() noexcept
         // h is pipe.
         process *p = reinterpret_cast<process *>(h->data);
         worker_process *w = static_cast<worker_process *>(p);
-        // io_state may be some other, then IO_READ if worker writes
-        // trash to stdout or dies (and we receive EOF).
-        if (w->io_state != worker_process::IO_READ ||
+        if (w->inline_left) {
+            *buf = uv_buf_init(w->inline_ptr, w->inline_left);
+            return;
+        }
+        // Worker may write trash to stdout without requests or die (and we
+        // receive EOF).
+        if ((w->ready && !w->reading) ||
             w->pipe_buf_ptr >= std::end(w->pipe_buf)) {
             *buf = uv_buf_init(nullptr, 0);
             return;
@@ -186,20 +434,362 @@ void dispatcher::spawn_worker() noexcept
         pruv_log_uv_err(LOG_ERR, "uv_read_start", r);
         return kill_worker(worker);
     }
+
+    if (worker->ring.opened() && !start_ring_poll(worker))
+        // Worker will not receive ring setup and will use pipe.
+        worker->ring.close();
+}
+
+bool dispatcher::fork_worker(worker_process *w, const int *inherit_fds,
+        size_t inherit_cnt, void (*deleter)(void *)) noexcept
+{
+    assert(zygote);
+    assert(2 + inherit_cnt <= ZYGOTE_MAX_FDS);
+    int in[2] = {-1, -1};
+    int out[2] = {-1, -1};
+    zygote_fork_cmd cmd;
+    cmd.hdr = make_cmd_header(CMD_ZYGOTE_FORK, 0, sizeof(cmd));
+    cmd.cookie = ++fork_cookie;
+    cmd.inherit_mask = 0;
+    cmd.reserved = 0;
+    bool sent = false;
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+        pruv_log_syserr(LOG_ERR, "pipe2");
+    else {
+        int fds[ZYGOTE_MAX_FDS] = {in[0], out[1]};
+        size_t fds_cnt = 2;
+        for (size_t i = 0; i < inherit_cnt; ++i)
+            if (inherit_fds[i] != -1) {
+                fds[fds_cnt++] = inherit_fds[i];
+                cmd.inherit_mask |= 1u << i;
+            }
+        size_t fds_size = fds_cnt * sizeof(int);
+        alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fds))];
+        iovec iov = {&cmd, sizeof(cmd)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(fds_size);
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(fds_size);
+        memcpy(CMSG_DATA(cm), fds, fds_size);
+        ssize_t r;
+        while ((r = sendmsg(zygote->ctl_fd, &msg, MSG_NOSIGNAL)) == -1 &&
+               errno == EINTR) {}
+        if (r == -1)
+            pruv_log_syserr(LOG_ERR, "sendmsg(zygote)");
+        sent = (r == sizeof(cmd));
+    }
+    // Child's ends of pipes are passed to zygote or not needed.
+    for (int fd : {in[0], out[1], sent ? -1 : in[1], sent ? -1 : out[0]})
+        if (fd != -1 && close(fd) == -1)
+            pruv_log_syserr(LOG_ERR, "close");
+    if (!sent) {
+        delete w;
+        return false;
+    }
+    w->cookie = cmd.cookie;
+    // Forked worker exits on closed pipes if adopt fails.
+    return w->adopt(loop, in[1], out[0], this, deleter);
+}
+
+template<typename Pred>
+dispatcher::worker_process * dispatcher::find_worker(Pred pred) noexcept
+{
+    for (list<worker_process> *l : {&starting_workers, &free_workers,
+                                    &in_use_workers, &terminated_workers})
+        for (worker_process &w : *l)
+            if (pred(w))
+                return &w;
+    return nullptr;
+}
+
+bool dispatcher::start_zygote() noexcept
+{
+    assert(!zygote);
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        pruv_log_syserr(LOG_ERR, "socketpair");
+        return false;
+    }
+    if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1) {
+        pruv_log_syserr(LOG_ERR, "fcntl(O_NONBLOCK)");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    // Environment with control socket number, which is the first inherited
+    // descriptor.
+    char zygote_var[sizeof(ZYGOTE_ENV) + 16];
+    snprintf(zygote_var, sizeof(zygote_var), "%s=%d", ZYGOTE_ENV, 3);
+    size_t env_cnt = 0;
+    while (environ[env_cnt])
+        ++env_cnt;
+    std::unique_ptr<const char *[]> env(
+            new (std::nothrow) const char *[env_cnt + 2]);
+    zygote_process *z = new (std::nothrow) zygote_process;
+    if (!env || !z) {
+        pruv_log(LOG_EMERG, "Not enough memory for zygote");
+        delete z;
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < env_cnt; ++i)
+        if (strncmp(environ[i], zygote_var, sizeof(ZYGOTE_ENV)))
+            env[n++] = environ[i];
+    env[n++] = zygote_var;
+    env[n] = nullptr;
+    z->ctl_fd = sv[0];
+
+    auto delcb = [](void *z) { delete reinterpret_cast<zygote_process *>(z); };
+    auto on_exit = [](uv_process_t *p, int64_t exit_code, int signal) {
+        zygote_process *z = static_cast<zygote_process *>(p);
+        dispatcher *d = reinterpret_cast<dispatcher *>(z->owner);
+        d->on_zygote_exit(exit_code, signal);
+    };
+    bool started = z->start(loop, worker_name, worker_args, this, on_exit,
+            delcb, &sv[1], 1, env.get());
+    close(sv[1]);
+    if (!started)
+        // deleter will be called sometime later, or already called.
+        return false;
+    pruv_log(LOG_NOTICE, "Zygote process %d started.", z->pid);
+    zygote = z;
+
+    int r;
+    if ((r = uv_poll_init(loop, &z->ctl_poll, z->ctl_fd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_init", r);
+        stop_zygote();
+        return false;
+    }
+    // Closed in on_zygote_exit with process::close_cb.
+    z->ctl_poll.data = static_cast<process *>(z);
+    ++z->wait_close;
+    auto poll_cb = [](uv_poll_t *h, int status, int /*events*/) {
+        process *p = reinterpret_cast<process *>(h->data);
+        zygote_process *z = static_cast<zygote_process *>(p);
+        dispatcher *d = reinterpret_cast<dispatcher *>(z->owner);
+        if (status < 0) {
+            pruv_log_uv_err(LOG_ERR, "poll_cb", status);
+            return d->stop_zygote();
+        }
+        d->on_zygote_read();
+    };
+    if ((r = uv_poll_start(&z->ctl_poll, UV_READABLE, poll_cb)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_start", r);
+        stop_zygote();
+        return false;
+    }
+    return true;
+}
+
+void dispatcher::stop_zygote() noexcept
+{
+    if (!zygote || zygote->terminated)
+        return;
+    zygote->terminated = true;
+    int r;
+    if ((r = zygote->send_signal(SIGTERM)) < 0)
+        pruv_log_uv_err(LOG_ERR, "uv_kill", r);
+}
+
+void dispatcher::on_zygote_read() noexcept
+{
+    assert(zygote);
+    for (;;) {
+        zygote_child_cmd cmd;
+        ssize_t r = recv(zygote->ctl_fd, &cmd, sizeof(cmd), 0);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                pruv_log_syserr(LOG_ERR, "recv(zygote)");
+                stop_zygote();
+            }
+            return;
+        }
+        if (!r)
+            // Zygote exits. Exit callback will be called.
+            return (void)uv_poll_stop(&zygote->ctl_poll);
+        bool forked = valid_cmd_header(cmd.hdr, CMD_ZYGOTE_FORKED);
+        if (r != sizeof(cmd) || cmd.hdr.size != sizeof(cmd) ||
+            (!forked && !valid_cmd_header(cmd.hdr, CMD_ZYGOTE_EXITED))) {
+            pruv_log(LOG_ERR, "Invalid message from zygote");
+            return stop_zygote();
+        }
+
+        if (!forked) {
+            worker_process *w = find_worker([&cmd](const worker_process &w) {
+                return w.cookie && w.pid == cmd.pid && !w.exited;
+            });
+            if (w)
+                on_worker_exit(w, cmd.exit_code, cmd.term_signal);
+            continue;
+        }
+
+        worker_process *w = find_worker([&cmd](const worker_process &w) {
+            return w.cookie == cmd.cookie;
+        });
+        if (!w) {
+            pruv_log(LOG_ERR, "Unknown worker forked by zygote");
+            continue;
+        }
+        if (cmd.pid <= 0) {
+            pruv_log(LOG_ERR, "Zygote can't fork worker: %s",
+                    strerror(-cmd.pid));
+            on_worker_exit(w, -1, 0);
+            continue;
+        }
+        w->pid = cmd.pid;
+        pruv_log(LOG_NOTICE, "Worker process %d forked.", w->pid);
+        int r2;
+        if (w->killed && (r2 = w->send_signal(SIGTERM)) < 0)
+            pruv_log_uv_err(LOG_ERR, "uv_kill", r2);
+    }
+}
+
+void dispatcher::on_zygote_exit(int64_t exit_code, int sig) noexcept
+{
+    pruv_log(LOG_NOTICE, "Zygote %d exited with code %" PRId64
+            " caused signal %d.", zygote->pid, exit_code, sig);
+    zygote_process *z = zygote;
+    zygote = nullptr;
+    if (z->ctl_poll.data)
+        uv_close((uv_handle_t *)&z->ctl_poll, process::close_cb);
+    z->stop();
+    // Forked workers are terminated by PR_SET_PDEATHSIG and nobody reports
+    // their exit. Treat them as exited now.
+    while (worker_process *w = find_worker([](const worker_process &w) {
+                return w.cookie && !w.exited;
+            }))
+        on_worker_exit(w, -1, 0);
+}
+
+bool dispatcher::start_ring_poll(worker_process *w) noexcept
+{
+    int r;
+    if ((r = uv_poll_init(loop, &w->ring_poll, w->ring.resp_efd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_init", r);
+        return false;
+    }
+    // Closed in on_worker_exit with process::close_cb.
+    w->ring_poll.data = static_cast<process *>(w);
+    ++w->wait_close;
+
+    auto poll_cb = [](uv_poll_t *h, int status, int /*events*/) {
+        process *p = reinterpret_cast<process *>(h->data);
+        worker_process *w = static_cast<worker_process *>(p);
+        dispatcher *d = reinterpret_cast<dispatcher *>(w->owner);
+        if (status < 0) {
+            pruv_log_uv_err(LOG_ERR, "poll_cb", status);
+            return d->kill_worker(w);
+        }
+        d->on_worker_ring(w);
+    };
+    if ((r = uv_poll_start(&w->ring_poll, UV_READABLE, poll_cb)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_start", r);
+        uv_close((uv_handle_t *)&w->ring_poll, process::close_cb);
+        return false;
+    }
+    return true;
+}
+
+void dispatcher::spawn_spares() noexcept
+{
+    if (!worker_name || draining)
+        return; // Dispatcher stopped or doesn't accept new connections.
+    // Starting workers will be idle soon.
+    size_t idle = free_workers.size() + starting_cnt;
+    while ((workers_cnt < workers_min || idle < workers_spare) &&
+           workers_cnt < workers_max) {
+        size_t prev_cnt = workers_cnt;
+        spawn_worker();
+        if (workers_cnt == prev_cnt)
+            break; // Spawn failed. Try again later.
+        ++idle;
+    }
+}
+
+void dispatcher::reap_idle_workers() noexcept
+{
+    if (!worker_idle_timeout)
+        return;
+    uint64_t now = uv_now(loop);
+    size_t idle = free_workers.size();
+    size_t alive = workers_cnt;
+    for (const worker_process &w : terminated_workers)
+        alive -= !w.exited;
+    // The front worker is idle for the longest time.
+    while (idle > workers_spare && alive > workers_min &&
+           free_workers.front().idle_since + worker_idle_timeout <= now) {
+        pruv_log(LOG_INFO, "Terminate idle worker %d",
+                free_workers.front().pid);
+        kill_worker(&free_workers.front());
+        --idle;
+        --alive;
+    }
+}
+
+dispatcher::worker_process * dispatcher::take_worker() noexcept
+{
+    // The most recently used worker is taken. So extra workers stay idle
+    // and are reaped.
+    if (!free_workers.empty())
+        return &free_workers.back();
+
+    // Spawn worker for each waiting request, which will not be taken by
+    // already starting workers. Requests are sent to new worker when it
+    // becomes ready, not queued to busy ones, so each starting worker
+    // keeps its request. Draining dispatcher finishes requests by running
+    // workers.
+    if (workers_cnt < workers_max && (!draining || !workers_cnt)) {
+        size_t waiting = 0;
+        for (auto it = clients_scheduling.begin();
+                it != clients_scheduling.end() && waiting <= starting_cnt; ++it)
+            ++waiting;
+        if (waiting <= starting_cnt)
+            return nullptr;
+        size_t prev_cnt = workers_cnt;
+        spawn_worker();
+        if (workers_cnt != prev_cnt)
+            return nullptr;
+    }
+
+    // All workers are busy and no more can be spawned. Queue request to the
+    // least loaded one. Without such worker requests stay queued. Spawning
+    // is retried by timer tick and SCHEDULING_TIMEOUT closes connections.
+    worker_process *best = nullptr;
+    for (worker_process &w : in_use_workers)
+        if (w.binary && w.inflight < w.depth &&
+            (!best || w.inflight < best->inflight))
+            best = &w;
+
+    return best;
 }
 
 void dispatcher::kill_worker(worker_process *w) noexcept
 {
     assert(loop);
-    if (w->processed_con)
-        w->processed_con->remove_from_dispatcher();
+    w->killed = true;
+    for (size_t i = 0; i < w->depth; ++i)
+        if (w->tasks[i].con)
+            w->tasks[i].con->remove_from_dispatcher();
     // Stop reading pipe to not receive eof,
     // because on_worker_read assumes loop is not null.
     int r;
     if ((r = uv_read_stop((uv_stream_t *)&w->out)) < 0)
         pruv_log_uv_err(LOG_ERR, "uv_read_stop", r);
-    if (!w->exited && (r = uv_process_kill(w, SIGTERM)) < 0)
-        pruv_log_uv_err(LOG_ERR, "uv_process_kill", r);
+    if (w->ring.opened() && (r = uv_poll_stop(&w->ring_poll)) < 0)
+        pruv_log_uv_err(LOG_ERR, "uv_poll_stop", r);
+    if (!w->exited && (r = w->send_signal(SIGTERM)) < 0)
+        pruv_log_uv_err(LOG_ERR, "uv_kill", r);
     w->unlink();
     w->timeout = uv_now(loop) + KILL_TIMEOUT;
     terminated_workers.push_back(*w);
@@ -211,15 +801,29 @@ void dispatcher::on_worker_exit(worker_process *w, int64_t exit_code, int sig)
     pruv_log(LOG_NOTICE, "Worker %d exited with code %" PRId64
             " caused signal %d.", w->pid, exit_code, sig);
     w->exited = true;
-    if (w->processed_con)
-        w->processed_con->remove_from_dispatcher();
-    // Buffers may be safely reused only after worker exit.
-    if (w->in_buf)
-        return_buffer(&w->in_buf, true);
-    if (w->out_buf)
-        return_buffer(&w->out_buf, false);
+    if (!w->ready)
+        --starting_cnt;
+    for (size_t i = 0; i < w->depth; ++i) {
+        worker_task &t = w->tasks[i];
+        if (t.con)
+            t.con->remove_from_dispatcher();
+        // Buffers may be safely reused only after worker exit.
+        if (t.in_buf)
+            return_buffer(&t.in_buf, true);
+        if (t.out_buf)
+            return_buffer(&t.out_buf, false);
+        t.state = worker_task::TASK_FREE;
+    }
+    w->inflight = w->reading = 0;
+    if (w->ring.opened())
+        uv_close((uv_handle_t *)&w->ring_poll, process::close_cb);
     w->stop();
+    // Exited worker must not be taken from free_workers until deleted.
+    w->unlink();
     --workers_cnt;
+    if (!worker_name && !workers_cnt)
+        // Dispatcher stopped. Zygote isn't needed to report exits anymore.
+        stop_zygote();
     schedule();
 }
 
@@ -237,11 +841,15 @@ void dispatcher::on_connection(uv_stream_t *server, int status) noexcept
 
     auto deleter = [](tcp_con *p) {
         tcp_context *con = static_cast<tcp_context *>(p);
+        // io_uring writes still refer to connection.
+        if (con->uring_writes)
+            return (void)(con->closed = true);
         con->get_dispatcher()->free_connection(con);
     };
 
     if (!con->accept(loop, server, this, deleter) || !con->read_start())
         return con->remove_from_dispatcher(); // deleter will be called later.
+    con->set_options(sock_opts);
 
     move_to(tcp_context::LIST_IDLE, con);
 }
@@ -252,7 +860,8 @@ void dispatcher::read_con_alloc_cb(tcp_context *con, size_t /*suggested_size*/,
     assert(loop);
     *b = uv_buf_init(nullptr, 0);
 
-    // Start new request reading.
+    // Start new request reading. Without buffer read_con_cb gets
+    // UV_ENOBUFS and pauses reading or closes connection.
     if (!con->read_buffer && !(con->read_buffer = get_buffer(true)))
         return;
 
@@ -266,6 +875,14 @@ void dispatcher::read_con_cb(tcp_context *con, ssize_t nread, const uv_buf_t *)
     noexcept
 {
     assert(loop);
+    if (nread == UV_ENOBUFS && !con->read_buffer && req_pool.exhausted) {
+        // Data stays in socket until a request buffer is returned.
+        if (!con->read_stop())
+            return con->remove_from_dispatcher();
+        con->read_paused = true;
+        ++paused_reads;
+        return;
+    }
     if (nread < 0) {
         pruv_log_uv_err(nread == UV_EOF ? LOG_DEBUG : LOG_ERR, "", nread);
         return con->remove_from_dispatcher();
@@ -295,8 +912,12 @@ void dispatcher::read_con_cb(tcp_context *con, ssize_t nread, const uv_buf_t *)
         if (!con->parse_request(nullptr))
             con->remove_from_dispatcher();
         else if (con->list_id == tcp_context::LIST_IO &&
-                con->resp_buffers.empty())
-            move_to(tcp_context::LIST_IDLE, con);
+                con->resp_buffers.empty()) {
+            if (draining)
+                con->remove_from_dispatcher();
+            else
+                move_to(tcp_context::LIST_IDLE, con);
+        }
     }
 }
 
@@ -329,31 +950,119 @@ void dispatcher::respond_or_enqueue(tcp_context *con) noexcept
 void dispatcher::schedule() noexcept
 {
     assert(loop);
-    if (clients_scheduling.empty() ||
-        (workers_cnt >= workers_max && free_workers.empty()))
+    if (clients_scheduling.empty())
         return;
 
-    if (free_workers.empty()) {
-        spawn_worker();
-        if (free_workers.empty()) {
-            // Сan't serve any request if spawning worker failed.
-            pruv_log(LOG_ERR, "No worker for request. Close connections.");
-            return close_connections(clients_scheduling);
+    worker_process *wp = take_worker();
+    if (!wp)
+        return;
+    worker_process &w = *wp;
+
+    uv_buf_t bufs[1 + REQUEST_BUFS * REQUEST_BATCH_MAX];
+    size_t bn = 0;
+    // Ring setup goes through pipe before the first binary request.
+    bool setup_ring = w.binary && !w.ring_active && w.ring.opened();
+    if (setup_ring) {
+        w.ring_setup.hdr = make_cmd_header(CMD_RING_SETUP, 0,
+                sizeof(w.ring_setup));
+        w.ring_setup.capacity = RING_CAPACITY;
+        w.ring_setup.mem_fd = RING_MEM_FD;
+        w.ring_setup.cmd_efd = RING_CMD_EFD;
+        w.ring_setup.resp_efd = RING_RESP_EFD;
+        bufs[bn++] = uv_buf_init((char *)&w.ring_setup, sizeof(w.ring_setup));
+    }
+
+    // Waiting requests are sent in one write, when there is no idle worker
+    // for them.
+    worker_task *batch = nullptr;
+    size_t cnt = 0;
+    do {
+        worker_task *t = prepare_request(w, bufs, bn);
+        if (!t)
+            break;
+        t->batch_next = batch;
+        batch = t;
+    } while (w.binary && ++cnt < request_batch && w.inflight < w.depth &&
+             free_workers.empty() && !clients_scheduling.empty());
+    if (!batch || w.killed)
+        return;
+
+    if (w.ring_active) {
+        // uv_buf_t is binary compatible with iovec on unix.
+        bool notify;
+        if (w.ring.cmd.write((const iovec *)bufs, bn, notify)) {
+            if (notify && !ring_channel::notify(w.ring.cmd_efd))
+                return kill_worker(&w);
+            pruv_log(LOG_DEBUG, "request sent to worker through ring");
+            on_requests_written(batch);
+            return;
         }
+        // Ring is full. Request goes through pipe.
+    }
+
+    batch->write_req.data = batch;
+    int r = uv_write(&batch->write_req, (uv_stream_t *)&w.in, bufs, bn,
+        [](uv_write_t *req, int status) {
+            // This callback may be called after worker death.
+            // But worker_process structure will alive while pipe's
+            // structures alive.
+            worker_task *t = reinterpret_cast<worker_task *>(req->data);
+            worker_process *w = t->worker;
+            dispatcher *d = reinterpret_cast<dispatcher *>(w->owner);
+            if (status != 0) {
+                pruv_log_uv_err(LOG_ERR, "write_cb", status);
+                // Worker may be already killed and task released.
+                if (!w->killed)
+                    d->kill_worker(w);
+                return;
+            }
+            pruv_log(LOG_DEBUG, "request sent to worker");
+            d->on_requests_written(t);
+        });
+    if (r < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_write", r);
+        return kill_worker(&w); // Connection will be closed here too
+    }
+    if (setup_ring)
+        w.ring_active = true;
+}
+
+void dispatcher::on_requests_written(worker_task *batch) noexcept
+{
+    while (batch) {
+        worker_task *t = batch;
+        batch = t->batch_next;
+        t->batch_next = nullptr;
+        if (t->state != worker_task::TASK_WRITE)
+            continue; // Worker exited and task released.
+        t->state = worker_task::TASK_READ;
+        ++t->worker->reading;
     }
+}
 
-    shmem_buffer_node *resp_buf = get_buffer(false);
-    if (!resp_buf) {
-        // Сan't serve any request if opening buffer failed.
-        pruv_log(LOG_ERR, "No buffer for response. Close connections.");
-        return close_connections(clients_scheduling);
+dispatcher::worker_task * dispatcher::prepare_request(worker_process &w,
+        uv_buf_t *bufs, size_t &bn) noexcept
+{
+    // Binary worker responds from its own buffer if it's allowed.
+    bool own_resp = worker_buffers && w.binary;
+    shmem_buffer_node *resp_buf = own_resp ? nullptr : get_buffer(false,
+            clients_scheduling.front().resp_size_hint);
+    if (!own_resp && !resp_buf && resp_pool.exhausted)
+        return nullptr; // Requests wait for returning of response buffer.
+    if (!own_resp && !resp_buf) {
+        pruv_log(LOG_ERR, "No buffer for response. Close connection.");
+        clients_scheduling.front().remove_from_dispatcher();
+        return nullptr;
     }
 
-    // take worker for request
-    worker_process &w = free_workers.front();
-    assert(w.io_state == worker_process::IO_IDLE);
-    // pipe_buf_ptr moved to start when state became IO_IDLE
-    assert(w.pipe_buf_ptr == w.pipe_buf);
+    // take free task for request
+    assert(w.inflight < w.depth);
+    // Text request is written from pipe_buf only to idle worker.
+    assert(w.binary || (!w.inflight && w.pipe_buf_ptr == w.pipe_buf));
+    size_t tag = 0;
+    while (w.tasks[tag].state != worker_task::TASK_FREE)
+        ++tag;
+    worker_task &t = w.tasks[tag];
 
     // make request params to send into worker
     tcp_context *con = nullptr;
@@ -361,10 +1070,13 @@ void dispatcher::schedule() noexcept
     while (!clients_scheduling.empty()) {
         con = &clients_scheduling.front();
         if (con->read_buffer) {
+            if (w.binary) // Binary frame has no length limits.
+                break;
             req_len = snprintf(w.pipe_buf, sizeof(w.pipe_buf),
                 "IN SHM %s %" PRIuPTR ", %" PRIuPTR
-                " OUT SHM %s %" PRIuPTR " META ", con->read_buffer->name(),
-                con->request.pos, con->request.size, resp_buf->name(),
+                " OUT SHM %s %" PRIuPTR " META ",
+                con->read_buffer->ref_name(), con->request.pos,
+                con->request.size, resp_buf->ref_name(),
                 resp_buf->file_size());
             if (req_len >= 0 && req_len < (int)sizeof(w.pipe_buf))
                 break;
@@ -373,49 +1085,99 @@ void dispatcher::schedule() noexcept
         con->remove_from_dispatcher();
         con = nullptr;
     }
-    if (!con)
-        return return_buffer(&resp_buf, false);
+    if (!con) {
+        if (resp_buf)
+            return_buffer(&resp_buf, false);
+        return nullptr;
+    }
 
     // Connect request and worker.
-    w.unlink();
-    w.processed_con = con;
-    w.in_buf = con->read_buffer;
-    w.out_buf = resp_buf; // buffer owned by worker for processing time
-    con->worker = &w;
-    w.timeout = uv_now(loop) + PROCESSING_TIMEOUT;
-    in_use_workers.push_back(w);
+    t.con = con;
+    t.in_buf = con->read_buffer;
+    t.out_buf = resp_buf; // buffer owned by task for processing time
+    con->task = &t;
+    t.timeout = uv_now(loop) + PROCESSING_TIMEOUT;
+    if (!w.inflight++) {
+        w.timeout = t.timeout;
+        w.unlink();
+        in_use_workers.push_back(w);
+        spawn_spares();
+    }
     move_to(tcp_context::LIST_PROCESSING, con);
 
-    // Send request to worker.
-    w.write_req.data = &w;
-    w.io_state = worker_process::IO_WRITE;
-    uv_buf_t bufs[3] = {uv_buf_init(w.pipe_buf, req_len)};
-    size_t bn = 1;
-    if (con->request.meta && *con->request.meta)
-        bufs[bn++] = {const_cast<char *>(con->request.meta),
-            strlen(con->request.meta)};
-    bufs[bn++] = uv_buf_init(&(w.pipe_buf[req_len] = '\n'), 1);
-    int r = uv_write(&w.write_req, (uv_stream_t *)&w.in, bufs, bn,
-        [](uv_write_t *req, int status) {
-            // This callback may be called after worker death.
-            // But worker_process structure will alive while pipe's
-            // structures alive.
-            worker_process *w = reinterpret_cast<worker_process *>(req->data);
-            dispatcher *d = reinterpret_cast<dispatcher *>(w->owner);
-            if (status != 0) {
-                pruv_log_uv_err(LOG_ERR, "write_cb", status);
-                return d->kill_worker(w);
-            }
-            pruv_log(LOG_DEBUG, "request sent to worker");
-            assert(w->io_state == worker_process::IO_WRITE);
-            // Before writing pipe_buf_ptr was at start. Writing don't move it.
-            assert(w->pipe_buf_ptr == w->pipe_buf);
-            w->io_state = worker_process::IO_READ;
-        });
-    if (r < 0) {
-        pruv_log_uv_err(LOG_ERR, "uv_write", r);
+    // Small request is copied into frame if it's mapped.
+    const char *inline_req = nullptr;
+    if (w.binary && inline_threshold &&
+        con->request.size <= inline_threshold) {
+        size_t off = t.in_buf->map_offset();
+        size_t len = t.in_buf->map_end() - t.in_buf->map_begin();
+        if (off <= con->request.pos &&
+            con->request.pos + con->request.size <= off + len)
+            inline_req = t.in_buf->map_begin() + (con->request.pos - off);
+    }
+
+    // Make frames of request.
+    t.state = worker_task::TASK_WRITE;
+    if ((!inline_req && !send_buffer_fd(w, *t.in_buf)) ||
+        (resp_buf && !send_buffer_fd(w, *resp_buf))) {
         kill_worker(&w); // Connection will be closed here too
+        return nullptr;
+    }
+    size_t meta_len = con->request.meta ? strlen(con->request.meta) : 0;
+    if (w.binary) {
+        // Memfd and registered buffers are referred by ids.
+        bool ids = t.in_buf->gen;
+        size_t in_name_len = ids || inline_req ? 0 : strlen(t.in_buf->name());
+        size_t out_name_len = ids || own_resp ? 0 : strlen(resp_buf->name());
+        size_t inline_len = inline_req ? con->request.size : 0;
+        uint32_t flags = ids ? CMD_F_BUFFER_IDS : 0;
+        if (inline_req)
+            flags |= CMD_F_INLINE_REQUEST;
+        if (inline_threshold)
+            flags |= CMD_F_INLINE_RESPONSE;
+        if (own_resp)
+            flags |= CMD_F_WORKER_BUFFER;
+        if (draining)
+            flags |= CMD_F_CLOSE;
+        t.cmd.hdr = make_cmd_header(CMD_REQUEST, flags, sizeof(t.cmd) +
+                in_name_len + out_name_len + meta_len + inline_len);
+        t.cmd.in_pos = con->request.pos;
+        t.cmd.in_len = con->request.size;
+        t.cmd.out_file_size = resp_buf ? resp_buf->file_size() : 0;
+        t.cmd.in_name_len = in_name_len;
+        t.cmd.out_name_len = out_name_len;
+        t.cmd.meta_len = meta_len;
+        t.cmd.tag = tag;
+        t.cmd.in_id = t.in_buf->id;
+        t.cmd.in_gen = t.in_buf->gen;
+        t.cmd.out_id = resp_buf ? resp_buf->id : 0;
+        t.cmd.out_gen = resp_buf ? resp_buf->gen : 0;
+        t.cmd.in_slot = t.in_buf->slot;
+        t.cmd.out_slot = resp_buf ? resp_buf->slot : 0;
+        t.cmd.inline_max = inline_threshold;
+        t.cmd.reserved = 0;
+        bufs[bn++] = uv_buf_init((char *)&t.cmd, sizeof(t.cmd));
+        if (!ids) {
+            bufs[bn++] = uv_buf_init(const_cast<char *>(t.in_buf->name()),
+                    in_name_len);
+            bufs[bn++] = uv_buf_init(const_cast<char *>(
+                        resp_buf ? resp_buf->name() : ""), out_name_len);
+        }
+        if (meta_len)
+            bufs[bn++] = uv_buf_init(const_cast<char *>(con->request.meta),
+                    meta_len);
+        if (inline_len)
+            bufs[bn++] = uv_buf_init(const_cast<char *>(inline_req),
+                    inline_len);
+    }
+    else {
+        bufs[bn++] = uv_buf_init(w.pipe_buf, req_len);
+        if (meta_len)
+            bufs[bn++] = uv_buf_init(const_cast<char *>(con->request.meta),
+                    meta_len);
+        bufs[bn++] = uv_buf_init(&(w.pipe_buf[req_len] = '\n'), 1);
     }
+    return &t;
 }
 
 void dispatcher::on_worker_read(worker_process *w, ssize_t nread,
@@ -427,62 +1189,252 @@ void dispatcher::on_worker_read(worker_process *w, ssize_t nread,
         return kill_worker(w);
     }
 
-    if (w->io_state != worker_process::IO_READ) {
+    if (w->ready && !w->reading) {
         pruv_log(LOG_ERR, "Worker not in read state");
         return kill_worker(w);
     }
 
+    if (w->inline_left) {
+        // Data of inline response is read into out buffer (see alloc_cb).
+        w->inline_ptr += nread;
+        w->inline_left -= nread;
+        if (!w->inline_left)
+            on_worker_response(w, w->inline_cmd);
+        return;
+    }
+
     w->pipe_buf_ptr += nread;
 
-    // Read until end of line.
-    if (!nread || buf->base[nread - 1] != '\n')
-        return;
+    if ((unsigned char)w->pipe_buf[0] == CMD_MAGIC) {
+        // Binary frames. Several frames may be read at once.
+        // Each frame is removed from pipe_buf before handling, because
+        // handlers may send text request from pipe_buf.
+        cmd_header hdr;
+        while (w->pipe_buf_ptr - w->pipe_buf >= (ptrdiff_t)sizeof(hdr) &&
+               (unsigned char)w->pipe_buf[0] == CMD_MAGIC) {
+            memcpy(&hdr, w->pipe_buf, sizeof(hdr));
+            bool ready = valid_cmd_header(hdr, CMD_READY) &&
+                hdr.size == sizeof(hdr);
+            bool inl = !ready && (hdr.flags & CMD_F_INLINE_RESPONSE);
+            if (!ready && (!valid_cmd_header(hdr, CMD_RESPONSE) ||
+                           (inl ? hdr.size < sizeof(response_cmd) :
+                                  hdr.size != sizeof(response_cmd)))) {
+                pruv_log(LOG_ERR, "Invalid binary frame from worker");
+                return kill_worker(w);
+            }
+            size_t len = ready ? hdr.size : sizeof(response_cmd);
+            size_t rest = w->pipe_buf_ptr - w->pipe_buf;
+            if (rest < len)
+                break;
+            response_cmd cmd;
+            memcpy(&cmd, w->pipe_buf, len);
+            rest -= len;
+            char *dst = nullptr;
+            size_t part = 0;
+            if (inl) {
+                if (!(dst = inline_response_dst(w, cmd)))
+                    return;
+                part = std::min<size_t>(rest, cmd.data_size);
+                memcpy(dst, w->pipe_buf + len, part);
+                len += part;
+                rest -= part;
+            }
+            memmove(w->pipe_buf, w->pipe_buf + len, rest);
+            w->pipe_buf_ptr = w->pipe_buf + rest;
+            if (inl && part < cmd.data_size) {
+                // The rest of inline data is read directly into out buffer.
+                assert(inl && !rest);
+                w->inline_cmd = cmd;
+                w->inline_ptr = dst + part;
+                w->inline_left = cmd.data_size - part;
+                return;
+            }
+            if (ready ? !on_worker_ready(w, hdr.flags) :
+                        !on_worker_response(w, cmd))
+                return;
+        }
+    }
+    else {
+        // Read until end of line.
+        if (!nread || buf->base[nread - 1] != '\n')
+            return;
 
-    // Now response from worker fully received.
-    pruv_log(LOG_DEBUG, "Response received from worker");
-
-    // Parse response length.
-    buf->base[nread - 1] = 0;
-    size_t resp_len;
-    size_t resp_file_size;
-    if (sscanf(w->pipe_buf, "RESP %" SCNuPTR " of %" SCNuPTR " END",
-                &resp_len, &resp_file_size) != 2) {
-        pruv_log(LOG_ERR, "sscanf can't parse response \"%s\".", buf->base);
-        return kill_worker(w);
+        buf->base[nread - 1] = 0;
+        if (!strcmp(w->pipe_buf, "READY")) {
+            w->pipe_buf_ptr = w->pipe_buf;
+            on_worker_ready(w, 0);
+            return;
+        }
+
+        // Parse response length.
+        size_t resp_len;
+        size_t resp_file_size;
+        if (sscanf(w->pipe_buf, "RESP %" SCNuPTR " of %" SCNuPTR " END",
+                    &resp_len, &resp_file_size) != 2) {
+            pruv_log(LOG_ERR, "sscanf can't parse response \"%s\".",
+                    buf->base);
+            return kill_worker(w);
+        }
+        response_cmd cmd;
+        cmd.hdr = make_cmd_header(CMD_RESPONSE, 0, sizeof(cmd));
+        cmd.data_size = resp_len;
+        cmd.file_size = resp_file_size;
+        cmd.tag = 0; // Text request is the only one in worker.
+        w->pipe_buf_ptr = w->pipe_buf;
+        on_worker_response(w, cmd);
+    }
+}
+
+bool dispatcher::on_worker_ready(worker_process *w, uint32_t flags) noexcept
+{
+    if (w->ready) {
+        pruv_log(LOG_ERR, "Worker %d is already ready", w->pid);
+        kill_worker(w);
+        return false;
+    }
+    pruv_log(LOG_INFO, "Worker %d ready", w->pid);
+    w->ready = true;
+    if (flags & CMD_F_BINARY_REQUESTS) {
+        pruv_log(LOG_DEBUG, "Worker %d accepts binary requests", w->pid);
+        w->binary = true;
+    }
+    --starting_cnt;
+    w->idle_since = uv_now(loop);
+    w->unlink();
+    free_workers.push_back(*w);
+    // Each call schedules one request. Ready worker may take several of
+    // waiting requests.
+    do
+        schedule();
+    while (!clients_scheduling.empty() && !free_workers.empty());
+    return !w->killed;
+}
+
+void dispatcher::on_worker_ring(worker_process *w) noexcept
+{
+    assert(loop);
+    shmem_ring &ring = w->ring.resp;
+    ring_channel::drain(w->ring.resp_efd);
+    ring.wake_up();
+    do {
+        // Worker writes whole frame at once.
+        while (ring.readable()) {
+            response_cmd cmd;
+            if (ring.readable() < sizeof(cmd)) {
+                pruv_log(LOG_ERR, "Partial response in ring");
+                return kill_worker(w);
+            }
+            ring.read(&cmd, sizeof(cmd));
+            bool inl = cmd.hdr.flags & CMD_F_INLINE_RESPONSE;
+            if (!valid_cmd_header(cmd.hdr, CMD_RESPONSE) ||
+                (!inl && cmd.hdr.size != sizeof(cmd))) {
+                pruv_log(LOG_ERR, "Invalid binary response from worker");
+                return kill_worker(w);
+            }
+            if (inl) {
+                char *dst = inline_response_dst(w, cmd);
+                if (!dst)
+                    return;
+                if (ring.readable() < cmd.data_size) {
+                    pruv_log(LOG_ERR, "Partial response in ring");
+                    return kill_worker(w);
+                }
+                ring.read(dst, cmd.data_size);
+            }
+            if (!on_worker_response(w, cmd))
+                return;
+        }
+    } while (!ring.prepare_sleep());
+}
+
+char * dispatcher::inline_response_dst(worker_process *w,
+        const response_cmd &cmd) noexcept
+{
+    if (cmd.hdr.size != sizeof(cmd) + cmd.data_size ||
+        cmd.data_size > inline_threshold || cmd.tag >= w->depth ||
+        w->tasks[cmd.tag].state != worker_task::TASK_READ) {
+        pruv_log(LOG_ERR, "Invalid inline response from worker");
+        kill_worker(w);
+        return nullptr;
     }
+    // Worker's buffers are used only for not inline responses.
+    worker_task &t = w->tasks[cmd.tag];
+    if (!t.out_buf && !(t.out_buf = get_buffer(false))) {
+        pruv_log(LOG_ERR, "No buffer for inline response");
+        kill_worker(w);
+        return nullptr;
+    }
+    // Buffer is mapped from its beginning at least for RESPONSE_CHUNK.
+    shmem_buffer_node *buf = t.out_buf;
+    assert(!buf->cur_pos());
+    return buf->map_ptr();
+}
+
+bool dispatcher::on_worker_response(worker_process *w,
+        const response_cmd &cmd) noexcept
+{
+    if (cmd.tag >= w->depth ||
+        w->tasks[cmd.tag].state != worker_task::TASK_READ) {
+        pruv_log(LOG_ERR, "Unexpected response from worker");
+        kill_worker(w);
+        return false;
+    }
+    worker_task &t = w->tasks[cmd.tag];
+    size_t resp_len = cmd.data_size;
+    size_t resp_file_size = cmd.file_size;
+
+    // Now response from worker fully received.
     pruv_log(LOG_DEBUG, "Response of %" PRIuPTR " bytes ready", resp_len);
 
-    assert(w->in_buf);
-    assert(w->out_buf);
+    assert(t.in_buf);
+    if (cmd.hdr.flags & CMD_F_WORKER_BUFFER) {
+        if (t.out_buf || !(t.out_buf = worker_buffer(w, cmd.buf_id))) {
+            pruv_log(LOG_ERR, "Invalid worker's buffer in response");
+            kill_worker(w);
+            return false;
+        }
+    }
+    assert(t.out_buf);
     // To reduce number of ftruncate syscals transfer changed size of shared
     // memory object through pipe.
-    w->out_buf->update_file_size(resp_file_size);
+    if (!(cmd.hdr.flags & CMD_F_INLINE_RESPONSE))
+        t.out_buf->update_file_size(resp_file_size);
     tcp_context *con = nullptr;
-    if (w->processed_con) {
-        con = w->processed_con;
-        w->processed_con = nullptr;
-        con->worker = nullptr;
+    if (t.con) {
+        con = t.con;
+        t.con = nullptr;
+        con->task = nullptr;
         assert(con->list_id == tcp_context::LIST_PROCESSING);
 
-        assert(!con->read_buffer || con->read_buffer == w->in_buf);
-        w->in_buf = nullptr;
+        assert(!con->read_buffer || con->read_buffer == t.in_buf);
+        t.in_buf = nullptr;
 
-        assert(!w->out_buf->cur_pos());
-        assert(w->out_buf->map_ptr() != w->out_buf->map_end());
-        w->out_buf->set_data_size(resp_len);
-        con->resp_buffers.push_back(*w->out_buf);
-        w->out_buf = nullptr;
+        assert(!t.out_buf->cur_pos());
+        assert(t.out_buf->map_ptr() != t.out_buf->map_end());
+        t.out_buf->set_data_size(resp_len);
+        con->resp_size_hint = resp_len;
+        con->resp_buffers.push_back(*t.out_buf);
+        t.out_buf = nullptr;
     }
     else {
         // Connection was closed before worker processing finished.
-        return_buffer(&w->in_buf, true);
-        return_buffer(&w->out_buf, false);
+        return_buffer(&t.in_buf, true);
+        return_buffer(&t.out_buf, false);
     }
 
-    w->io_state = worker_process::IO_IDLE;
-    w->pipe_buf_ptr = w->pipe_buf;
-    w->unlink();
-    free_workers.push_back(*w);
+    t.state = worker_task::TASK_FREE;
+    --w->reading;
+    if (!--w->inflight) {
+        w->idle_since = uv_now(loop);
+        w->unlink();
+        free_workers.push_back(*w);
+    }
+    else {
+        w->timeout = UINT64_MAX;
+        for (size_t i = 0; i < w->depth; ++i)
+            if (w->tasks[i].state != worker_task::TASK_FREE)
+                w->timeout = std::min(w->timeout, w->tasks[i].timeout);
+    }
 
     if (con) {
         if (!con->response_ready(con->read_buffer, con->request,
@@ -513,6 +1465,7 @@ void dispatcher::on_worker_read(worker_process *w, ssize_t nread,
             con->remove_from_dispatcher();
     }
     schedule();
+    return !w->killed;
 }
 
 void dispatcher::write_con(tcp_context *con) noexcept
@@ -527,17 +1480,57 @@ void dispatcher::write_con(tcp_context *con) noexcept
     if (con->list_id == tcp_context::LIST_IO)
         move_to(tcp_context::LIST_IO, con);
 
-    shmem_buffer_node *buf = &con->resp_buffers.front();
-    if (buf->map_ptr() == buf->map_end()) {
-        // Mapped chunk was fully written. Map next chunk.
-        size_t map_size = std::min(RESPONSE_CHUNK,
-                buf->data_size() - buf->cur_pos());
-        if (!buf->map(buf->cur_pos(), map_size))
-            return con->remove_from_dispatcher();
+    shmem_buffer_node &front = con->resp_buffers.front();
+    if (use_sendfile && !front.is_view() &&
+        front.data_size() - front.cur_pos() > RESPONSE_CHUNK) {
+        if (sendfile_con(con))
+            return;
+        pruv_log(LOG_WARNING, "Buffers don't support sendfile()");
+        use_sendfile = false;
     }
+    // Large response is written by windows, two of them are in flight.
+    if (!front.contiguous() && !front.is_view() &&
+        front.data_size() - front.cur_pos() > RESPONSE_CHUNK)
+        return stream_con(con);
+
+    // Ready responses are written together. Response is parsed only after
+    // previous one is finished, so they are finished while gathering.
+    uv_buf_t wbufs[WRITE_BUFS_MAX];
+    con->write_close = false;
+    size_t cnt = 0;
+    size_t bytes = 0;
+    size_t last = 0;
+    auto it = con->resp_buffers.begin();
+    for (;;) {
+        shmem_buffer_node &buf = *it;
+        if (buf.map_ptr() == buf.map_end()) {
+            // Mapped chunk was fully written. Map next chunk or the rest of
+            // contiguous buffer or view, which doesn't make syscalls.
+            size_t map_size = buf.data_size() - buf.cur_pos();
+            if (!buf.contiguous() && !buf.is_view())
+                map_size = std::min(RESPONSE_CHUNK, map_size);
+            if (!buf.map(buf.cur_pos(), map_size))
+                return con->remove_from_dispatcher();
+        }
 
-    if (!con->parse_response(*buf))
-        return con->remove_from_dispatcher();
+        if (!con->parse_response(buf))
+            return con->remove_from_dispatcher();
+
+        // Can be 0 for empty response
+        last = std::min(size_t(buf.map_end() - buf.map_ptr()),
+                buf.data_size() - buf.cur_pos());
+        wbufs[cnt++] = uv_buf_init(buf.map_ptr(), last);
+        bytes += last;
+        if (buf.cur_pos() + last < buf.data_size() ||
+            cnt == WRITE_BUFS_MAX || bytes >= WRITE_BYTES_MAX ||
+            ++it == con->resp_buffers.end())
+            break;
+        if (!con->finish_response(buf)) {
+            // Connection is closed after this response.
+            con->write_close = true;
+            break;
+        }
+    }
 
     auto write_cb = [](uv_write_t *r, int status) {
         tcp_context *con = static_cast<tcp_context *>(tcp_con::from(r->handle));
@@ -547,6 +1540,17 @@ void dispatcher::write_con(tcp_context *con) noexcept
             pruv_log_uv_err(LOG_ERR, "", status);
             return con->remove_from_dispatcher();
         }
+        dispatcher *d = con->get_dispatcher();
+        con->sent_bytes += con->write_bytes;
+        // All responses except the last one are written fully and finished.
+        for (size_t i = 1; i < con->write_cnt; ++i) {
+            shmem_buffer_node &buf = con->resp_buffers.front();
+            buf.move_ptr(buf.data_size() - buf.cur_pos());
+            if (!d->return_written(con))
+                return con->remove_from_dispatcher();
+            if (con->resp_buffers.empty())
+                return; // Connection was closed.
+        }
         size_t chunk_size = (size_t)r->data;
         shmem_buffer_node &buf = con->resp_buffers.front();
         buf.move_ptr(chunk_size);
@@ -555,30 +1559,322 @@ void dispatcher::write_con(tcp_context *con) noexcept
         if (buf.cur_pos() >= buf.data_size())
             // Do it in callback to protect from infinite recursion
             // on_end_write_con -> respond_or_enqueue -> ... for empty response.
-            return con->get_dispatcher()->on_end_write_con(con);
-        con->get_dispatcher()->write_con(con);
+            return d->on_end_write_con(con);
+        d->write_con(con);
     };
 
-    size_t chunk_size = std::min(size_t(buf->map_end() - buf->map_ptr()),
-            buf->data_size() - buf->cur_pos()); // Can be 0 for empty response
-    uv_buf_t wbuf = uv_buf_init(buf->map_ptr(), chunk_size);
-    con->write_req.data = (void *)chunk_size;
-    int r = uv_write(&con->write_req, con->base<uv_stream_t *>(), &wbuf, 1,
-            write_cb);
+    gathered_cnt += cnt > 1;
+    con->write_cnt = cnt;
+    con->write_bytes = bytes;
+    con->write_req.data = (void *)last;
+    int r = write_stream(con, &con->write_req, wbufs, cnt, write_cb);
     if (r < 0) {
         pruv_log_uv_err(LOG_ERR, "uv_write", r);
         return con->remove_from_dispatcher();
     }
 }
 
+void dispatcher::stream_con(tcp_context *con) noexcept
+{
+    shmem_buffer_node &buf = con->resp_buffers.front();
+    assert(!(buf.cur_pos() & shmem_buffer::PAGE_SIZE_MASK));
+    con->write_close = false;
+    con->stream_pos = buf.cur_pos();
+    ++streamed_cnt;
+    // io_uring doesn't order sends into one socket, so windows are written
+    // one after another.
+    if (uring_io.opened()) {
+        if (!write_window(con, buf, con->write_req))
+            con->remove_from_dispatcher();
+        return;
+    }
+    // Second window is mapped through duplicate of buffer's descriptor.
+    int fd = fcntl(buf.get_fd(), F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        pruv_log_syserr(LOG_ERR, "fcntl(F_DUPFD_CLOEXEC)");
+        return con->remove_from_dispatcher();
+    }
+    if (!con->stream_buf.open_fd(fd, false))
+        return con->remove_from_dispatcher();
+    con->stream_buf.update_file_size(buf.file_size());
+    con->stream_buf.set_data_size(buf.data_size());
+    if (!write_window(con, buf, con->write_req) ||
+        !write_window(con, con->stream_buf, con->stream_req))
+        return con->remove_from_dispatcher();
+}
+
+bool dispatcher::write_window(tcp_context *con, shmem_buffer &win,
+        uv_write_t &req) noexcept
+{
+    size_t len = std::min(RESPONSE_CHUNK, win.data_size() - con->stream_pos);
+    if (!win.map(con->stream_pos, len) || !con->parse_response(win))
+        return false;
+
+    auto write_cb = [](uv_write_t *r, int status) {
+        tcp_context *con = static_cast<tcp_context *>(tcp_con::from(r->handle));
+        if (con->resp_buffers.empty())
+            return; // Connection was closed and buffers was returned to pool.
+        if (status < 0) {
+            pruv_log_uv_err(LOG_ERR, "", status);
+            return con->remove_from_dispatcher();
+        }
+        dispatcher *d = con->get_dispatcher();
+        shmem_buffer &win = *reinterpret_cast<shmem_buffer *>(r->data);
+        --con->stream_inflight;
+        // Slow peer still reads, so each window extends its timeout.
+        if (con->list_id == tcp_context::LIST_IO)
+            d->move_to(tcp_context::LIST_IO, con);
+        con->sent_bytes += std::min(size_t(win.map_end() - win.map_ptr()),
+                win.data_size() - win.cur_pos());
+        // Windows are written in order. Written one is reused for the next
+        // window, while the other one is still being written.
+        if (con->stream_pos < win.data_size()) {
+            if (!d->write_window(con, win, *r))
+                con->remove_from_dispatcher();
+            return;
+        }
+        if (con->stream_inflight)
+            return;
+        con->stream_buf.close();
+        d->on_end_write_con(con);
+    };
+
+    uv_buf_t wbuf = uv_buf_init(win.map_ptr(), len);
+    req.data = &win;
+    int r = write_stream(con, &req, &wbuf, 1, write_cb);
+    if (r < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_write", r);
+        return false;
+    }
+    pruv_log(LOG_DEBUG, "Response window of %" PRIuPTR " bytes at %" PRIuPTR,
+            len, con->stream_pos);
+    con->stream_pos += len;
+    ++con->stream_inflight;
+    return true;
+}
+
+bool dispatcher::sendfile_con(tcp_context *con) noexcept
+{
+    shmem_buffer_node &buf = con->resp_buffers.front();
+    con->write_close = false;
+    // Response's head is parsed from mapping.
+    if ((buf.map_ptr() == buf.map_end() && !buf.map(buf.cur_pos(),
+                std::min(RESPONSE_CHUNK, buf.data_size() - buf.cur_pos()))) ||
+        !con->parse_response(buf)) {
+        con->remove_from_dispatcher();
+        return true;
+    }
+    con->stream_pos = buf.cur_pos();
+    con->parsed_pos = buf.cur_pos() + std::min(
+            size_t(buf.map_end() - buf.map_ptr()),
+            buf.data_size() - buf.cur_pos());
+    return send_file(con);
+}
+
+bool dispatcher::send_file(tcp_context *con) noexcept
+{
+    shmem_buffer_node &buf = con->resp_buffers.front();
+    // sendfile() stops before the last page, which is written by uv_write(),
+    // so response is finished in callback.
+    const size_t last_page =
+        (buf.data_size() - 1) & ~shmem_buffer::PAGE_SIZE_MASK;
+    int fd;
+    int r = uv_fileno(con->base<uv_handle_t *>(), &fd);
+    if (r < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_fileno", r);
+        con->remove_from_dispatcher();
+        return true;
+    }
+    const size_t start_pos = con->stream_pos;
+    while (con->stream_pos < last_page) {
+        // Data is passed to parse_response() by windows before it's sent.
+        if (con->stream_pos >= con->parsed_pos) {
+            size_t base = con->parsed_pos & ~shmem_buffer::PAGE_SIZE_MASK;
+            size_t len = std::min(RESPONSE_CHUNK, last_page - base);
+            if (!buf.map(base, len)) {
+                con->remove_from_dispatcher();
+                return true;
+            }
+            buf.move_ptr(con->parsed_pos - base);
+            if (!con->parse_response(buf)) {
+                con->remove_from_dispatcher();
+                return true;
+            }
+            con->parsed_pos = base + len;
+        }
+        off_t off = con->stream_pos;
+        ssize_t n = sendfile(fd, buf.get_fd(), &off,
+                std::min(con->parsed_pos, last_page) - con->stream_pos);
+        if (n > 0) {
+            buf.sender = con;
+            con->stream_pos += n;
+            con->sent_bytes += n;
+            sendfile_sent += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n == -1 && !buf.sender && (errno == EINVAL || errno == ENOSYS))
+            return false;
+        if (n == -1)
+            pruv_log_syserr(LOG_ERR, "sendfile");
+        else
+            pruv_log(LOG_ERR, "Response buffer is shorter than response");
+        con->remove_from_dispatcher();
+        return true;
+    }
+    if (con->stream_pos != start_pos && con->list_id == tcp_context::LIST_IO)
+        move_to(tcp_context::LIST_IO, con);
+
+    // Socket is full or only the last page is left. Completion of its write
+    // means that socket is writable again.
+    size_t page = con->stream_pos & ~shmem_buffer::PAGE_SIZE_MASK;
+    size_t page_end = std::min(page + shmem_buffer::PAGE_SIZE,
+            buf.data_size());
+    size_t len = page_end - con->stream_pos;
+    if (!buf.map(page, shmem_buffer::PAGE_SIZE)) {
+        con->remove_from_dispatcher();
+        return true;
+    }
+    // Only the part after already parsed windows is passed to
+    // parse_response().
+    if (con->parsed_pos < page_end) {
+        size_t parse_pos = std::max(con->stream_pos, con->parsed_pos);
+        buf.move_ptr(parse_pos - page);
+        if (!con->parse_response(buf)) {
+            con->remove_from_dispatcher();
+            return true;
+        }
+        buf.move_ptr(-ptrdiff_t(parse_pos - page));
+        con->parsed_pos = page_end;
+    }
+    buf.move_ptr(con->stream_pos - page);
+
+    auto write_cb = [](uv_write_t *r, int status) {
+        tcp_context *con = static_cast<tcp_context *>(tcp_con::from(r->handle));
+        if (con->resp_buffers.empty())
+            return; // Connection was closed and buffers was returned to pool.
+        if (status < 0) {
+            pruv_log_uv_err(LOG_ERR, "", status);
+            return con->remove_from_dispatcher();
+        }
+        dispatcher *d = con->get_dispatcher();
+        if (con->list_id == tcp_context::LIST_IO)
+            d->move_to(tcp_context::LIST_IO, con);
+        con->sent_bytes += con->write_bytes;
+        con->stream_pos += con->write_bytes;
+        if (con->stream_pos >= con->resp_buffers.front().data_size())
+            return d->on_end_write_con(con);
+        if (!d->send_file(con))
+            con->remove_from_dispatcher();
+    };
+
+    uv_buf_t wbuf = uv_buf_init(buf.map_ptr(), len);
+    con->write_bytes = len;
+    r = write_stream(con, &con->write_req, &wbuf, 1, write_cb);
+    if (r < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_write", r);
+        con->remove_from_dispatcher();
+    }
+    return true;
+}
+
+bool dispatcher::return_acked(tcp_context *con, bool force) noexcept
+{
+    bool exhausted = resp_pool.exhausted;
+    bool returned = false;
+    for (auto it = unacked_buffers.begin(); it != unacked_buffers.end();) {
+        shmem_buffer_node &buf = *it++;
+        tcp_context *sender = buf.sender;
+        if (con && sender != con)
+            continue;
+        if (!force) {
+            // Socket's send queue holds unacknowledged and unsent data.
+            int fd;
+            int outq = 0;
+            int r = uv_fileno(sender->base<uv_handle_t *>(), &fd);
+            if (r < 0) {
+                pruv_log_uv_err(LOG_ERR, "uv_fileno", r);
+                continue;
+            }
+            if (ioctl(fd, SIOCOUTQ, &outq) == -1) {
+                pruv_log_syserr(LOG_ERR, "ioctl(SIOCOUTQ)");
+                continue;
+            }
+            if (sender->sent_bytes - (unsigned)outq < buf.ack_end)
+                continue;
+            buf.sender = nullptr;
+        }
+        --sender->unacked_cnt;
+        return_buffer(buf, false);
+        returned = true;
+    }
+    return exhausted && returned;
+}
+
+int dispatcher::write_stream(tcp_context *con, uv_write_t *req,
+        const uv_buf_t bufs[], unsigned nbufs, uv_write_cb cb) noexcept
+{
+    static_assert(WRITE_BUFS_MAX <= uring::MAX_BUFS, "");
+    if (!uring_io.opened())
+        return uv_write(req, con->base<uv_stream_t *>(), bufs, nbufs, cb);
+    // Sends into one socket aren't ordered by io_uring.
+    assert(!con->uring_writes);
+    int r = uring_io.write(req, con->base<uv_stream_t *>(), bufs, nbufs, cb);
+    if (!r) {
+        ++con->uring_writes;
+        ++uring_cnt;
+    }
+    return r;
+}
+
+void dispatcher::on_uring_write(uv_write_t *req, int status) noexcept
+{
+    tcp_context *con = static_cast<tcp_context *>(tcp_con::from(req->handle));
+    --con->uring_writes;
+    req->cb(req, status);
+    if (con->uring_writes)
+        return;
+    dispatcher *d = con->get_dispatcher();
+    while (!con->uring_held.empty())
+        d->return_buffer(con->uring_held.front(), false);
+    if (con->closed)
+        d->free_connection(con);
+}
+
+bool dispatcher::return_written(tcp_context *con) noexcept
+{
+    if (!con->parse_request(con->read_buffer))
+        return false;
+    shmem_buffer_node &buf = con->resp_buffers.front();
+    if (buf.sender) {
+        // Buffer is returned when its data is acknowledged.
+        buf.unlink();
+        buf.ack_end = con->sent_bytes;
+        unacked_buffers.push_back(buf);
+        ++con->unacked_cnt;
+        return true;
+    }
+    bool exhausted = resp_pool.exhausted;
+    return_buffer(con->resp_buffers.front(), false);
+    if (exhausted)
+        schedule(); // Requests wait for response buffer.
+    return true;
+}
+
 void dispatcher::on_end_write_con(tcp_context *con) noexcept
 {
     assert(loop);
     assert(con->list_id != tcp_context::LIST_IDLE);
     pruv_log(LOG_DEBUG, "Response sended");
-    if (con->finish_response(con->resp_buffers.front()) &&
-        con->parse_request(con->read_buffer)) {
-        return_buffer(con->resp_buffers.front(), false);
+    if (con->unacked_cnt && return_acked(con, false))
+        schedule(); // Requests wait for response buffer.
+    bool keep_alive = !con->write_close &&
+        con->finish_response(con->resp_buffers.front());
+    con->write_close = false;
+    if (keep_alive && return_written(con)) {
         if (!con->resp_buffers.empty())
             return write_con(con);
         if (con->list_id != tcp_context::LIST_IO)
@@ -592,6 +1888,9 @@ void dispatcher::on_end_write_con(tcp_context *con) noexcept
         else if (con->read_buffer)
             // Connection has partially readed message.
             move_to(tcp_context::LIST_IO, con);
+        else if (draining)
+            // Don't wait for next request.
+            con->remove_from_dispatcher();
         else
             // Connection is inactive.
             move_to(tcp_context::LIST_IDLE, con);
@@ -612,8 +1911,10 @@ void dispatcher::move_to(tcp_context::list_id_enum dst, tcp_context *con)
         con->timeout = uv_now(loop) + IO_TIMEOUT;
         clients_io.push_back(*con);
     }
-    else if (dst == tcp_context::LIST_SCHEDULING)
+    else if (dst == tcp_context::LIST_SCHEDULING) {
+        con->timeout = uv_now(loop) + SCHEDULING_TIMEOUT;
         clients_scheduling.push_back(*con);
+    }
     else if (dst == tcp_context::LIST_PROCESSING)
         clients_processing.push_back(*con);
     else if (dst == tcp_context::LIST_IDLE) {
@@ -624,43 +1925,164 @@ void dispatcher::move_to(tcp_context::list_id_enum dst, tcp_context *con)
             tcp_context::list_names[dst]);
 }
 
-dispatcher::shmem_buffer_node * dispatcher::get_buffer(bool for_req) noexcept
+dispatcher::shmem_buffer_node * dispatcher::get_buffer(bool for_req,
+        size_t size_hint) noexcept
 {
     assert(loop);
-    list<shmem_buffer_node> &list = (for_req ? req_bufs : resp_bufs);
-    if (!list.empty()) {
+    const size_t chunk = chunk_size(for_req);
+    if (arena_slots)
+        size_hint = std::min(size_hint,
+                for_req ? arena_req_capacity : arena_resp_capacity);
+    else if (contiguous_reserve)
+        size_hint = std::min(size_hint, contiguous_reserve);
+    size_t cls = buffer_class(size_hint, chunk, BUFFER_CLASSES);
+    if (chunk << 2 * cls < size_hint && cls + 1 < BUFFER_CLASSES)
+        ++cls;
+    // Smaller buffer grows up to size_hint with one resize.
+    buffer_pool &pool = for_req ? req_pool : resp_pool;
+    size_t size = std::max(size_hint, chunk);
+    for (size_t i = 0; i < BUFFER_CLASSES; ++i) {
+        // Classes cls, cls + 1, ..., BUFFER_CLASSES - 1, cls - 1, ..., 0.
+        size_t c = cls + i < BUFFER_CLASSES ?
+            cls + i : BUFFER_CLASSES - 1 - i;
+        list<shmem_buffer_node> &list = pool.classes[c];
+        if (list.empty())
+            continue;
         shmem_buffer_node *buf = &list.front();
         buf->unlink();
+        pool.resident -= buf->resident;
+        buf->resident = 0;
         assert(buf->data_size() == 0);
         assert(!buf->cur_pos());
+        // Buffer isn't grown beyond budget. It grows by chunks if needed.
+        if (buf->file_size() < size && (!buffer_bytes_max ||
+                pool.bytes + size - buf->file_size() <= buffer_bytes_max)) {
+            if (!buf->resize(size)) {
+                free_buffer(buf);
+                return nullptr;
+            }
+            pool.bytes += size - buf->accounted;
+            buf->accounted = size;
+        }
         return buf;
     }
 
+    if (buffer_bytes_max && pool.bytes + size > buffer_bytes_max)
+        size = chunk;
+    if ((buffers_max && pool.count >= buffers_max) ||
+        (buffer_bytes_max && pool.bytes + size > buffer_bytes_max)) {
+        if (!pool.exhausted)
+            pruv_log(LOG_WARNING, "%s buffers budget exhausted",
+                    for_req ? "Request" : "Response");
+        pool.exhausted = true;
+        return nullptr;
+    }
+
     scoped_ptr<shmem_buffer_node> buf(new (std::nothrow) shmem_buffer_node);
     if (!buf) {
         pruv_log(LOG_EMERG, "No memory for shmem_buffer_node");
         return nullptr;
     }
-    if (!buf->open(nullptr, true))
+    if (arena_slots) {
+        arena_segment *seg = nullptr;
+        for (arena_segment &sg : arena_segments)
+            if (sg.for_req == for_req && sg.free_cnt) {
+                seg = &sg;
+                break;
+            }
+        if (!seg && !(seg = create_segment(for_req)))
+            return nullptr;
+        uint32_t slot = seg->free_slots[--seg->free_cnt];
+        size_t base = slot * seg->slot_size;
+        buf->open_view(seg->fd, seg->region + base, base, seg->slot_size,
+                true);
+        buf->segment = seg;
+        buf->slot = slot;
+        buf->id = seg->id;
+        buf->gen = seg->gen;
+        snprintf(buf->ref, sizeof(buf->ref), "#%" PRIu32 ".%" PRIu32
+                ".%" PRIu32, buf->id, buf->gen, buf->slot);
+    }
+    else if (memfd_buffers) {
+        if (!buf->open_memfd())
+            return nullptr;
+        if (!alloc_buffer_id(buf->id, buf->gen)) {
+            buf->close();
+            return nullptr;
+        }
+        snprintf(buf->ref, sizeof(buf->ref), "#%" PRIu32 ".%" PRIu32,
+                buf->id, buf->gen);
+    }
+    else if (!buf->open(nullptr, true))
         return nullptr;
-    if (!buf->reset_defaults(for_req ? REQUEST_CHUNK : RESPONSE_CHUNK)) {
-        buf->close();
+    else if (registered_buffers) {
+        if (!alloc_buffer_id(buf->id, buf->gen)) {
+            buf->close();
+            return nullptr;
+        }
+        snprintf(buf->ref, sizeof(buf->ref), "#%" PRIu32 ".%" PRIu32,
+                buf->id, buf->gen);
+    }
+    if (contiguous_reserve)
+        buf->set_contiguous(contiguous_reserve);
+    if (!buf->resize(size) || !buf->map(0, chunk)) {
+        free_buffer(buf.release());
         return nullptr;
     }
+    buf->pool = &pool;
+    buf->accounted = size;
+    ++pool.count;
+    pool.bytes += size;
     return buf.release();
 }
 
 void dispatcher::return_buffer(shmem_buffer_node &buf, bool for_req) noexcept
 {
-    buf.unlink();
-    if (!buf.reset_defaults(for_req ? REQUEST_CHUNK : RESPONSE_CHUNK)) {
-        buf.close();
-        delete &buf;
-        return;
+    if (buf.sender) {
+        // Socket may still refer to buffer's pages. They're left to it and
+        // buffer gets new ones.
+        buf.sender = nullptr;
+        buf.release_memory(0);
     }
-    assert(!buf.cur_pos()); // after reset_defaults
+    if (buf.foreign)
+        return release_worker_buffer(buf);
+    buf.unlink();
+    // Grown buffer keeps its size. Worker may shrink it below chunk.
+    const size_t chunk = chunk_size(for_req);
+    if ((buf.file_size() < chunk && !buf.resize(chunk)) || !buf.map(0, chunk))
+        return free_buffer(&buf);
+    assert(!buf.cur_pos()); // after map
     buf.set_data_size(0);
-    (for_req ? req_bufs : resp_bufs).push_front(buf);
+    buf.resident = buf.file_size();
+    buf.returned_at = uv_now(loop);
+    buffer_pool &pool = for_req ? req_pool : resp_pool;
+    pool.classes[buffer_class(buf.file_size(), chunk, BUFFER_CLASSES)]
+        .push_front(buf);
+    pool.resident += buf.resident;
+    // Buffer could be grown while used.
+    pool.bytes += buf.file_size() - buf.accounted;
+    buf.accounted = buf.file_size();
+    pool.exhausted = false;
+    if (buffer_bytes_max && pool.bytes > buffer_bytes_max)
+        reap_buffers(pool, buffer_bytes_max, 0);
+    size_t other = (for_req ? resp_pool : req_pool).resident;
+    if (pool.resident + other > buffer_pool_limit)
+        trim_pool(pool, for_req,
+                buffer_pool_limit - std::min(buffer_pool_limit, other), 0);
+    if (for_req && paused_reads)
+        resume_reads();
+}
+
+void dispatcher::resume_reads() noexcept
+{
+    // Connections, which get no buffer again, pause again. Connection isn't
+    // removed here, because caller may iterate its list.
+    for (list<tcp_context> *l : {&clients_idle, &clients_io})
+        for (auto it = l->begin(); paused_reads && it != l->end(); ++it)
+            if (it->read_paused && it->read_start()) {
+                it->read_paused = false;
+                --paused_reads;
+            }
 }
 
 void dispatcher::return_buffer(shmem_buffer_node **buf, bool for_req) noexcept
@@ -669,15 +2091,340 @@ void dispatcher::return_buffer(shmem_buffer_node **buf, bool for_req) noexcept
     *buf = nullptr;
 }
 
-void dispatcher::close_buffers(list<shmem_buffer_node> &buf_list) noexcept
+void dispatcher::release_worker_buffer(shmem_buffer_node &buf) noexcept
 {
-    assert(loop);
-    buf_list.clear_and_dispose([](shmem_buffer_node *buf) {
+    buf.unlink();
+    worker_process *w = buf.owner;
+    // Buffer must be mapped from its beginning for the next response.
+    if (!w || !buf.map(0, RESPONSE_CHUNK)) {
+        if (w)
+            w->own_bufs[buf.id] = nullptr;
+        return free_buffer(&buf);
+    }
+    buf.set_data_size(0);
+    buffer_release_cmd cmd;
+    cmd.hdr = make_cmd_header(CMD_BUFFER_RELEASE, 0, sizeof(cmd));
+    cmd.id = buf.id;
+    cmd.reserved = 0;
+    ssize_t r;
+    while ((r = send(w->buf_sock, &cmd, sizeof(cmd), MSG_NOSIGNAL)) == -1 &&
+           errno == EINTR) {}
+    // Worker allocates another buffer instead of lost one.
+    if (r != sizeof(cmd))
+        pruv_log_syserr(LOG_ERR, "send(buffer release)");
+}
+
+dispatcher::shmem_buffer_node * dispatcher::worker_buffer(worker_process *w,
+        uint32_t id) noexcept
+{
+    // Worker sends descriptor before response, which uses it.
+    while (id >= w->own_bufs_cnt || !w->own_bufs[id])
+        if (!recv_worker_buffer(w))
+            return nullptr;
+    shmem_buffer_node *buf = w->own_bufs[id];
+    // Buffer is released by dispatcher before worker uses it again.
+    return buf->is_linked() ? nullptr : buf;
+}
+
+bool dispatcher::recv_worker_buffer(worker_process *w) noexcept
+{
+    buffer_fd_cmd cmd;
+    int fd;
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fd))];
+    iovec iov = {&cmd, sizeof(cmd)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t r;
+    while ((r = recvmsg(w->buf_sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+           errno == EINTR) {}
+    if (r == -1) {
+        pruv_log_syserr(LOG_ERR, "recvmsg(worker's buffer)");
+        return false;
+    }
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fd))) {
+        pruv_log(LOG_ERR, "No descriptor in worker's buffer frame");
+        return false;
+    }
+    memcpy(&fd, CMSG_DATA(cm), sizeof(fd));
+    if (r != sizeof(cmd) || !valid_cmd_header(cmd.hdr, CMD_BUFFER_FD) ||
+        cmd.hdr.size != sizeof(cmd) || cmd.gen ||
+        (cmd.id < w->own_bufs_cnt && w->own_bufs[cmd.id])) {
+        pruv_log(LOG_ERR, "Invalid worker's buffer frame");
+        close(fd);
+        return false;
+    }
+    if (cmd.id >= w->own_bufs_cnt) {
+        size_t cnt = std::max<size_t>(cmd.id + 1, 2 * w->own_bufs_cnt);
+        shmem_buffer_node **p = new (std::nothrow) shmem_buffer_node *[cnt];
+        if (!p) {
+            pruv_log(LOG_EMERG, "No memory for worker's buffers");
+            close(fd);
+            return false;
+        }
+        std::copy(w->own_bufs.get(), w->own_bufs.get() + w->own_bufs_cnt, p);
+        std::fill(p + w->own_bufs_cnt, p + cnt, nullptr);
+        w->own_bufs.reset(p);
+        w->own_bufs_cnt = cnt;
+    }
+    shmem_buffer_node *buf = new (std::nothrow) shmem_buffer_node;
+    if (!buf) {
+        pruv_log(LOG_EMERG, "No memory for worker's buffer");
+        close(fd);
+        return false;
+    }
+    buf->id = cmd.id;
+    buf->foreign = true;
+    buf->owner = w;
+    if (!buf->open_fd(fd, true) || !buf->map(0, RESPONSE_CHUNK)) {
         buf->close();
-        // tcp_stream and worker, which uses this buffer, must be closed before
-        // and must not use buffer in close_cb.
         delete buf;
-    });
+        return false;
+    }
+    w->own_bufs[cmd.id] = buf;
+    return true;
+}
+
+bool dispatcher::send_buffer_fd(worker_process &w,
+        const shmem_buffer_node &buf) noexcept
+{
+    if (!buf.gen)
+        return true; // Not registered named buffer.
+    // Arena segment is passed once for all its slots.
+    if (buf.id < w.buf_sent_cnt && w.buf_sent_gen[buf.id] == buf.gen)
+        return true;
+    if (buf.id >= w.buf_sent_cnt) {
+        size_t cnt = std::max<size_t>(buf.id + 1, 2 * w.buf_sent_cnt);
+        uint32_t *p = new (std::nothrow) uint32_t[cnt];
+        if (!p) {
+            pruv_log(LOG_EMERG, "No memory for worker's buffers");
+            return false;
+        }
+        std::copy(w.buf_sent_gen.get(), w.buf_sent_gen.get() + w.buf_sent_cnt,
+                p);
+        std::fill(p + w.buf_sent_cnt, p + cnt, 0);
+        w.buf_sent_gen.reset(p);
+        w.buf_sent_cnt = cnt;
+    }
+
+    buffer_fd_cmd cmd;
+    uint32_t flags = prefault_req || prefault_resp ? CMD_F_POPULATE : 0;
+    if (huge_pages)
+        flags |= CMD_F_HUGE_PAGES;
+    if (buf.contiguous())
+        flags |= CMD_F_CONTIGUOUS;
+    cmd.hdr = make_cmd_header(CMD_BUFFER_FD, flags, sizeof(cmd));
+    cmd.id = buf.id;
+    cmd.gen = buf.gen;
+    cmd.size = buf.segment ? buf.segment->size :
+        buf.contiguous() ? contiguous_reserve : 0;
+    cmd.slot_size = buf.segment ? buf.segment->slot_size : 0;
+    int fd = buf.get_fd();
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fd))];
+    iovec iov = {&cmd, sizeof(cmd)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(fd));
+    // Worker reads descriptors before requests, which use them. Socket is
+    // nonblocking and full socket means that worker doesn't read it.
+    ssize_t r;
+    while ((r = sendmsg(w.buf_sock, &msg, MSG_NOSIGNAL)) == -1 &&
+           errno == EINTR) {}
+    if (r != sizeof(cmd)) {
+        pruv_log_syserr(LOG_ERR, "sendmsg(buffer fd)");
+        return false;
+    }
+    w.buf_sent_gen[buf.id] = buf.gen;
+    return true;
+}
+
+bool dispatcher::alloc_buffer_id(uint32_t &id, uint32_t &gen) noexcept
+{
+    if (!free_buf_ids_cnt) {
+        // Stack has capacity for all ids, so release never fails.
+        uint32_t *p = (uint32_t *)realloc(free_buf_ids,
+                (buf_ids_cnt + 1) * sizeof(*p));
+        if (!p) {
+            pruv_log(LOG_EMERG, "No memory for buffer id");
+            return false;
+        }
+        free_buf_ids = p;
+        free_buf_ids[free_buf_ids_cnt++] = buf_ids_cnt++;
+    }
+    id = free_buf_ids[--free_buf_ids_cnt];
+    if (!++buf_gen)
+        ++buf_gen; // 0 is for not registered named buffers.
+    gen = buf_gen;
+    return true;
+}
+
+dispatcher::arena_segment * dispatcher::create_segment(bool for_req) noexcept
+{
+    scoped_ptr<arena_segment> seg(new (std::nothrow) arena_segment);
+    if (seg)
+        seg->free_slots.reset(new (std::nothrow) uint32_t[arena_slots]);
+    if (!seg || !seg->free_slots) {
+        pruv_log(LOG_EMERG, "No memory for arena segment");
+        return nullptr;
+    }
+    seg->for_req = for_req;
+    seg->slot_size = for_req ? arena_req_capacity : arena_resp_capacity;
+    seg->slots_cnt = arena_slots;
+    seg->size = seg->slot_size * seg->slots_cnt;
+    seg->fd = memfd_create("pruv-arena", MFD_CLOEXEC);
+    if (seg->fd == -1) {
+        pruv_log_syserr(LOG_ERR, "memfd_create");
+        return nullptr;
+    }
+    // Memory is allocated only for used parts of slots.
+    if (ftruncate(seg->fd, seg->size) == -1) {
+        pruv_log_syserr(LOG_ERR, "ftruncate");
+        return nullptr;
+    }
+    void *r = mmap(nullptr, seg->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_NORESERVE, seg->fd, 0);
+    if (r == MAP_FAILED) {
+        pruv_log_syserr(LOG_ERR, "mmap");
+        return nullptr;
+    }
+    seg->region = (char *)r;
+    if (huge_pages && madvise(r, seg->size, MADV_HUGEPAGE) == -1)
+        pruv_log_syserr(LOG_WARNING, "madvise(MADV_HUGEPAGE)");
+    if (!alloc_buffer_id(seg->id, seg->gen))
+        return nullptr;
+    // Lower slots are taken first.
+    for (size_t i = seg->slots_cnt; i--;)
+        seg->free_slots[seg->free_cnt++] = i;
+    arena_segments.push_back(*seg.get());
+    pruv_log(LOG_NOTICE, "Arena segment of %" PRIuPTR " slots of %" PRIuPTR
+            " bytes created", seg->slots_cnt, seg->slot_size);
+    return seg.release();
+}
+
+void dispatcher::close_arena() noexcept
+{
+    for (auto it = arena_segments.begin(); it != arena_segments.end();) {
+        arena_segment &seg = *it++;
+        if (seg.free_cnt != seg.slots_cnt)
+            continue;
+        free_buf_ids[free_buf_ids_cnt++] = seg.id;
+        delete &seg;
+    }
+}
+
+void dispatcher::free_buffer(shmem_buffer_node *buf) noexcept
+{
+    if (buf->pool) {
+        --buf->pool->count;
+        buf->pool->bytes -= buf->accounted;
+    }
+    // Slot keeps memory until it's punched out.
+    if (buf->segment)
+        buf->resize(0);
+    buf->close();
+    if (buf->segment)
+        buf->segment->free_slots[buf->segment->free_cnt++] = buf->slot;
+    else if (buf->gen)
+        free_buf_ids[free_buf_ids_cnt++] = buf->id;
+    delete buf;
+}
+
+void dispatcher::trim_pool(buffer_pool &pool, bool for_req, size_t limit,
+        uint64_t idle_before) noexcept
+{
+    // The first chunk is mapped and is touched first by the next user.
+    const size_t chunk = chunk_size(for_req);
+    for (size_t c = BUFFER_CLASSES; c--;) {
+        list<shmem_buffer_node> &list = pool.classes[c];
+        for (auto it = list.rbegin(); it != list.rend(); ++it) {
+            shmem_buffer_node &buf = *it;
+            if (pool.resident <= limit && buf.returned_at >= idle_before)
+                break;
+            if (buf.resident <= chunk)
+                continue;
+            if (!buf.release_memory(chunk))
+                continue;
+            pool.resident -= buf.resident - chunk;
+            buf.resident = chunk;
+        }
+    }
+}
+
+void dispatcher::reap_buffers(buffer_pool &pool, size_t max_bytes,
+        uint64_t idle_before) noexcept
+{
+    for (;;) {
+        // The least recently used buffer is at the back of some class.
+        shmem_buffer_node *oldest = nullptr;
+        for (list<shmem_buffer_node> &list : pool.classes)
+            if (!list.empty() && (!oldest ||
+                    list.back().returned_at < oldest->returned_at))
+                oldest = &list.back();
+        if (!oldest || (pool.bytes <= max_bytes &&
+            (oldest->returned_at >= idle_before || pool.count <= pool.reserved)))
+            break;
+        oldest->unlink();
+        pool.resident -= oldest->resident;
+        free_buffer(oldest);
+    }
+}
+
+void dispatcher::prefault_buffers(bool for_req, size_t cnt) noexcept
+{
+    if (!cnt)
+        return;
+    std::unique_ptr<shmem_buffer_node *[]> bufs(
+            new (std::nothrow) shmem_buffer_node *[cnt]);
+    if (!bufs) {
+        pruv_log(LOG_EMERG, "No memory for prefaulting buffers");
+        return;
+    }
+    rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    size_t n = 0;
+    size_t pages = 0;
+    while (n < cnt && (bufs[n] = get_buffer(for_req))) {
+        ptrdiff_t r = bufs[n++]->prefault();
+        if (r < 0)
+            break;
+        pages += r;
+    }
+    getrusage(RUSAGE_SELF, &after);
+    while (n)
+        return_buffer(*bufs[--n], for_req);
+    buffer_pool &pool = for_req ? req_pool : resp_pool;
+    pool.reserved = cnt;
+    prefaulted += pages;
+    pruv_log(LOG_NOTICE, "Prefaulted %" PRIuPTR " pages of %s buffers, "
+            "%ld minor faults taken in advance", pages,
+            for_req ? "request" : "response",
+            after.ru_minflt - before.ru_minflt);
+}
+
+void dispatcher::close_buffers(buffer_pool &pool) noexcept
+{
+    assert(loop);
+    for (list<shmem_buffer_node> &list : pool.classes)
+        list.clear_and_dispose([this](shmem_buffer_node *buf) {
+            // tcp_stream and worker, which uses this buffer, must be closed
+            // before and must not use buffer in close_cb.
+            free_buffer(buf);
+        });
+    pool.resident = 0;
+    close_arena();
 }
 
 bool dispatcher::start_timer() noexcept
@@ -717,22 +2464,64 @@ void dispatcher::close_timer() noexcept
 
 void dispatcher::on_timer_tick() noexcept
 {
+    assert(loop);
+    if (draining) {
+        bool drained = clients_idle.empty() && clients_io.empty() &&
+            clients_scheduling.empty() && clients_processing.empty();
+        if (drained) {
+            pruv_log(LOG_NOTICE, "Connections are drained");
+            return stop();
+        }
+        if (drain_timeout && uv_now(loop) >= drain_deadline) {
+            // Workers not exited after stop are killed by KILL_TIMEOUT.
+            pruv_log(LOG_WARNING, "Connections aren't drained in time");
+            return stop();
+        }
+    }
+    reap_idle_workers();
+    // Memory of buffers unused for the whole period is released.
+    uint64_t idle_before = uv_now(loop) - std::min<uint64_t>(uv_now(loop),
+            TIMER_PERIOD);
+    trim_pool(req_pool, true, SIZE_MAX, idle_before);
+    trim_pool(resp_pool, false, SIZE_MAX, idle_before);
+    uint64_t cold_before = uv_now(loop) - std::min<uint64_t>(uv_now(loop),
+            BUFFER_IDLE_TIMEOUT);
+    reap_buffers(req_pool, SIZE_MAX, cold_before);
+    reap_buffers(resp_pool, SIZE_MAX, cold_before);
+    close_arena();
+    return_acked(nullptr, false);
+    // Requests may wait for buffers returned without scheduling.
+    schedule();
+    if (paused_reads)
+        resume_reads();
+    // Exited workers are replaced here, not in on_worker_exit, to not
+    // respawn crashing workers in a tight loop.
+    spawn_spares();
     if (!timeouts_enabled)
         return;
-    assert(loop);
     uint64_t now = uv_now(loop);
-    for (const worker_process &w : terminated_workers) {
+    while (!starting_workers.empty() &&
+           starting_workers.front().timeout <= now) {
+        pruv_log(LOG_ERR, "Worker %d isn't ready in time",
+                starting_workers.front().pid);
+        kill_worker(&starting_workers.front());
+    }
+    for (worker_process &w : terminated_workers) {
         if (w.timeout > now)
             break;
-        assert(!terminated_workers.front().exited);
-        int r = uv_process_kill(&terminated_workers.front(), SIGKILL);
-        if (r < 0)
-            pruv_log_uv_err(LOG_ERR, "uv_process_kill", r);
+        int r;
+        if (!w.exited && (r = w.send_signal(SIGKILL)) < 0)
+            pruv_log_uv_err(LOG_ERR, "uv_kill", r);
+    }
+    for (auto it = in_use_workers.begin(); it != in_use_workers.end();) {
+        worker_process &w = *it++;
+        if (w.timeout <= now)
+            kill_worker(&w);
     }
-    while (!in_use_workers.empty() && in_use_workers.front().timeout <= now)
-        kill_worker(&in_use_workers.front());
     close_old_connections(clients_idle);
     close_old_connections(clients_io);
+    // Requests wait for response buffers while budget is exhausted.
+    close_old_connections(clients_scheduling);
 }
 
 void dispatcher::close_connections(list<tcp_context> &list) noexcept
@@ -749,6 +2538,49 @@ void dispatcher::close_old_connections(list<tcp_context> &list) noexcept
         list.front().remove_from_dispatcher();
 }
 
+///
+/// worker_process
+///
+
+dispatcher::worker_process::~worker_process()
+{
+    // Buffers with unsent responses are freed when returned.
+    for (size_t i = 0; i < own_bufs_cnt; ++i) {
+        if (shmem_buffer_node *buf = own_bufs[i]) {
+            if (buf->is_linked())
+                buf->owner = nullptr;
+            else {
+                buf->close();
+                delete buf;
+            }
+        }
+    }
+    if (buf_sock != -1 && close(buf_sock) == -1)
+        pruv_log_syserr(LOG_ERR, "close");
+}
+
+///
+/// arena_segment
+///
+
+dispatcher::arena_segment::~arena_segment()
+{
+    if (region && munmap(region, size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    if (fd != -1 && close(fd) == -1)
+        pruv_log_syserr(LOG_ERR, "close");
+}
+
+///
+/// zygote_process
+///
+
+dispatcher::zygote_process::~zygote_process()
+{
+    if (ctl_fd != -1 && close(ctl_fd) == -1)
+        pruv_log_syserr(LOG_ERR, "close");
+}
+
 ///
 /// tcp_context
 ///
@@ -760,16 +2592,39 @@ dispatcher * dispatcher::tcp_context::get_dispatcher() const noexcept
 
 void dispatcher::tcp_context::remove_from_dispatcher() noexcept
 {
+    if (uring_writes) {
+        // Socket isn't closed while io_uring refers to it. Shutdown fails
+        // pending writes, but kernel may still read their buffers until
+        // they're finished, so buffers are returned by on_uring_write().
+        uv_os_fd_t fd;
+        if (!uv_fileno(base<uv_handle_t *>(), &fd) &&
+            shutdown(fd, SHUT_RDWR) == -1 && errno != ENOTCONN)
+            pruv_log_syserr(LOG_ERR, "shutdown");
+        get_dispatcher()->uring_io.cancel(base<uv_stream_t *>());
+        uring_held.splice(uring_held.end(), resp_buffers);
+    }
     while (!resp_buffers.empty())
         get_dispatcher()->return_buffer(resp_buffers.front(), false);
+    if (unacked_cnt) {
+        get_dispatcher()->return_acked(this, false);
+        get_dispatcher()->return_acked(this, true);
+    }
 
-    if (worker)
-        worker->processed_con = nullptr;
+    if (read_paused) {
+        read_paused = false;
+        --get_dispatcher()->paused_reads;
+    }
+    if (task)
+        task->con = nullptr;
     else if (read_buffer) // Can return buffer only if worker not use it.
         get_dispatcher()->return_buffer(&read_buffer, true);
 
     unlink(); // may be not in any list (for example, in schedule)
     close();
+    // Pending writes are canceled by closing.
+    if (stream_buf.opened())
+        stream_buf.close();
+    stream_inflight = 0;
     pruv_log(LOG_DEBUG, "Connection closed.");
 }
 
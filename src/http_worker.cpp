@@ -131,6 +131,9 @@ int http_worker::handle_request() noexcept
         pruv_log(LOG_WARNING, "HTTP parsing error");
         return send_empty_response("400 Bad Request");
     }
+    // Dispatcher closes connection after this response.
+    if (close_requested())
+        _keep_alive = false;
     _method = static_cast<http_method>(parser.method);
     return do_response();
 }
@@ -5,8 +5,11 @@
 #include <pruv/process.hpp>
 
 #include <cassert>
+#include <initializer_list>
 #include <memory.h>
 
+#include <unistd.h>
+
 #include <pruv/cleanup_helpers.hpp>
 #include <pruv/log.hpp>
 
@@ -21,7 +24,9 @@ process::process() noexcept
 }
 
 bool process::start(uv_loop_t *loop, const char *file, const char * const *args,
-        void *owner, uv_exit_cb on_exit, void (*deleter)(void *)) noexcept
+        void *owner, uv_exit_cb on_exit, void (*deleter)(void *),
+        const int *inherit_fds, size_t inherit_cnt, const char * const *env)
+    noexcept
 {
     assert(loop);
     this->owner = owner;
@@ -51,14 +56,27 @@ bool process::start(uv_loop_t *loop, const char *file, const char * const *args,
     // It is only due to limitation of the ISO C.
     // In fact args is completely constant.
     options.args = const_cast<char **>(args);
+    options.env = const_cast<char **>(env);
     options.flags = UV_PROCESS_WINDOWS_HIDE;
-    options.stdio_count = 2;
-    uv_stdio_container_t stdio[2];
+    constexpr size_t MAX_STDIO = 8;
+    if (inherit_cnt > MAX_STDIO - 3) {
+        pruv_log(LOG_ERR, "Too many descriptors to inherit");
+        return false;
+    }
+    options.stdio_count = inherit_cnt ? 3 + inherit_cnt : 2;
+    uv_stdio_container_t stdio[MAX_STDIO];
     options.stdio = stdio;
     options.stdio[0].flags = uv_stdio_flags(UV_CREATE_PIPE | UV_READABLE_PIPE);
     options.stdio[0].data.stream = (uv_stream_t *)&in;
     options.stdio[1].flags = uv_stdio_flags(UV_CREATE_PIPE | UV_WRITABLE_PIPE);
     options.stdio[1].data.stream = (uv_stream_t *)&out;
+    options.stdio[2].flags = UV_INHERIT_FD;
+    options.stdio[2].data.fd = 2;
+    for (size_t i = 0; i < inherit_cnt; ++i) {
+        options.stdio[3 + i].flags =
+            inherit_fds[i] == -1 ? UV_IGNORE : UV_INHERIT_FD;
+        options.stdio[3 + i].data.fd = inherit_fds[i];
+    }
 
     ++wait_close;
     close_on_return close_this_proc((uv_handle_t *)this, close_cb);
@@ -71,9 +89,59 @@ bool process::start(uv_loop_t *loop, const char *file, const char * const *args,
     return true;
 }
 
+bool process::adopt(uv_loop_t *loop, int in_fd, int out_fd, void *owner,
+        void (*deleter)(void *)) noexcept
+{
+    assert(loop);
+    this->owner = owner;
+    this->deleter = deleter;
+    adopted = true;
+
+    auto close_fds = [&in_fd, &out_fd]() {
+        for (int fd : {in_fd, out_fd})
+            if (fd != -1 && close(fd) == -1)
+                pruv_log_syserr(LOG_ERR, "close");
+        return false;
+    };
+
+    int r;
+    ++wait_close;
+    close_on_return close_in((uv_handle_t *)&in, close_cb);
+    if ((r = uv_pipe_init(loop, &in, 0)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_pipe_init in", r);
+        return close_fds();
+    }
+
+    ++wait_close;
+    close_on_return close_out((uv_handle_t *)&out, close_cb);
+    if ((r = uv_pipe_init(loop, &out, 0)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_pipe_init out", r);
+        return close_fds();
+    }
+
+    if ((r = uv_pipe_open(&in, in_fd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_pipe_open in", r);
+        return close_fds();
+    }
+    in_fd = -1; // Closed with pipe now.
+    if ((r = uv_pipe_open(&out, out_fd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_pipe_open out", r);
+        return close_fds();
+    }
+
+    close_in.h = close_out.h = nullptr;
+    return true;
+}
+
+int process::send_signal(int signum) noexcept
+{
+    return pid > 0 ? uv_kill(pid, signum) : 0;
+}
+
 void process::stop() noexcept
 {
-    uv_close((uv_handle_t *)this, close_cb);
+    if (!adopted)
+        uv_close((uv_handle_t *)this, close_cb);
     uv_close((uv_handle_t *)&out, close_cb);
     uv_close((uv_handle_t *)&in, close_cb);
 }
@@ -4,6 +4,7 @@
 
 #include <pruv/shmem_buffer.hpp>
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
@@ -84,9 +85,73 @@ bool shmem_buffer::open(const char *name, bool for_write) noexcept
     return true;
 }
 
+bool shmem_buffer::open_memfd() noexcept
+{
+    if (name_ || fd != -1) {
+        pruv_log(LOG_ERR, "Attempt to reopen not closed shmem_buffer.");
+        return false;
+    }
+    int memfd = memfd_create("pruv-shm", MFD_CLOEXEC);
+    if (memfd == -1) {
+        pruv_log_syserr(LOG_ERR, "shmem_buffer::open_memfd memfd_create");
+        return false;
+    }
+    return open_fd(memfd, true);
+}
+
+bool shmem_buffer::open_fd(int fd, bool for_write) noexcept
+{
+    if (name_ || this->fd != -1) {
+        pruv_log(LOG_ERR, "Attempt to reopen not closed shmem_buffer.");
+        ::close(fd);
+        return false;
+    }
+    this->fd = fd;
+    pruv_log(LOG_DEBUG, "Opened shared memory object fd = %d", fd);
+    file_size_ = 0;
+    writable = for_write;
+    return true;
+}
+
+bool shmem_buffer::open_view(int fd, char *mem, size_t base, size_t capacity,
+        bool for_write) noexcept
+{
+    if (name_ || this->fd != -1) {
+        pruv_log(LOG_ERR, "Attempt to reopen not closed shmem_buffer.");
+        return false;
+    }
+    assert(!(base & PAGE_SIZE_MASK) && !(capacity & PAGE_SIZE_MASK));
+    this->fd = fd;
+    view_ = mem;
+    view_base_ = base;
+    view_capacity_ = capacity;
+    file_size_ = 0;
+    writable = for_write;
+    return true;
+}
+
 bool shmem_buffer::resize(size_t new_size) noexcept
 {
     new_size = (new_size + PAGE_SIZE_MASK) & ~PAGE_SIZE_MASK;
+    if (view_) {
+        if (new_size > view_capacity_) {
+            pruv_log(LOG_ERR, "Buffer capacity %" PRIuPTR " exceeded",
+                    view_capacity_);
+            return false;
+        }
+        // Release memory as ftruncate does.
+        if (new_size < file_size_ && fallocate(fd,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                view_base_ + new_size, file_size_ - new_size) == -1) {
+            pruv_log_syserr(LOG_ERR, "fallocate");
+            return false;
+        }
+        file_size_ = new_size;
+        return true;
+    }
+    // Pages beyond end of object must not stay mapped.
+    if (new_size < region_mapped_ && !shrink_contiguous(new_size))
+        return false;
     int r;
     for (;;) {
         r = ftruncate(fd, new_size);
@@ -105,6 +170,11 @@ void shmem_buffer::update_file_size(size_t new_file_size) noexcept
 {
     assert(fd != -1);
 #ifndef NDEBUG
+    if (view_) {
+        assert(new_file_size <= view_capacity_);
+        file_size_ = new_file_size;
+        return;
+    }
     struct stat prop;
     int r = fstat(fd, &prop);
     assert(!r);
@@ -113,11 +183,97 @@ void shmem_buffer::update_file_size(size_t new_file_size) noexcept
     file_size_ = new_file_size;
 }
 
+bool shmem_buffer::release_memory(size_t offset) noexcept
+{
+    assert(!(offset & PAGE_SIZE_MASK));
+    if (offset >= file_size_)
+        return true;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (view_ ? view_base_ : 0) + offset, file_size_ - offset) == -1) {
+        pruv_log_syserr(LOG_ERR, "fallocate");
+        return false;
+    }
+    return true;
+}
+
+ptrdiff_t shmem_buffer::prefault() noexcept
+{
+    if (fallocate(fd, 0, view_ ? view_base_ : 0, file_size_) == -1) {
+        pruv_log_syserr(LOG_ERR, "fallocate");
+        return -1;
+    }
+    size_t len = map_end_ - map_begin_;
+#ifdef MADV_POPULATE_WRITE
+    if (writable && !madvise(map_begin_, len, MADV_POPULATE_WRITE))
+        return len / PAGE_SIZE;
+#endif
+    // Read fault maps allocated page of shared mapping.
+    for (size_t i = 0; i < len; i += PAGE_SIZE)
+        (void)*(volatile char *)(map_begin_ + i);
+    return len / PAGE_SIZE;
+}
+
+void shmem_buffer::set_contiguous(size_t reserve) noexcept
+{
+    assert(!map_begin_);
+    reserve_ = (reserve + PAGE_SIZE_MASK) & ~PAGE_SIZE_MASK;
+}
+
+bool shmem_buffer::map_contiguous(size_t offset, size_t size) noexcept
+{
+    if (offset + size > reserve_) {
+        pruv_log(LOG_ERR, "Map beyond reserved range of %" PRIuPTR " bytes",
+                reserve_);
+        return false;
+    }
+    if (!region_) {
+        void *r = mmap(nullptr, reserve_, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (r == MAP_FAILED) {
+            pruv_log_syserr(LOG_ERR, "mmap(reserve)");
+            return false;
+        }
+        region_ = (char *)r;
+    }
+    if (offset + size > region_mapped_) {
+        int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+        int flags = MAP_SHARED | MAP_FIXED | (populate_ ? MAP_POPULATE : 0);
+        size_t len = offset + size - region_mapped_;
+        if (mmap(region_ + region_mapped_, len, prot, flags, fd,
+                    region_mapped_) == MAP_FAILED) {
+            pruv_log_syserr(LOG_ERR, "mmap");
+            return false;
+        }
+        region_mapped_ += len;
+    }
+    map_begin_ = region_;
+    map_end_ = region_ + region_mapped_;
+    map_ptr_ = region_ + offset;
+    map_offset_ = 0;
+    return true;
+}
+
+bool shmem_buffer::shrink_contiguous(size_t size) noexcept
+{
+    if (mmap(region_ + size, region_mapped_ - size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) ==
+            MAP_FAILED) {
+        pruv_log_syserr(LOG_ERR, "mmap(reserve)");
+        return false;
+    }
+    region_mapped_ = size;
+    if (map_begin_) {
+        map_end_ = region_ + size;
+        map_ptr_ = std::min(map_ptr_, map_end_);
+    }
+    return true;
+}
+
 bool shmem_buffer::unmap() noexcept
 {
-    if (!map_begin_)
+    if (!map_begin_ || contiguous())
         return true;
-    if (!munmap(map_begin_, map_end_ - map_begin_)) {
+    if (view_ || !munmap(map_begin_, map_end_ - map_begin_)) {
         map_ptr_ = map_end_ = map_begin_ = nullptr;
         map_offset_ = 0;
         return true;
@@ -129,10 +285,18 @@ bool shmem_buffer::unmap() noexcept
 
 char * shmem_buffer::map_impl(size_t offset, size_t size) const noexcept
 {
+    if (view_) {
+        if (offset + size > view_capacity_) {
+            pruv_log(LOG_ERR, "Map beyond buffer capacity");
+            return nullptr;
+        }
+        return view_ + offset;
+    }
     int prot = PROT_READ;
     if (writable)
         prot |= PROT_WRITE;
-    void *r = mmap(nullptr, size, prot, MAP_SHARED, fd, offset);
+    int flags = MAP_SHARED | (populate_ ? MAP_POPULATE : 0);
+    void *r = mmap(nullptr, size, prot, flags, fd, offset);
     if (r == MAP_FAILED) {
         pruv_log_syserr(LOG_ERR, "mmap");
         return nullptr;
@@ -149,6 +313,8 @@ bool shmem_buffer::map(size_t offset, size_t size) noexcept
 {
     assert(!(offset & PAGE_SIZE_MASK));
     size = (size + PAGE_SIZE_MASK) & ~PAGE_SIZE_MASK;
+    if (contiguous())
+        return map_contiguous(offset, size);
     if (map_offset_ == offset && (ptrdiff_t)size == map_end_ - map_begin_) {
         map_ptr_ = map_begin_;
         return true;
@@ -156,6 +322,11 @@ bool shmem_buffer::map(size_t offset, size_t size) noexcept
 
     if (!unmap())
         return false;
+    // mmap rejects empty mappings. Empty buffer has nothing to map.
+    if (!size) {
+        map_offset_ = offset;
+        return true;
+    }
 
     char *r = map_impl(offset, size);
     if (!r)
@@ -199,6 +370,23 @@ bool shmem_buffer::close() noexcept
 {
     bool res = true;
     res &= unmap();
+    if (region_) {
+        if (munmap(region_, reserve_) == -1) {
+            pruv_log_syserr(LOG_ERR, "munmap");
+            res = false;
+        }
+        region_ = nullptr;
+        region_mapped_ = 0;
+        map_ptr_ = map_end_ = map_begin_ = nullptr;
+        map_offset_ = 0;
+    }
+    if (view_) {
+        // Descriptor and memory are owned by arena.
+        view_ = nullptr;
+        fd = -1;
+        file_size_ = 0;
+        return res;
+    }
     if (name_) {
         if (shm_unlink(name_) == -1) {
             pruv_log_syserr(LOG_ERR, "shm_unlink");
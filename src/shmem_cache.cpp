@@ -4,11 +4,17 @@
 
 #include <pruv/shmem_cache.hpp>
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring> // strcmp, strlen
 #include <functional> // hash
 #include <string_view>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <pruv/log.hpp>
+#include <pruv/worker_protocol.hpp>
 
 namespace pruv {
 
@@ -41,6 +47,9 @@ shmem_cache::~shmem_cache()
             e->shm.close();
         delete e;
     });
+    for (size_t i = 0; i < _by_id_cnt; ++i)
+        delete _by_id[i];
+    free(_by_id);
 }
 
 shmem_buffer * shmem_cache::get(char const *name) noexcept
@@ -82,4 +91,94 @@ shmem_buffer * shmem_cache::get(char const *name) noexcept
     return &e->shm;
 }
 
+shmem_cache::id_entry::~id_entry()
+{
+    delete[] slots;
+    if (region && munmap(region, region_size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    if (shm.opened())
+        shm.close();
+}
+
+shmem_buffer * shmem_cache::get(uint32_t id, uint32_t gen, uint32_t slot)
+    noexcept
+{
+    if (id >= _by_id_cnt || !_by_id[id] || _by_id[id]->gen != gen ||
+        !_by_id[id]->shm.opened())
+        return nullptr;
+    id_entry *e = _by_id[id];
+    shmem_buffer *buf = &e->shm;
+    if (e->slots) {
+        if (slot >= e->region_size / e->slot_size) {
+            pruv_log(LOG_ERR, "Invalid arena slot");
+            return nullptr;
+        }
+        buf = &e->slots[slot];
+        size_t base = slot * e->slot_size;
+        if (!buf->opened() && !buf->open_view(e->shm.get_fd(),
+                    e->region + base, base, e->slot_size, _for_write))
+            return nullptr;
+    }
+    buf->set_data_size(0);
+    return buf;
+}
+
+bool shmem_cache::put(uint32_t id, uint32_t gen, int fd, size_t size,
+        size_t slot_size, uint32_t flags) noexcept
+{
+    if (id >= _by_id_cnt) {
+        size_t cnt = std::max<size_t>(id + 1, 2 * _by_id_cnt);
+        id_entry **p = (id_entry **)realloc(_by_id, cnt * sizeof(*p));
+        if (!p) {
+            pruv_log(LOG_EMERG, "Can't allocate memory for cache entries.");
+            close(fd);
+            return false;
+        }
+        std::fill(p + _by_id_cnt, p + cnt, nullptr);
+        _by_id = p;
+        _by_id_cnt = cnt;
+    }
+    id_entry *&e = _by_id[id];
+    delete e;
+    if (!(e = new (std::nothrow) id_entry)) {
+        pruv_log(LOG_EMERG, "Can't allocate memory for cache entry.");
+        close(fd);
+        return false;
+    }
+    e->gen = gen;
+    if (!e->shm.open_fd(fd, _for_write))
+        return false;
+    e->shm.set_populate(flags & CMD_F_POPULATE);
+    if (!slot_size) {
+        if (flags & CMD_F_CONTIGUOUS)
+            e->shm.set_contiguous(size);
+        return true;
+    }
+
+    if (size % slot_size || slot_size & shmem_buffer::PAGE_SIZE_MASK) {
+        pruv_log(LOG_ERR, "Invalid arena segment");
+        e->shm.close();
+        return false;
+    }
+    int prot = PROT_READ | (_for_write ? PROT_WRITE : 0);
+    void *r = mmap(nullptr, size, prot, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (r == MAP_FAILED) {
+        pruv_log_syserr(LOG_ERR, "mmap");
+        e->shm.close();
+        return false;
+    }
+    if ((flags & CMD_F_HUGE_PAGES) && madvise(r, size, MADV_HUGEPAGE) == -1)
+        pruv_log_syserr(LOG_WARNING, "madvise(MADV_HUGEPAGE)");
+    e->region = (char *)r;
+    e->region_size = size;
+    e->slot_size = slot_size;
+    e->slots = new (std::nothrow) shmem_buffer[size / slot_size];
+    if (!e->slots) {
+        pruv_log(LOG_EMERG, "Can't allocate memory for arena slots.");
+        e->shm.close();
+        return false;
+    }
+    return true;
+}
+
 } // namespace pruv
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#include <pruv/shmem_ring.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <pruv/log.hpp>
+#include <pruv/shmem_buffer.hpp>
+
+namespace pruv {
+
+///
+/// shmem_ring
+///
+
+size_t shmem_ring::region_size(size_t capacity) noexcept
+{
+    return sizeof(control) + capacity;
+}
+
+void shmem_ring::attach(void *region, size_t capacity, bool init) noexcept
+{
+    assert(capacity && !(capacity & (capacity - 1)));
+    ctl_ = reinterpret_cast<control *>(region);
+    data_ = reinterpret_cast<char *>(region) + sizeof(control);
+    capacity_ = capacity;
+    if (init) {
+        new (ctl_) control;
+        ctl_->write_pos.store(0, std::memory_order_relaxed);
+        ctl_->read_pos.store(0, std::memory_order_relaxed);
+        ctl_->sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool shmem_ring::write(const iovec *bufs, size_t cnt, bool &notify) noexcept
+{
+    notify = false;
+    size_t len = 0;
+    for (size_t i = 0; i < cnt; ++i)
+        len += bufs[i].iov_len;
+    uint64_t wpos = ctl_->write_pos.load(std::memory_order_relaxed);
+    uint64_t rpos = ctl_->read_pos.load(std::memory_order_acquire);
+    if (capacity_ - (wpos - rpos) < len)
+        return false;
+
+    size_t mask = capacity_ - 1;
+    for (size_t i = 0; i < cnt; ++i) {
+        const char *src = (const char *)bufs[i].iov_base;
+        size_t n = bufs[i].iov_len;
+        while (n) {
+            size_t off = wpos & mask;
+            size_t c = std::min(n, capacity_ - off);
+            memcpy(data_ + off, src, c);
+            src += c;
+            wpos += c;
+            n -= c;
+        }
+    }
+    ctl_->write_pos.store(wpos, std::memory_order_release);
+    // Pairs with fence in prepare_sleep(). Either consumer sees new data or
+    // producer sees sleeping flag.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    notify = ctl_->sleeping.load(std::memory_order_relaxed);
+    return true;
+}
+
+size_t shmem_ring::readable() const noexcept
+{
+    return ctl_->write_pos.load(std::memory_order_acquire) -
+        ctl_->read_pos.load(std::memory_order_relaxed);
+}
+
+void shmem_ring::copy_out(uint64_t pos, void *dst, size_t len) const noexcept
+{
+    size_t mask = capacity_ - 1;
+    char *d = (char *)dst;
+    while (len) {
+        size_t off = pos & mask;
+        size_t c = std::min(len, capacity_ - off);
+        memcpy(d, data_ + off, c);
+        d += c;
+        pos += c;
+        len -= c;
+    }
+}
+
+void shmem_ring::peek(void *dst, size_t len) const noexcept
+{
+    assert(len <= readable());
+    copy_out(ctl_->read_pos.load(std::memory_order_relaxed), dst, len);
+}
+
+void shmem_ring::read(void *dst, size_t len) noexcept
+{
+    assert(len <= readable());
+    uint64_t rpos = ctl_->read_pos.load(std::memory_order_relaxed);
+    copy_out(rpos, dst, len);
+    ctl_->read_pos.store(rpos + len, std::memory_order_release);
+}
+
+bool shmem_ring::prepare_sleep() noexcept
+{
+    ctl_->sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (readable()) {
+        ctl_->sleeping.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void shmem_ring::wake_up() noexcept
+{
+    ctl_->sleeping.store(0, std::memory_order_relaxed);
+}
+
+///
+/// ring_channel
+///
+
+ring_channel::~ring_channel()
+{
+    close();
+}
+
+bool ring_channel::create(size_t capacity) noexcept
+{
+    assert(mem_fd == -1 && cmd_efd == -1 && resp_efd == -1);
+    mem_fd = memfd_create("pruv-ring", MFD_CLOEXEC);
+    if (mem_fd == -1) {
+        pruv_log_syserr(LOG_ERR, "memfd_create");
+        return false;
+    }
+    cmd_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    resp_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (cmd_efd == -1 || resp_efd == -1) {
+        pruv_log_syserr(LOG_ERR, "eventfd");
+        close();
+        return false;
+    }
+    if (ftruncate(mem_fd, channel_size(capacity)) == -1) {
+        pruv_log_syserr(LOG_ERR, "ftruncate");
+        close();
+        return false;
+    }
+    if (!map(capacity, true)) {
+        close();
+        return false;
+    }
+    // Dispatcher sleeps in loop all the time, except when it reads responses.
+    resp.prepare_sleep();
+    return true;
+}
+
+bool ring_channel::attach(int mem_fd, int cmd_efd, int resp_efd,
+        size_t capacity) noexcept
+{
+    this->mem_fd = mem_fd;
+    this->cmd_efd = cmd_efd;
+    this->resp_efd = resp_efd;
+    if (!map(capacity, false)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+size_t ring_channel::channel_size(size_t capacity) noexcept
+{
+    const size_t mask = shmem_buffer::PAGE_SIZE_MASK;
+    return (2 * shmem_ring::region_size(capacity) + mask) & ~mask;
+}
+
+bool ring_channel::map(size_t capacity, bool init) noexcept
+{
+    size_t size = channel_size(capacity);
+    void *r = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            mem_fd, 0);
+    if (r == MAP_FAILED) {
+        pruv_log_syserr(LOG_ERR, "mmap");
+        return false;
+    }
+    region = r;
+    region_size = size;
+    cmd.attach(region, capacity, init);
+    resp.attach((char *)region + shmem_ring::region_size(capacity), capacity,
+            init);
+    return true;
+}
+
+void ring_channel::close() noexcept
+{
+    if (region && munmap(region, region_size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    region = nullptr;
+    region_size = 0;
+    for (int *fd : {&mem_fd, &cmd_efd, &resp_efd}) {
+        if (*fd != -1 && ::close(*fd) == -1)
+            pruv_log_syserr(LOG_ERR, "close");
+        *fd = -1;
+    }
+}
+
+bool ring_channel::notify(int efd) noexcept
+{
+    uint64_t v = 1;
+    for (;;) {
+        if (::write(efd, &v, sizeof(v)) == sizeof(v))
+            return true;
+        if (errno == EINTR)
+            continue;
+        // EAGAIN means counter is overflowed, so consumer will be woken up.
+        if (errno == EAGAIN)
+            return true;
+        pruv_log_syserr(LOG_ERR, "write(eventfd)");
+        return false;
+    }
+}
+
+void ring_channel::drain(int efd) noexcept
+{
+    uint64_t v;
+    while (::read(efd, &v, sizeof(v)) == -1 && errno == EINTR) {}
+}
+
+} // namespace pruv
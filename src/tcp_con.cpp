@@ -4,6 +4,10 @@
 
 #include <pruv/tcp_con.hpp>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
 #include <pruv/cleanup_helpers.hpp>
 #include <pruv/log.hpp>
 
@@ -29,11 +33,6 @@ bool tcp_con::accept(uv_loop_t *loop, uv_stream_t *server, void *owner,
     }
 
     pruv_log(LOG_DEBUG, "Connection accepted");
-
-    if ((r = uv_tcp_nodelay(this, 0))) {
-        pruv_log_uv_err(LOG_ERR, "uv_tcp_nodelay", r);
-        return true;
-    }
     return true;
 }
 
@@ -55,15 +54,17 @@ bool tcp_con::set_tcp_keepalive(int enable, unsigned delay, unsigned interval,
 {
     bool ret = true;
     int r;
-    if ((r = uv_tcp_keepalive(this, 1, 20)) < 0) {
+    if ((r = uv_tcp_keepalive(this, enable, delay)) < 0) {
         pruv_log_uv_err(LOG_ERR, "uv_tcp_keepalive", r);
         ret = false;
     }
+    if (!enable)
+        return ret;
 
     uv_os_fd_t fd;
     if ((r = uv_fileno(base<uv_handle_t *>(), &fd)) < 0) {
         pruv_log_uv_err(LOG_ERR, "uv_fileno", r);
-        ret = false;
+        return false;
     }
 
     if ((r = setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
@@ -79,6 +80,38 @@ bool tcp_con::set_tcp_keepalive(int enable, unsigned delay, unsigned interval,
     return ret;
 }
 
+bool tcp_con::set_options(const socket_options &opts) noexcept
+{
+    bool ret = true;
+    int r;
+    if ((r = uv_tcp_nodelay(this, opts.nodelay)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_tcp_nodelay", r);
+        ret = false;
+    }
+    if (opts.keepalive && !set_tcp_keepalive(1, opts.keepalive_idle,
+                opts.keepalive_interval, opts.keepalive_cnt))
+        ret = false;
+    if (!opts.notsent_lowat && !opts.busy_poll)
+        return ret;
+
+    uv_os_fd_t fd;
+    if ((r = uv_fileno(base<uv_handle_t *>(), &fd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_fileno", r);
+        return false;
+    }
+    if (opts.notsent_lowat && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &opts.notsent_lowat, sizeof(opts.notsent_lowat))) {
+        pruv_log_syserr(LOG_ERR, "setsockopt(TCP_NOTSENT_LOWAT)");
+        ret = false;
+    }
+    if (opts.busy_poll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                &opts.busy_poll, sizeof(opts.busy_poll))) {
+        pruv_log_syserr(LOG_ERR, "setsockopt(SO_BUSY_POLL)");
+        ret = false;
+    }
+    return ret;
+}
+
 bool tcp_con::read_start(uv_alloc_cb alloc_cb, uv_read_cb read_cb) noexcept
 {
     // Start connection reading.
@@ -102,4 +135,12 @@ bool tcp_con::read_stop() noexcept
     return true;
 }
 
+int tcp_con::fileno() noexcept
+{
+    uv_os_fd_t fd;
+    if (uv_fileno(base<uv_handle_t *>(), &fd) < 0)
+        return -1;
+    return fd;
+}
+
 } // namespace pruv
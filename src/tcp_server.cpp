@@ -4,6 +4,12 @@
 
 #include <pruv/tcp_server.hpp>
 
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <pruv/log.hpp>
 
 namespace pruv {
@@ -18,9 +24,48 @@ bool tcp_server::init(uv_loop_t *loop) noexcept
     return true;
 }
 
+bool tcp_server::open(int fd) noexcept
+{
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+        pruv_log_syserr(LOG_EMERG, "fcntl(FD_CLOEXEC)");
+        ::close(fd);
+        return false;
+    }
+    int r = uv_tcp_open(this, fd);
+    if (r < 0) {
+        pruv_log_uv_err(LOG_EMERG, "uv_tcp_open", r);
+        ::close(fd);
+        return false;
+    }
+    return true;
+}
+
 bool tcp_server::bind(sockaddr *addr, unsigned int flags) noexcept
 {
-    int r = uv_tcp_bind(this, addr, 0);
+    int r;
+    if (flags & REUSEPORT) {
+        // libuv creates socket only inside uv_tcp_bind. Therefore create it
+        // here to set option before bind.
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            pruv_log_syserr(LOG_EMERG, "socket");
+            return false;
+        }
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+            pruv_log_syserr(LOG_EMERG, "setsockopt(SO_REUSEPORT)");
+            ::close(fd);
+            return false;
+        }
+        if ((r = uv_tcp_open(this, fd)) < 0) {
+            pruv_log_uv_err(LOG_EMERG, "uv_tcp_open", r);
+            ::close(fd);
+            return false;
+        }
+    }
+
+    r = uv_tcp_bind(this, addr, flags & ~REUSEPORT);
     if (r < 0) {
         pruv_log_uv_err(LOG_EMERG, "uv_tcp_bind", r);
         return false;
@@ -28,6 +73,27 @@ bool tcp_server::bind(sockaddr *addr, unsigned int flags) noexcept
     return true;
 }
 
+bool tcp_server::set_options(const socket_options &opts) noexcept
+{
+    uv_os_fd_t fd;
+    int r = uv_fileno(base<uv_handle_t *>(), &fd);
+    if (r < 0) {
+        pruv_log_uv_err(LOG_EMERG, "uv_fileno", r);
+        return false;
+    }
+    if (opts.defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &opts.defer_accept, sizeof(opts.defer_accept))) {
+        pruv_log_syserr(LOG_EMERG, "setsockopt(TCP_DEFER_ACCEPT)");
+        return false;
+    }
+    if (opts.fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                &opts.fastopen, sizeof(opts.fastopen))) {
+        pruv_log_syserr(LOG_EMERG, "setsockopt(TCP_FASTOPEN)");
+        return false;
+    }
+    return true;
+}
+
 bool tcp_server::listen(int backlog, uv_connection_cb cb) noexcept
 {
     int r = uv_listen(base<uv_stream_t *>(), backlog, cb);
@@ -38,6 +104,14 @@ bool tcp_server::listen(int backlog, uv_connection_cb cb) noexcept
     return true;
 }
 
+int tcp_server::fileno() noexcept
+{
+    uv_os_fd_t fd;
+    if (uv_fileno(base<uv_handle_t *>(), &fd) < 0)
+        return -1;
+    return fd;
+}
+
 void tcp_server::close(uv_close_cb close_cb)
 {
     if (!uv_is_closing(base<uv_handle_t *>()))
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) Andrey Pikas
+ */
+
+#include <pruv/uring.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <pruv/log.hpp>
+
+namespace pruv {
+
+namespace {
+
+/// Idle time in milliseconds, after which submission thread sleeps.
+constexpr unsigned SQ_THREAD_IDLE = 1000;
+
+template<typename T>
+T * ring_ptr(void *ring, uint32_t offset) noexcept
+{
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+} // namespace
+
+uring::~uring()
+{
+    if (opened())
+        close();
+}
+
+bool uring::init(uv_loop_t *loop, unsigned entries, bool sqpoll,
+        uv_write_cb done) noexcept
+{
+    this->loop = loop;
+    this->done = done;
+    this->sqpoll = sqpoll;
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQ_THREAD_IDLE;
+    }
+    ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring_fd == -1) {
+        pruv_log_syserr(LOG_ERR, "io_uring_setup");
+        return false;
+    }
+    // Socket writes rely on kernel polling sockets instead of returning
+    // EAGAIN, and completions must not be dropped.
+    if (!(p.features & IORING_FEAT_FAST_POLL) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        pruv_log(LOG_ERR, "io_uring lacks fast poll or nodrop features");
+        close();
+        return false;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        pruv_log_syserr(LOG_ERR, "mmap");
+        close();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else if ((cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd,
+                    IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        cq_ring = nullptr;
+        pruv_log_syserr(LOG_ERR, "mmap");
+        close();
+        return false;
+    }
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED) {
+        pruv_log_syserr(LOG_ERR, "mmap");
+        close();
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(s);
+
+    sq_head = ring_ptr<unsigned>(sq_ring, p.sq_off.head);
+    sq_tail = ring_ptr<unsigned>(sq_ring, p.sq_off.tail);
+    sq_flags = ring_ptr<unsigned>(sq_ring, p.sq_off.flags);
+    sq_mask = *ring_ptr<unsigned>(sq_ring, p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+    // Entries are used in order, so array is identity.
+    unsigned *array = ring_ptr<unsigned>(sq_ring, p.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i)
+        array[i] = i;
+    cq_head = ring_ptr<unsigned>(cq_ring, p.cq_off.head);
+    cq_tail = ring_ptr<unsigned>(cq_ring, p.cq_off.tail);
+    cq_mask = *ring_ptr<unsigned>(cq_ring, p.cq_off.ring_mask);
+    cqes = ring_ptr<io_uring_cqe>(cq_ring, p.cq_off.cqes);
+
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd == -1) {
+        pruv_log_syserr(LOG_ERR, "eventfd");
+        close();
+        return false;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD,
+                &efd, 1) == -1) {
+        pruv_log_syserr(LOG_ERR, "io_uring_register");
+        close();
+        return false;
+    }
+
+    int r;
+    if ((r = uv_poll_init(loop, &poll, efd)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_init", r);
+        close();
+        return false;
+    }
+    uv_prepare_init(loop, &prepare);
+    poll.data = this;
+    prepare.data = this;
+    auto poll_cb = [](uv_poll_t *h, int status, int /*events*/) {
+        uring *u = reinterpret_cast<uring *>(h->data);
+        if (status < 0)
+            pruv_log_uv_err(LOG_ERR, "poll_cb", status);
+        u->reap();
+    };
+    if ((r = uv_poll_start(&poll, UV_READABLE, poll_cb)) < 0) {
+        pruv_log_uv_err(LOG_ERR, "uv_poll_start", r);
+        close();
+        return false;
+    }
+    // Poll keeps loop alive only while writes are in flight.
+    uv_unref((uv_handle_t *)&poll);
+    uv_prepare_start(&prepare, [](uv_prepare_t *h) {
+        uring *u = reinterpret_cast<uring *>(h->data);
+        u->submit();
+        // Socket writes usually finish inline. Connection closed after its
+        // response sends FIN before peer polls for the data.
+        if (*u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            u->reap();
+    });
+    uv_unref((uv_handle_t *)&prepare);
+    return true;
+}
+
+void uring::close() noexcept
+{
+    assert(inflight.empty());
+    if (poll.data) {
+        uv_close((uv_handle_t *)&poll, nullptr);
+        uv_close((uv_handle_t *)&prepare, nullptr);
+        poll.data = nullptr;
+    }
+    if (sqes && munmap(sqes, sqes_size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    if (cq_ring && cq_ring != sq_ring && munmap(cq_ring, cq_ring_size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    if (sq_ring && munmap(sq_ring, sq_ring_size) == -1)
+        pruv_log_syserr(LOG_ERR, "munmap");
+    sqes = nullptr;
+    cq_ring = sq_ring = nullptr;
+    for (int *fd : {&efd, &ring_fd}) {
+        if (*fd != -1 && ::close(*fd) == -1)
+            pruv_log_syserr(LOG_ERR, "close");
+        *fd = -1;
+    }
+    while (op *o = free_ops) {
+        free_ops = o->next_free;
+        delete o;
+    }
+}
+
+int uring::write(uv_write_t *req, uv_stream_t *stream, const uv_buf_t bufs[],
+        unsigned nbufs, uv_write_cb cb) noexcept
+{
+    if (nbufs > MAX_BUFS)
+        return UV_EINVAL;
+    op *o = free_ops;
+    if (o)
+        free_ops = o->next_free;
+    else if (!(o = new (std::nothrow) op))
+        return UV_ENOMEM;
+    req->handle = stream;
+    req->cb = cb;
+    o->req = req;
+    memset(&o->msg, 0, sizeof(o->msg));
+    o->msg.msg_iov = o->iov;
+    o->msg.msg_iovlen = nbufs;
+    for (unsigned i = 0; i < nbufs; ++i)
+        o->iov[i] = {bufs[i].base, bufs[i].len};
+    if (!send(o)) {
+        o->next_free = free_ops;
+        free_ops = o;
+        return UV_ENOBUFS;
+    }
+    if (inflight.empty())
+        uv_ref((uv_handle_t *)&poll);
+    inflight.push_back(*o);
+    return 0;
+}
+
+void uring::cancel(uv_stream_t *stream) noexcept
+{
+    for (op &o : inflight) {
+        if (o.req->handle != stream)
+            continue;
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) {
+            pruv_log(LOG_ERR, "io_uring submission queue is full");
+            break;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uintptr_t>(&o);
+        sqe->user_data = 0;
+    }
+    submit();
+}
+
+bool uring::send(op *o) noexcept
+{
+    int fd;
+    if (uv_fileno((uv_handle_t *)o->req->handle, &fd) < 0)
+        return false;
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&o->msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<uintptr_t>(o);
+    return true;
+}
+
+void uring::complete(op *o, int res) noexcept
+{
+    // Interrupted or not polled send is retried.
+    if (res == -EAGAIN || res == -EINTR)
+        res = 0;
+    if (res < 0)
+        return finish(o, res);
+    size_t len = res;
+    while (o->msg.msg_iovlen && len >= o->msg.msg_iov->iov_len) {
+        len -= o->msg.msg_iov->iov_len;
+        ++o->msg.msg_iov;
+        --o->msg.msg_iovlen;
+    }
+    if (!o->msg.msg_iovlen)
+        return finish(o, 0);
+    o->msg.msg_iov->iov_base = (char *)o->msg.msg_iov->iov_base + len;
+    o->msg.msg_iov->iov_len -= len;
+    if (!send(o))
+        finish(o, UV_ENOBUFS);
+}
+
+void uring::finish(op *o, int status) noexcept
+{
+    uv_write_t *req = o->req;
+    o->unlink();
+    o->next_free = free_ops;
+    free_ops = o;
+    if (inflight.empty())
+        uv_unref((uv_handle_t *)&poll);
+    done(req, status);
+}
+
+io_uring_sqe * uring::get_sqe() noexcept
+{
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+            sq_entries) {
+        submit();
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+                sq_entries)
+            return nullptr;
+    }
+    io_uring_sqe *sqe = &sqes[sq_local_tail++ & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring::submit() noexcept
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = 0;
+    unsigned to_submit = 0;
+    if (sqpoll) {
+        // Kernel thread must see the tail before its flags are checked.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) &
+                    IORING_SQ_NEED_WAKEUP))
+            return;
+        flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    else if (!(to_submit = sq_local_tail -
+                __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)))
+        return;
+    // Entries not submitted because of error are submitted next time.
+    while (syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, flags,
+                nullptr, 0) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EBUSY)
+            pruv_log_syserr(LOG_ERR, "io_uring_enter");
+        break;
+    }
+}
+
+void uring::reap() noexcept
+{
+    uint64_t v;
+    while (::read(efd, &v, sizeof(v)) == -1 && errno == EINTR) {}
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe *cqe = &cqes[head++ & cq_mask];
+        op *o = reinterpret_cast<op *>(cqe->user_data);
+        int res = cqe->res;
+        // Entry is released before handling, which may submit new ones.
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (o) // Cancel requests have no op.
+            complete(o, res);
+    }
+    submit();
+}
+
+} // namespace pruv
@@ -10,14 +10,20 @@
 #include <cstring>
 #include <iterator>
 
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <pruv/log.hpp>
 #include <pruv/shmem_buffer.hpp>
 #include <pruv/shmem_cache.hpp>
 #include <pruv/termination.hpp>
+#include <pruv/worker_protocol.hpp>
 
 namespace pruv {
 
@@ -28,6 +34,75 @@ void termhdlr(int sig)
     setup_interruption(sig == SIGINT ? IRQ_INT : IRQ_TERM);
 }
 
+bool send_to_dispatcher(int ctl, const zygote_child_cmd &cmd) noexcept
+{
+    for (;;) {
+        if (send(ctl, &cmd, sizeof(cmd), MSG_NOSIGNAL) == sizeof(cmd))
+            return true;
+        if (errno != EINTR) {
+            pruv_log_syserr(LOG_ERR, "send(zygote)");
+            return false;
+        }
+    }
+}
+
+/// Report all exited children.
+bool reap_children(int ctl) noexcept
+{
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0)
+            return true;
+        zygote_child_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.hdr = make_cmd_header(CMD_ZYGOTE_EXITED, 0, sizeof(cmd));
+        cmd.pid = pid;
+        cmd.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+        cmd.term_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        if (!send_to_dispatcher(ctl, cmd))
+            return false;
+    }
+}
+
+/// Place descriptors received with fork request: stdin, stdout and then
+/// descriptors 3 + i for bits i of mask.
+bool install_child_fds(int *fds, size_t cnt, uint32_t mask) noexcept
+{
+    // Move all descriptors out of the way first, because targets may be
+    // occupied by other received descriptors.
+    for (size_t i = 0; i < cnt; ++i) {
+        int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 3 + 32);
+        if (fd == -1) {
+            pruv_log_syserr(LOG_ERR, "fcntl(F_DUPFD_CLOEXEC)");
+            return false;
+        }
+        close(fds[i]);
+        fds[i] = fd;
+    }
+    for (size_t i = 0; i < cnt; ++i) {
+        int target = (int)i;
+        if (i >= 2) {
+            // Skip stderr. Position of the next bit of mask.
+            target = 3 + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        if (dup2(fds[i], target) == -1) {
+            pruv_log_syserr(LOG_ERR, "dup2");
+            return false;
+        }
+        close(fds[i]);
+    }
+    return true;
+}
+
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
 } // namespace
 
 int worker_loop::_argc = 0;
@@ -35,6 +110,33 @@ char const * const * worker_loop::_argv = nullptr;
 
 worker_loop::worker_loop() {}
 
+worker_loop::~worker_loop()
+{
+    for (size_t i = 0; i < _deferred_cnt; ++i) {
+        free(_deferred[i].inline_copy);
+        free(_deferred[i].meta_copy);
+    }
+    for (size_t i = 0; i < _batch_cnt; ++i) {
+        free(_batch[i].inline_copy);
+        free(_batch[i].meta_copy);
+    }
+    free(_cur.inline_copy);
+    free(_cur.meta_copy);
+    for (size_t i = 0; i < _own_cnt; ++i) {
+        if (_own_bufs[i]) {
+            _own_bufs[i]->close();
+            delete _own_bufs[i];
+        }
+    }
+    free(_own_bufs);
+    free(_local_bufs);
+    free(_inline_req);
+    free(_long_meta);
+    free(_deferred);
+    free(_batch);
+    free(_resp_out);
+}
+
 int worker_loop::setup(int argc, char const * const *argv) noexcept
 {
     _argc = argc;
@@ -74,26 +176,189 @@ char const * const * worker_loop::argv() noexcept
 
 int worker_loop::run() noexcept
 {
+    if (!warm_up()) {
+        pruv_log(LOG_ERR, "Warm up failed.");
+        return EXIT_FAILURE;
+    }
+    if (const char *zygote_fd = getenv(ZYGOTE_ENV)) {
+        bool child;
+        int r = zygote_loop(atoi(zygote_fd), child);
+        if (!child)
+            return r;
+        if (r != EXIT_SUCCESS)
+            return r;
+    }
+    _binary_requests = binary_protocol();
+    cmd_header ready = make_cmd_header(CMD_READY,
+            _binary_requests ? CMD_F_BINARY_REQUESTS : 0, sizeof(cmd_header));
+    if (!write_all(&ready, sizeof(ready)))
+        return EXIT_FAILURE;
+
     for (;;) {
-        if (!next_request()) {
+        if (!next_batch()) {
             if (interruption_requested() == IRQ_TERM)
                 break;
             else
                 return EXIT_FAILURE;
         }
 
-        int r = handle_request();
+        _coalesce = _batch_cnt > 1;
+        int r = handle_batch();
         if (interruption_requested() == IRQ_TERM)
             break;
         else if (r != EXIT_SUCCESS)
             return r;
-        if (!clean_after_request())
+        if (!finish_batch())
             return EXIT_FAILURE;
     }
     pruv_log(LOG_NOTICE, "Terminated.");
     return EXIT_SUCCESS;
 }
 
+bool worker_loop::warm_up() noexcept
+{
+    return true;
+}
+
+int worker_loop::handle_batch() noexcept
+{
+    for (size_t i = 0; i < _batch_cnt; ++i) {
+        if (!select_request(i))
+            return EXIT_FAILURE;
+        int r = handle_request();
+        if (r != EXIT_SUCCESS || interruption_requested() == IRQ_TERM)
+            return r;
+    }
+    return EXIT_SUCCESS;
+}
+
+bool worker_loop::select_request(size_t i) noexcept
+{
+    if (i >= _batch_cnt || !_batch[i].request) {
+        pruv_log(LOG_ERR, "No request %" PRIuPTR " in batch", i);
+        return false;
+    }
+    if (!clean_after_request())
+        return false;
+    _cur = _batch[i];
+    _batch[i] = request_state();
+    return true;
+}
+
+int worker_loop::zygote_loop(int ctl, bool &child) noexcept
+{
+    child = false;
+    // Forked workers must not become zygotes.
+    unsetenv(ZYGOTE_ENV);
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld_mask, &old_mask) == -1) {
+        pruv_log_syserr(LOG_ERR, "sigprocmask");
+        return EXIT_FAILURE;
+    }
+    int sfd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd == -1) {
+        pruv_log_syserr(LOG_ERR, "signalfd");
+        return EXIT_FAILURE;
+    }
+    pruv_log(LOG_INFO, "Zygote ready");
+
+    int ret = EXIT_SUCCESS;
+    while (interruption_requested() != IRQ_TERM) {
+        // Stdin is closed by dispatcher when zygote isn't needed anymore.
+        pollfd fds[3] = {{ctl, POLLIN, 0}, {sfd, POLLIN, 0},
+            {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            pruv_log_syserr(LOG_ERR, "poll");
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if (fds[1].revents) {
+            signalfd_siginfo si;
+            while (read(sfd, &si, sizeof(si)) > 0) {}
+            if (!reap_children(ctl)) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+        }
+        if (fds[2].revents)
+            break;
+        if (!(fds[0].revents & POLLIN)) {
+            if (!fds[0].revents)
+                continue;
+            break; // Dispatcher closed control socket.
+        }
+
+        zygote_fork_cmd cmd;
+        int cfds[ZYGOTE_MAX_FDS];
+        alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(cfds))];
+        iovec iov = {&cmd, sizeof(cmd)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        ssize_t r = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            pruv_log_syserr(LOG_ERR, "recvmsg(zygote)");
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if (!r)
+            break;
+        size_t cfds_cnt = 0;
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            cfds_cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(cfds, CMSG_DATA(cm), cfds_cnt * sizeof(int));
+        }
+        if (r != sizeof(cmd) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            !valid_cmd_header(cmd.hdr, CMD_ZYGOTE_FORK) ||
+            cmd.hdr.size != sizeof(cmd) ||
+            cfds_cnt != 2 + (size_t)__builtin_popcount(cmd.inherit_mask)) {
+            pruv_log(LOG_ERR, "Invalid fork request");
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        pid_t pid = fork();
+        int fork_err = errno;
+        if (!pid) {
+            child = true;
+            close(sfd);
+            close(ctl);
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            if (prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0) == -1)
+                pruv_log_syserr(LOG_ERR, "worker_loop prctl");
+            return install_child_fds(cfds, cfds_cnt, cmd.inherit_mask) ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (pid == -1)
+            pruv_log_syserr(LOG_ERR, "fork");
+        for (size_t i = 0; i < cfds_cnt; ++i)
+            close(cfds[i]);
+        zygote_child_cmd reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.hdr = make_cmd_header(CMD_ZYGOTE_FORKED, 0, sizeof(reply));
+        reply.cookie = cmd.cookie;
+        reply.pid = pid == -1 ? -fork_err : pid;
+        if (!send_to_dispatcher(ctl, reply)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    close(sfd);
+    // Forked workers are terminated by PR_SET_PDEATHSIG.
+    pruv_log(LOG_NOTICE, "Zygote terminated.");
+    return ret;
+}
+
 bool worker_loop::read_line() noexcept
 {
     char *dst = _ln;
@@ -121,6 +386,202 @@ bool worker_loop::read_line() noexcept
     return false;
 }
 
+bool worker_loop::read_all(void *dst, size_t len) noexcept
+{
+    char *p = (char *)dst;
+    while (len && interruption_requested() != IRQ_TERM) {
+        ssize_t r = read(STDIN_FILENO, p, len);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            pruv_log_syserr(LOG_ERR, "read(STDIN_FILENO)");
+            return false;
+        }
+        if (!r) {
+            pruv_log(LOG_ERR, "Unexpected end of input");
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return !len;
+}
+
+bool worker_loop::wait_frame() noexcept
+{
+    _from_ring = false;
+    if (!_ring.opened() && _wakeup_fd == -1)
+        return true; // Blocking read from stdin.
+
+    for (;;) {
+        if (_ring.opened()) {
+            // Spin while requests come frequently. Spin limit grows when
+            // request was caught while spinning and falls when worker goes
+            // to sleep.
+            for (unsigned i = 0; i < _spin_limit; ++i) {
+                if (_ring.cmd.readable()) {
+                    _spin_limit = std::min(_spin_limit * 2, MAX_SPIN);
+                    _from_ring = true;
+                    return true;
+                }
+                cpu_relax();
+            }
+            _spin_limit = std::max(_spin_limit / 2, MIN_SPIN);
+
+            if (!_ring.cmd.prepare_sleep()) {
+                _from_ring = true;
+                return true;
+            }
+        }
+
+        // Negative descriptors are ignored by poll().
+        pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {_wakeup_fd, POLLIN, 0},
+            {_ring.cmd_efd, POLLIN, 0}};
+        int r = poll(fds, 3, -1);
+        if (_ring.opened())
+            _ring.cmd.wake_up();
+        if (r == -1) {
+            if (errno != EINTR) {
+                pruv_log_syserr(LOG_ERR, "poll");
+                return false;
+            }
+            if (interruption_requested() == IRQ_TERM)
+                return false;
+            continue;
+        }
+        if (fds[1].revents) {
+            // Resumed request is cleaned here, because run() doesn't know
+            // about it.
+            if (on_wakeup() != EXIT_SUCCESS || !clean_after_request())
+                return false;
+            continue;
+        }
+        if (fds[2].revents)
+            ring_channel::drain(_ring.cmd_efd);
+        if (_ring.opened() && _ring.cmd.readable()) {
+            _from_ring = true;
+            return true;
+        }
+        if (fds[0].revents)
+            return true; // Frame or EOF in pipe.
+    }
+}
+
+bool worker_loop::read_frame(void *dst, size_t len) noexcept
+{
+    if (!_from_ring)
+        return read_all(dst, len);
+    // Dispatcher writes whole frame at once.
+    if (_ring.cmd.readable() < len) {
+        pruv_log(LOG_ERR, "Partial frame in ring");
+        return false;
+    }
+    _ring.cmd.read(dst, len);
+    return true;
+}
+
+bool worker_loop::setup_ring(const cmd_header &hdr) noexcept
+{
+    ring_setup_cmd cmd;
+    cmd.hdr = hdr;
+    if (_from_ring || _ring.opened() || hdr.size != sizeof(cmd) ||
+        !read_frame(&cmd.hdr + 1, sizeof(cmd) - sizeof(cmd.hdr))) {
+        pruv_log(LOG_ERR, "Invalid ring setup frame");
+        return false;
+    }
+    if (!cmd.capacity || (cmd.capacity & (cmd.capacity - 1))) {
+        pruv_log(LOG_ERR, "Invalid ring capacity");
+        return false;
+    }
+    if (!_ring.attach(cmd.mem_fd, cmd.cmd_efd, cmd.resp_efd, cmd.capacity))
+        return false;
+    pruv_log(LOG_DEBUG, "Ring transport enabled");
+    return true;
+}
+
+bool worker_loop::recv_request_frame(size_t &buf_in_pos, size_t &buf_in_len,
+        size_t &buf_out_file_size) noexcept
+{
+    request_cmd cmd;
+    for (;;) {
+        if (!wait_frame() || !read_frame(&cmd.hdr, sizeof(cmd.hdr)))
+            return false;
+        if (!valid_cmd_header(cmd.hdr, CMD_RING_SETUP))
+            break;
+        if (!setup_ring(cmd.hdr))
+            return false;
+    }
+    if (!read_frame(&cmd.hdr + 1, sizeof(cmd) - sizeof(cmd.hdr)))
+        return false;
+    _inline_request = cmd.hdr.flags & CMD_F_INLINE_REQUEST;
+    _inline_response = cmd.hdr.flags & CMD_F_INLINE_RESPONSE;
+    _inline_max = cmd.inline_max;
+    _worker_response = cmd.hdr.flags & CMD_F_WORKER_BUFFER;
+    if (!valid_cmd_header(cmd.hdr, CMD_REQUEST) ||
+        cmd.hdr.size != sizeof(cmd) + (uint64_t)cmd.in_name_len +
+            cmd.out_name_len + cmd.meta_len +
+            (_inline_request ? cmd.in_len : 0)) {
+        pruv_log(LOG_ERR, "Invalid request frame");
+        return false;
+    }
+    if (cmd.in_name_len >= sizeof(_buf_in_name) ||
+        cmd.out_name_len >= sizeof(_buf_out_name)) {
+        pruv_log(LOG_ERR, "Buffer name too long");
+        return false;
+    }
+    if ((cmd.hdr.flags & CMD_F_BUFFER_IDS) &&
+        (cmd.in_name_len || cmd.out_name_len)) {
+        pruv_log(LOG_ERR, "Buffer names with ids");
+        return false;
+    }
+
+    _meta = _req_meta;
+    if (cmd.meta_len >= sizeof(_req_meta)) {
+        if (cmd.meta_len >= _long_meta_cap) {
+            char *p = (char *)realloc(_long_meta, cmd.meta_len + 1);
+            if (!p) {
+                pruv_log(LOG_EMERG, "No memory for request meta");
+                return false;
+            }
+            _long_meta = p;
+            _long_meta_cap = cmd.meta_len + 1;
+        }
+        _meta = _long_meta;
+    }
+    // Request pointer must not be null even for empty request.
+    if (_inline_request && cmd.in_len >= _inline_req_cap) {
+        char *p = (char *)realloc(_inline_req, cmd.in_len + 1);
+        if (!p) {
+            pruv_log(LOG_EMERG, "No memory for inline request");
+            return false;
+        }
+        _inline_req = p;
+        _inline_req_cap = cmd.in_len + 1;
+    }
+
+    if (!read_frame(_buf_in_name, cmd.in_name_len) ||
+        !read_frame(_buf_out_name, cmd.out_name_len) ||
+        !read_frame(_meta, cmd.meta_len) ||
+        (_inline_request && !read_frame(_inline_req, cmd.in_len)))
+        return false;
+    _buf_in_name[cmd.in_name_len] = 0;
+    _buf_out_name[cmd.out_name_len] = 0;
+    _meta[cmd.meta_len] = 0;
+
+    buf_in_pos = cmd.in_pos;
+    buf_in_len = cmd.in_len;
+    buf_out_file_size = cmd.out_file_size;
+    _cur.tag = cmd.tag;
+    _cur.close = cmd.hdr.flags & CMD_F_CLOSE;
+    _buf_in_id = cmd.in_id;
+    _buf_in_gen = cmd.in_gen;
+    _buf_out_id = cmd.out_id;
+    _buf_out_gen = cmd.out_gen;
+    _buf_in_slot = cmd.in_slot;
+    _buf_out_slot = cmd.out_slot;
+    return true;
+}
+
 bool worker_loop::recv_request_cmd(
         char (&buf_in_name)[256], size_t &buf_in_pos, size_t &buf_in_len,
         char (&buf_out_name)[256], size_t &buf_out_file_size,
@@ -148,76 +609,535 @@ bool worker_loop::recv_request_cmd(
     return true;
 }
 
+int worker_loop::recv_buffer_frame(bool wait) noexcept
+{
+    union {
+        cmd_header hdr;
+        buffer_fd_cmd fd;
+        buffer_release_cmd release;
+    } frame;
+    int fd;
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fd))];
+    iovec iov = {&frame, sizeof(frame)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t r;
+    int flags = MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT);
+    while ((r = recvmsg(BUF_SOCK_FD, &msg, flags)) == -1) {
+        if (!wait && errno == EAGAIN)
+            return 0;
+        if (errno != EINTR || interruption_requested() == IRQ_TERM) {
+            pruv_log_syserr(LOG_ERR, "recvmsg(BUF_SOCK_FD)");
+            return -1;
+        }
+    }
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm && r == sizeof(frame.release) &&
+        valid_cmd_header(frame.hdr, CMD_BUFFER_RELEASE) &&
+        frame.hdr.size == sizeof(frame.release)) {
+        uint32_t id = frame.release.id;
+        if (id >= _own_cnt || !_own_bufs[id] || !_own_bufs[id]->registered) {
+            pruv_log(LOG_ERR, "Release of unknown buffer %" PRIu32, id);
+            return -1;
+        }
+        return release_local_buffer(_own_bufs[id]) ? 1 : -1;
+    }
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fd))) {
+        pruv_log(LOG_ERR, "No descriptor in buffer frame");
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cm), sizeof(fd));
+    const buffer_fd_cmd &cmd = frame.fd;
+    if (r != sizeof(cmd) || !valid_cmd_header(cmd.hdr, CMD_BUFFER_FD) ||
+        cmd.hdr.size != sizeof(cmd)) {
+        pruv_log(LOG_ERR, "Invalid buffer frame");
+        close(fd);
+        return -1;
+    }
+    return _buf_fd_cache.put(cmd.id, cmd.gen, fd, cmd.size, cmd.slot_size,
+            cmd.hdr.flags) ? 1 : -1;
+}
+
+shmem_buffer * worker_loop::buffer_by_id(uint32_t id, uint32_t gen,
+        uint32_t slot) noexcept
+{
+    // Dispatcher sends descriptor before request, which uses it.
+    for (;;) {
+        if (shmem_buffer *buf = _buf_fd_cache.get(id, gen, slot))
+            return buf;
+        if (recv_buffer_frame(true) != 1)
+            return nullptr;
+    }
+}
+
+shmem_buffer * worker_loop::find_buffer(shmem_cache &cache, const char *name,
+        uint32_t id, uint32_t gen, uint32_t slot) noexcept
+{
+    if (!name[0])
+        return buffer_by_id(id, gen, slot);
+    if (name[0] == '#') {
+        slot = 0;
+        if (sscanf(name, "#%" SCNu32 ".%" SCNu32 ".%" SCNu32,
+                    &id, &gen, &slot) < 2) {
+            pruv_log(LOG_ERR, "Invalid buffer reference %s", name);
+            return nullptr;
+        }
+        return buffer_by_id(id, gen, slot);
+    }
+    return cache.get(name);
+}
+
 bool worker_loop::next_request() noexcept
 {
     size_t buf_in_pos;
     size_t buf_in_len;
     size_t buf_out_file_size;
-    if (!recv_request_cmd(
-                _buf_in_name, buf_in_pos, buf_in_len,
-                _buf_out_name, buf_out_file_size,
-                _req_meta, sizeof(_req_meta)))
-        return false;
+    if (_binary_requests) {
+        if (!recv_request_frame(buf_in_pos, buf_in_len, buf_out_file_size))
+            return false;
+    }
+    else {
+        _meta = _req_meta;
+        _cur.tag = 0;
+        _cur.close = false;
+        _inline_request = false;
+        _inline_response = false;
+        _worker_response = false;
+        if (!wait_frame() || !recv_request_cmd(
+                    _buf_in_name, buf_in_pos, buf_in_len,
+                    _buf_out_name, buf_out_file_size,
+                    _req_meta, sizeof(_req_meta)))
+            return false;
+    }
 
-    shmem_buffer *buf_in = _buf_in_cache.get(_buf_in_name);
-    if (!buf_in)
-        return false;
-    size_t buf_in_base_pos = buf_in_pos & ~shmem_buffer::PAGE_SIZE_MASK;
-    size_t in_len = buf_in_pos + buf_in_len - buf_in_base_pos;
-    size_t buf_in_end_pos = buf_in->map_offset() +
-        (buf_in->map_end() - buf_in->map_begin());
-    if (!(buf_in->map_offset() <= buf_in_base_pos &&
-          buf_in_base_pos + in_len <= buf_in_end_pos)) {
-        if (!buf_in->map(buf_in_base_pos, in_len))
+    if (_inline_request) {
+        _cur.request_buf = nullptr;
+        _cur.request = _inline_req;
+    }
+    else {
+        shmem_buffer *buf_in = find_buffer(_buf_in_cache, _buf_in_name,
+                _buf_in_id, _buf_in_gen, _buf_in_slot);
+        if (!buf_in)
             return false;
+        size_t buf_in_base_pos = buf_in_pos & ~shmem_buffer::PAGE_SIZE_MASK;
+        size_t in_len = buf_in_pos + buf_in_len - buf_in_base_pos;
+        size_t buf_in_end_pos = buf_in->map_offset() +
+            (buf_in->map_end() - buf_in->map_begin());
+        if (!(buf_in->map_offset() <= buf_in_base_pos &&
+              buf_in_base_pos + in_len <= buf_in_end_pos)) {
+            if (!buf_in->map(buf_in_base_pos, in_len))
+                return false;
+        }
+        buf_in->move_ptr((ptrdiff_t)buf_in_pos -
+                (ptrdiff_t)buf_in->cur_pos());
+        _cur.request_buf = buf_in;
+        _cur.request = buf_in->map_ptr();
+    }
+    _cur.request_len = buf_in_len;
+
+    shmem_buffer *buf_out = nullptr;
+    if (!_worker_response) {
+        buf_out = find_buffer(_buf_out_cache, _buf_out_name,
+                _buf_out_id, _buf_out_gen, _buf_out_slot);
+        if (!buf_out)
+            return false;
+        buf_out->update_file_size(buf_out_file_size);
+    }
+    _cur.response_buf = buf_out;
+    if (_inline_response || _worker_response) {
+        // Shared buffer isn't touched unless response is too big.
+        shmem_buffer *local = take_local_buffer();
+        if (!local)
+            return false;
+        _cur.out_buf = buf_out;
+        _cur.response_buf = local;
+        _cur.local_response = true;
+        _cur.inline_max = _inline_response ? _inline_max : 0;
+    }
+    return true;
+}
+
+shmem_buffer * worker_loop::take_local_buffer() noexcept
+{
+    // Buffers given back by dispatcher are reused before creating new one.
+    if (!_local_cnt && _own_registered) {
+        int r = 0;
+        while (!_local_cnt && (r = recv_buffer_frame(false)) > 0) {}
+        if (r == -1)
+            return nullptr;
+    }
+    if (_local_cnt)
+        return _local_bufs[--_local_cnt];
+    if (_own_cap == _own_cnt) {
+        size_t cap = std::max<size_t>(2 * _own_cap, 4);
+        void *p = realloc(_own_bufs, cap * sizeof(*_own_bufs));
+        if (p)
+            _own_bufs = (own_buffer **)p;
+        void *q = p ? realloc(_local_bufs, cap * sizeof(*_local_bufs)) :
+            nullptr;
+        if (!q) {
+            pruv_log(LOG_EMERG, "No memory for local buffers");
+            return nullptr;
+        }
+        _local_bufs = (own_buffer **)q;
+        _own_cap = cap;
+    }
+    own_buffer *buf = new (std::nothrow) own_buffer;
+    if (!buf) {
+        pruv_log(LOG_EMERG, "No memory for local buffer");
+        return nullptr;
+    }
+    if (!buf->open_memfd()) {
+        delete buf;
+        return nullptr;
     }
-    buf_in->move_ptr((ptrdiff_t)buf_in_pos - (ptrdiff_t)buf_in->cur_pos());
+    if (!buf->reset_defaults(RESPONSE_CHUNK)) {
+        buf->close();
+        delete buf;
+        return nullptr;
+    }
+    buf->id = _own_cnt;
+    _own_bufs[_own_cnt++] = buf;
+    return buf;
+}
 
-    shmem_buffer *buf_out = _buf_out_cache.get(_buf_out_name);
-    if (!buf_out)
+bool worker_loop::release_local_buffer(shmem_buffer *b) noexcept
+{
+    own_buffer *buf = static_cast<own_buffer *>(b);
+    buf->set_data_size(0);
+    if (!buf->reset_defaults(RESPONSE_CHUNK)) {
+        _own_bufs[buf->id] = nullptr;
+        buf->close();
+        delete buf;
         return false;
-    buf_out->update_file_size(buf_out_file_size);
+    }
+    _local_bufs[_local_cnt++] = buf;
+    return true;
+}
 
-    _request_buf = buf_in;
-    _request = buf_in->map_ptr();
-    _request_len = buf_in_len;
-    _response_buf = buf_out;
+bool worker_loop::register_own_buffer(own_buffer &buf) noexcept
+{
+    if (buf.registered)
+        return true;
+    buffer_fd_cmd cmd;
+    cmd.hdr = make_cmd_header(CMD_BUFFER_FD, 0, sizeof(cmd));
+    cmd.id = buf.id;
+    cmd.gen = 0;
+    cmd.size = 0;
+    cmd.slot_size = 0;
+    int fd = buf.get_fd();
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fd))];
+    iovec iov = {&cmd, sizeof(cmd)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(fd));
+    ssize_t r;
+    while ((r = sendmsg(BUF_SOCK_FD, &msg, MSG_NOSIGNAL)) == -1 &&
+           errno == EINTR) {}
+    if (r != sizeof(cmd)) {
+        pruv_log_syserr(LOG_ERR, "sendmsg(BUF_SOCK_FD)");
+        return false;
+    }
+    buf.registered = true;
+    _own_registered = true;
+    return true;
+}
+
+bool worker_loop::spill_response(shmem_buffer &local, shmem_buffer &out)
+    noexcept
+{
+    size_t size = local.data_size();
+    if (size > out.file_size() && !out.resize(size))
+        return false;
+    for (size_t pos = 0; pos < size; pos += RESPONSE_CHUNK) {
+        size_t n = std::min(size - pos, RESPONSE_CHUNK);
+        if (!local.map(pos, n) || !out.map(pos, n))
+            return false;
+        memcpy(out.map_ptr(), local.map_ptr(), n);
+    }
+    out.set_data_size(size);
     return true;
 }
 
 bool worker_loop::send_last_response() noexcept
 {
     bool ok = true;
-    if (_response_buf->map_end() - _response_buf->map_begin() >
-            (ptrdiff_t)RESPONSE_CHUNK)
-        ok &= _response_buf->unmap();
-    if (!ok) {
-        _response_buf = nullptr;
-        return false;
+    shmem_buffer *local = _cur.local_response ? _cur.response_buf : nullptr;
+    if (local && (local->data_size() > _cur.inline_max || !_cur.inline_max)) {
+        if (_cur.out_buf) {
+            ok &= spill_response(*local, *_cur.out_buf);
+            _cur.response_buf = _cur.out_buf;
+        }
+        else {
+            // Dispatcher writes response from local buffer and gives it
+            // back later.
+            ok &= register_own_buffer(*static_cast<own_buffer *>(local));
+            _cur.own_response = true;
+            local = nullptr;
+        }
+        _cur.local_response = false;
     }
+    if (_cur.local_response) {
+        // Inline response is sent from mapping of its beginning.
+        size_t len = local->data_size();
+        if (local->map_offset() || local->map_end() - local->map_begin() <
+                (ptrdiff_t)len)
+            ok &= local->map(0, len);
+    }
+    else if (_cur.response_buf->map_end() - _cur.response_buf->map_begin() >
+            (ptrdiff_t)RESPONSE_CHUNK)
+        ok &= _cur.response_buf->unmap();
+    if (ok)
+        ok &= emit_last_response_cmd();
 
-    ok &= emit_last_response_cmd();
-    _response_buf = nullptr;
+    if (local)
+        ok &= release_local_buffer(local);
+    _cur.response_buf = nullptr;
+    _cur.local_response = false;
+    _cur.own_response = false;
     return ok;
 }
 
+bool worker_loop::binary_protocol() const noexcept
+{
+    return true;
+}
+
 bool worker_loop::emit_last_response_cmd() noexcept
 {
-    return
-        printf("RESP %" PRIuPTR " of %" PRIuPTR " END\n",
-            _response_buf->data_size(), _response_buf->file_size()) >= 0 &&
-        fflush(stdout) == 0;
+    response_cmd cmd;
+    uint32_t flags = 0;
+    size_t inline_len = 0;
+    if (_cur.local_response) {
+        flags |= CMD_F_INLINE_RESPONSE;
+        inline_len = _cur.response_buf->data_size();
+    }
+    uint32_t buf_id = 0;
+    if (_cur.own_response) {
+        flags |= CMD_F_WORKER_BUFFER;
+        buf_id = static_cast<own_buffer *>(_cur.response_buf)->id;
+    }
+    cmd.hdr = make_cmd_header(CMD_RESPONSE, flags, sizeof(cmd) + inline_len);
+    cmd.data_size = _cur.response_buf->data_size();
+    cmd.file_size = _cur.response_buf->file_size();
+    cmd.tag = _cur.tag;
+    cmd.buf_id = buf_id;
+    iovec v[2] = {{&cmd, sizeof(cmd)},
+        {const_cast<char *>(_cur.response_buf->map_begin()), inline_len}};
+    size_t cnt = inline_len ? 2 : 1;
+    // Responses of batch are sent together by finish_batch().
+    if (_coalesce)
+        return append_response(v, cnt);
+    if (_ring.opened()) {
+        bool notify;
+        if (_ring.resp.write(v, cnt, notify))
+            return !notify || ring_channel::notify(_ring.resp_efd);
+        // Ring is full. Response goes through pipe.
+    }
+    return write_all(v[0].iov_base, v[0].iov_len) &&
+        write_all(v[1].iov_base, v[1].iov_len);
+}
+
+bool worker_loop::write_all(const void *src, size_t len) noexcept
+{
+    const char *p = (const char *)src;
+    while (len) {
+        ssize_t r = write(STDOUT_FILENO, p, len);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            pruv_log_syserr(LOG_ERR, "write(STDOUT_FILENO)");
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
 }
 
 bool worker_loop::clean_after_request() noexcept
 {
-    assert(_request_buf);
+    if (!_cur.request)
+        return true; // Request deferred or there was no request.
     bool ok = true;
-    if (_request_buf->map_offset() +
-        (_request_buf->map_end() - _request_buf->map_begin()) > REQUEST_CHUNK)
-        ok &= _request_buf->unmap();
-    _request_buf = nullptr;
+    if (_cur.request_buf && _cur.request_buf->map_offset() +
+            (_cur.request_buf->map_end() - _cur.request_buf->map_begin()) >
+            REQUEST_CHUNK)
+        ok &= _cur.request_buf->unmap();
+    if (_cur.local_response && _cur.response_buf)
+        ok &= release_local_buffer(_cur.response_buf);
+    free(_cur.inline_copy);
+    free(_cur.meta_copy);
+    _cur = request_state();
     return ok;
 }
 
+bool worker_loop::next_batch() noexcept
+{
+    do {
+        if (_batch_cnt) {
+            // Previous request keeps its data while next one is received.
+            request_state &prev = _batch[_batch_cnt - 1];
+            if (!copy_inline_request(prev))
+                return false;
+            if (!(prev.meta_copy = strdup(_meta))) {
+                pruv_log(LOG_EMERG, "No memory for request meta copy");
+                return false;
+            }
+        }
+        if (!next_request())
+            return false;
+        if (_batch_cnt == _batch_cap) {
+            size_t cap = std::max<size_t>(2 * _batch_cap, 4);
+            void *p = realloc(_batch, cap * sizeof(*_batch));
+            if (!p) {
+                pruv_log(LOG_EMERG, "No memory for batch of requests");
+                return false;
+            }
+            _batch = (request_state *)p;
+            _batch_cap = cap;
+        }
+        _batch[_batch_cnt++] = _cur;
+        _cur = request_state();
+    } while (_binary_requests && frame_pending());
+    return true;
+}
+
+bool worker_loop::frame_pending() noexcept
+{
+    if (_ring.opened() && _ring.cmd.readable())
+        return true;
+    pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    int r;
+    while ((r = poll(&fd, 1, 0)) == -1 && errno == EINTR) {}
+    return r > 0;
+}
+
+bool worker_loop::finish_batch() noexcept
+{
+    bool ok = flush_responses();
+    _coalesce = false;
+    ok &= clean_after_request();
+    // Requests, which handle_batch() didn't select.
+    for (size_t i = 0; i < _batch_cnt; ++i) {
+        if (_batch[i].request) {
+            _cur = _batch[i];
+            ok &= clean_after_request();
+        }
+    }
+    _batch_cnt = 0;
+    return ok;
+}
+
+bool worker_loop::append_response(const iovec *v, size_t cnt) noexcept
+{
+    for (size_t i = 0; i < cnt; ++i) {
+        if (_resp_out_cap - _resp_out_len < v[i].iov_len) {
+            size_t cap = std::max(2 * _resp_out_cap,
+                    _resp_out_len + v[i].iov_len);
+            char *p = (char *)realloc(_resp_out, cap);
+            if (!p) {
+                pruv_log(LOG_EMERG, "No memory for responses of batch");
+                return false;
+            }
+            _resp_out = p;
+            _resp_out_cap = cap;
+        }
+        memcpy(_resp_out + _resp_out_len, v[i].iov_base, v[i].iov_len);
+        _resp_out_len += v[i].iov_len;
+    }
+    return true;
+}
+
+bool worker_loop::flush_responses() noexcept
+{
+    if (!_resp_out_len)
+        return true;
+    iovec v = {_resp_out, _resp_out_len};
+    _resp_out_len = 0;
+    if (_ring.opened()) {
+        bool notify;
+        if (_ring.resp.write(&v, 1, notify))
+            return !notify || ring_channel::notify(_ring.resp_efd);
+        // Ring is full. Responses go through pipe.
+    }
+    return write_all(v.iov_base, v.iov_len);
+}
+
+int worker_loop::on_wakeup() noexcept
+{
+    return EXIT_SUCCESS;
+}
+
+bool worker_loop::copy_inline_request(request_state &r) noexcept
+{
+    if (r.request_buf || r.inline_copy)
+        return true;
+    char *p = (char *)malloc(r.request_len + 1);
+    if (!p) {
+        pruv_log(LOG_EMERG, "No memory for inline request copy");
+        return false;
+    }
+    memcpy(p, r.request, r.request_len);
+    r.request = r.inline_copy = p;
+    return true;
+}
+
+bool worker_loop::defer_request(uint32_t &id) noexcept
+{
+    assert(_cur.request);
+    if (!copy_inline_request(_cur))
+        return false;
+    if (_deferred_cnt == _deferred_cap) {
+        size_t cap = std::max<size_t>(2 * _deferred_cap, 4);
+        void *p = realloc(_deferred, cap * sizeof(*_deferred));
+        if (!p) {
+            pruv_log(LOG_EMERG, "No memory for deferred request");
+            return false;
+        }
+        _deferred = (request_state *)p;
+        _deferred_cap = cap;
+    }
+    _deferred[_deferred_cnt++] = _cur;
+    id = _cur.tag;
+    _cur = request_state();
+    return true;
+}
+
+bool worker_loop::resume_request(uint32_t id) noexcept
+{
+    if (_cur.response_buf) {
+        pruv_log(LOG_ERR, "Response for current request isn't sent");
+        return false;
+    }
+    if (!clean_after_request())
+        return false;
+    for (size_t i = 0; i < _deferred_cnt; ++i)
+        if (_deferred[i].tag == id) {
+            _cur = _deferred[i];
+            _deferred[i] = _deferred[--_deferred_cnt];
+            return true;
+        }
+    pruv_log(LOG_ERR, "No deferred request %" PRIu32, id);
+    return false;
+}
+
+void worker_loop::set_wakeup_fd(int fd) noexcept
+{
+    _wakeup_fd = fd;
+}
+
 } // namespace pruv
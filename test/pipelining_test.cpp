@@ -269,6 +269,29 @@ struct pipeline : loop_fixture, ::testing::WithParamInterface<bool> {
         ASSERT_TRUE(uv_ok(uv_read_start((uv_stream_t *)&st->connection,
                         alloc_cb, read_cb)));
     }
+
+    static void on_read_delay(uv_timer_t *th)
+    {
+        state *st = reinterpret_cast<state *>(th->data);
+        ASSERT_TRUE(uv_ok(uv_read_start((uv_stream_t *)&st->connection,
+                        alloc_cb, read_cb)));
+    }
+
+    /// Sends all requests at once and starts reading later, so responses
+    /// are ready while the first one is still written.
+    static void on_connect_slow_reader(uv_connect_t *conreq, int status)
+    {
+        ASSERT_TRUE(uv_ok(status));
+        state *st = reinterpret_cast<state *>(conreq->handle->data);
+        st->timer.data = st;
+        ASSERT_TRUE(uv_ok(uv_timer_init(st->connection.loop, &st->timer)));
+        ASSERT_TRUE(uv_ok(uv_timer_start(&st->timer, on_read_delay, 500, 0)));
+        st->write_reqs.emplace_back();
+        uv_buf_t buf = uv_buf_init(&st->send_data[0], st->send_data.size());
+        st->sended = st->send_data.size();
+        ASSERT_TRUE(uv_ok(uv_write(&st->write_reqs.back(),
+                        (uv_stream_t *)&st->connection, &buf, 1, on_write)));
+    }
 };
 
 struct redundant_worker : public worker_loop {
@@ -321,6 +344,44 @@ TEST_P(pipeline, test_1)
             st.recv_buffer.begin(), st.recv_buffer.end()));
 }
 
+TEST_P(pipeline, gathering)
+{
+    // Response doesn't fit into socket buffers, so the next responses are
+    // ready before it's written and are written together.
+    size_t lens[] = {8 * 1024 * 1024, 9, 10, 100, REQUEST_CHUNK, 20, 9};
+    size_t sz = sizeof(lens) / sizeof(*lens);
+    std::vector<reqtest> tests(sz);
+    for (size_t i = 0; i < sz; ++i)
+        fill_test(tests[i], lens[i], i + 1 < sz);
+    for (size_t i = 1; i < sz; ++i)
+        tests[i - 1].next = &tests[i];
+
+    state st;
+    concatenate_requests(&tests[0], &st.send_data);
+    concatenate_responses(&tests[0], &st.exp_received);
+
+    ASSERT_TRUE(uv_ok(uv_tcp_init(&loop, &st.connection)));
+
+    common_dispatcher<pipeline_context> d(GetParam());
+    st.d = &d;
+    const char *args[] = {"./pruv_test", "--worker", "redundantxor", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+
+    sockaddr_in6 addr;
+    ASSERT_TRUE(uv_ok(uv_ip6_addr("::1", 8000, &addr)));
+    uv_connect_t conreq;
+    st.connection.data = &st;
+    ASSERT_TRUE(uv_ok(uv_tcp_connect(&conreq, &st.connection,
+                    (sockaddr *)&addr, pipeline::on_connect_slow_reader)));
+
+    EXPECT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_LT(0u, d.gathered_writes());
+    EXPECT_TRUE(std::equal(
+            st.exp_received.begin(), st.exp_received.end(),
+            st.recv_buffer.begin(), st.recv_buffer.end()));
+}
+
 INSTANTIATE_TEST_CASE_P(inworker, pipeline, ::testing::Values(false),
         ::testing::internal::DefaultParamName<bool>);
 
@@ -2,11 +2,19 @@
  * Copyright (C) Andrey Pikas
  */
 
+#include <cinttypes>
+#include <cstdio>
+#include <functional>
 #include <memory>
 
 #include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <uv.h>
 
+#include <pruv/uring.hpp>
 #include "fixtures.hpp"
 #include "common_dispatcher.hpp"
 #include "workers_reg.hpp"
@@ -120,10 +128,14 @@ struct context {
     size_t resp_len;
     size_t exp_resp_len;
     common_dispatcher<test_context> *d;
+    /// Replaces on_read if set.
+    uv_read_cb read_cb = nullptr;
 
     virtual ~context() {}
     virtual void create_request() = 0;
     virtual void check_response() const = 0;
+    /// Length varied by test.
+    virtual void set_len(size_t len) { exp_resp_len = len; }
 };
 
 void connect(context *ctx);
@@ -175,7 +187,8 @@ void on_write(uv_write_t *req_w, int status)
     ASSERT_TRUE(uv_ok(status));
     context *ctx = reinterpret_cast<context *>(req_w->data);
     ctx->resp_len = 0;
-    ASSERT_TRUE(uv_ok(uv_read_start(req_w->handle, alloc, on_read)));
+    ASSERT_TRUE(uv_ok(uv_read_start(req_w->handle, alloc,
+                    ctx->read_cb ? ctx->read_cb : on_read)));
 }
 
 void on_connect(uv_connect_t *req_con, int status)
@@ -226,8 +239,42 @@ struct onerequest_worker : public worker_loop {
     }
 };
 
+/// Worker with custom response command. Dispatcher must keep text protocol.
+struct onerequest_text_worker : public onerequest_worker {
+    virtual bool binary_protocol() const noexcept override { return false; }
+
+    virtual bool emit_last_response_cmd() noexcept override
+    {
+        return
+            printf("RESP %" PRIuPTR " of %" PRIuPTR " END\n",
+                response_buf()->data_size(), response_buf()->file_size()) >= 0
+            && fflush(stdout) == 0;
+    }
+};
+
+/// Fails requests until warm up done.
+struct warmup_worker : public onerequest_worker {
+    virtual bool warm_up() noexcept override
+    {
+        usleep(100'000);
+        warmed_up = true;
+        return true;
+    }
+
+    virtual int handle_request() noexcept override
+    {
+        if (!warmed_up)
+            return EXIT_FAILURE;
+        return onerequest_worker::handle_request();
+    }
+
+    bool warmed_up = false;
+};
+
 namespace {
 workers_reg::registrator<onerequest_worker> reg1("onerequest");
+workers_reg::registrator<warmup_worker> reg1w("warmup");
+workers_reg::registrator<onerequest_text_worker> reg1t("onerequest_text");
 } // namespace
 
 struct empty_req_context : context {
@@ -250,7 +297,30 @@ struct empty_req_context : context {
 template<typename T, size_t n>
 constexpr size_t ar_sz(const T (&)[n]) { return n; }
 
-struct nonpersistent : loop_fixture {};
+/// Chain of client connections. Each one is made after the previous one is
+/// done or reuses its persistent connection.
+struct chain_fixture : loop_fixture {
+    template <typename Ctx = empty_req_context, size_t n>
+    void make_chain(common_dispatcher<test_context> &d,
+            const size_t (&lens)[n], bool keep_alive)
+    {
+        ctxs.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            ctxs[i].reset(new Ctx);
+            ctxs[i]->next = nullptr;
+            if (i)
+                ctxs[i - 1]->next = ctxs[i].get();
+            ctxs[i]->keep_alive = keep_alive;
+            ctxs[i]->set_len(lens[i]);
+            ctxs[i]->d = &d;
+            ctxs[i]->loop = &loop;
+        }
+    }
+
+    std::vector<std::unique_ptr<context>> ctxs;
+};
+
+struct nonpersistent : chain_fixture {};
 
 TEST_F(nonpersistent, varresponses)
 {
@@ -259,23 +329,264 @@ TEST_F(nonpersistent, varresponses)
     d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
     size_t lens[] = {0, 1, 4096, REQUEST_CHUNK, RESPONSE_CHUNK,
         10 * RESPONSE_CHUNK, 123, 10 * RESPONSE_CHUNK + 123};
-    std::vector<std::unique_ptr<context>> ctxs(ar_sz(lens));
-    for (size_t i = 0; i < ctxs.size(); ++i) {
-        ctxs[i].reset(new empty_req_context);
-        ctxs[i]->next = nullptr;
-        if (i)
-            ctxs[i - 1]->next = ctxs[i].get();
-        ctxs[i]->keep_alive = false;
-        ctxs[i]->exp_resp_len = lens[i];
-        ctxs[i]->d = &d;
-        ctxs[i]->loop = &loop;
-    }
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, textprotocol)
+{
+    common_dispatcher<test_context> d;
+    const char *args[] = {"./pruv_test", "--worker", "onerequest_text",
+        nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, warmup)
+{
+    common_dispatcher<test_context> d;
+    const char *args[] = {"./pruv_test", "--worker", "warmup", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    std::unique_ptr<context> ctx(new empty_req_context());
+    ctx->next = nullptr;
+    ctx->keep_alive = false;
+    ctx->exp_resp_len = 4096;
+    ctx->d = &d;
+    ctx->loop = &loop;
+    connect(ctx.get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, memfdbuffers)
+{
+    common_dispatcher<test_context> d;
+    d.set_memfd_buffers(true);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, REQUEST_CHUNK, RESPONSE_CHUNK,
+        10 * RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, registeredbuffers)
+{
+    // Named buffers are passed by descriptors and referred by ids.
+    common_dispatcher<test_context> d;
+    d.set_registered_buffers(true);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, REQUEST_CHUNK, RESPONSE_CHUNK,
+        10 * RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, workerbuffers)
+{
+    // Binary worker responds from its own buffers, small responses inline.
+    common_dispatcher<test_context> d;
+    d.set_worker_buffers(true);
+    d.set_inline_threshold(1024);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 10 * RESPONSE_CHUNK, 123,
+        4096, 1024, 1025};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, contiguousbuffers)
+{
+    // Buffers are mapped growing in place by dispatcher and worker.
+    common_dispatcher<test_context> d;
+    d.set_memfd_buffers(true);
+    d.set_contiguous_buffers(16 << 20);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 10 * RESPONSE_CHUNK + 123,
+        123, 40 * RESPONSE_CHUNK};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, largeresponses)
+{
+    // Large responses are written by double-buffered windows.
+    common_dispatcher<test_context> d;
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {256 * RESPONSE_CHUNK, 123, 256 * RESPONSE_CHUNK + 123,
+        RESPONSE_CHUNK + 1, RESPONSE_CHUNK};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_EQ(3u, d.streamed_responses());
+}
+
+TEST_F(nonpersistent, largeresponsesthroughput)
+{
+    // Throughput of large responses written by double-buffered windows.
+    // It's only printed and doesn't fail the test.
+    common_dispatcher<test_context> d;
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {256 * RESPONSE_CHUNK, 256 * RESPONSE_CHUNK + 123,
+        RESPONSE_CHUNK + 1, 256 * RESPONSE_CHUNK};
+    size_t total = 0;
+    for (size_t len : lens)
+        total += len;
+    make_chain(d, lens, false);
+    uint64_t start = uv_hrtime();
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    uint64_t ns = uv_hrtime() - start;
+    d.on_loop_exit();
+    if (!ns)
+        ns = 1;
+    std::printf("Large responses: %" PRIuPTR " MB in %" PRIu64 " ms, "
+            "%" PRIu64 " MB/s\n", total >> 20, ns / 1'000'000,
+            (uint64_t)total * 1'000'000'000 / ns >> 20);
+}
+
+TEST_F(nonpersistent, sendfile)
+{
+    // Large responses are sent from buffers' descriptors.
+    common_dispatcher<test_context> d;
+    d.set_sendfile(true);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 123, RESPONSE_CHUNK + 1, 64 * RESPONSE_CHUNK + 123,
+        10 * RESPONSE_CHUNK, 4096};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_LT(0u, d.sendfile_bytes());
+}
+
+TEST_F(nonpersistent, iouring)
+{
+    // Responses are written by io_uring, large ones by windows, when kernel
+    // supports it.
+    uring probe;
+    bool available = probe.init(&loop, 4, false, nullptr);
+    if (available)
+        probe.close();
+    common_dispatcher<test_context> d;
+    d.set_io_uring(64, false);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 10 * RESPONSE_CHUNK + 123,
+        123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_EQ(available, d.uring_sent() > 0);
+}
+
+TEST_F(nonpersistent, listenfd)
+{
+    // Dispatcher listens on socket bound before start.
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, fd);
+    int on = 1;
+    ASSERT_EQ(0, setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)));
+    sockaddr_in6 addr;
+    ASSERT_TRUE(uv_ok(uv_ip6_addr("::1", 8000, &addr)));
+    ASSERT_EQ(0, bind(fd, (sockaddr *)&addr, sizeof(addr)));
+    ASSERT_EQ(0, listen(fd, 16));
+    common_dispatcher<test_context> d;
+    d.set_listen_fd(fd);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8001, 1, "./pruv_test", args);
+    size_t lens[] = {0, 123, RESPONSE_CHUNK + 1};
+    make_chain(d, lens, false);
     connect(ctxs.front().get());
     ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
     d.on_loop_exit();
 }
 
-struct persistent : loop_fixture {};
+TEST_F(nonpersistent, workerspool)
+{
+    // workers_min workers are spawned at start, not on demand.
+    common_dispatcher<test_context> d;
+    d.set_workers_pool(2, 1, 0);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 4, "./pruv_test", args);
+    EXPECT_EQ(2u, d.workers_count());
+    size_t lens[] = {0, 123, RESPONSE_CHUNK + 1};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, arena)
+{
+    // Buffers are slots of two arena segments, which are passed once.
+    common_dispatcher<test_context> d;
+    d.set_buffer_arena(2, REQUEST_CHUNK, 11 * RESPONSE_CHUNK);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, REQUEST_CHUNK, RESPONSE_CHUNK,
+        10 * RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, prefault)
+{
+    // Buffers are created and faulted in at start and reused by requests.
+    common_dispatcher<test_context> d;
+    d.set_buffer_arena(4, 2 << 20, 12 << 20);
+    d.set_buffer_prefault(2, 2, true);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    EXPECT_EQ(2 * (REQUEST_CHUNK + RESPONSE_CHUNK) / shmem_buffer::PAGE_SIZE,
+            d.prefaulted_pages());
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 10 * RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(nonpersistent, zygote)
+{
+    // Forked workers inherit warmed up state of zygote.
+    common_dispatcher<test_context> d;
+    d.set_zygote(true);
+    d.set_ring_transport(true);
+    const char *args[] = {"./pruv_test", "--worker", "warmup", nullptr};
+    d.start(&loop, "::1", 8000, 2, "./pruv_test", args);
+    size_t lens[] = {0, 1, 4096, RESPONSE_CHUNK, 123};
+    make_chain(d, lens, false);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+struct persistent : chain_fixture {};
 
 TEST_F(persistent, varresponses)
 {
@@ -284,17 +595,81 @@ TEST_F(persistent, varresponses)
     d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
     size_t lens[] = {1, 4096, REQUEST_CHUNK, RESPONSE_CHUNK,
         10 * RESPONSE_CHUNK, 123, 10 * RESPONSE_CHUNK + 123};
-    std::vector<std::unique_ptr<context>> ctxs(ar_sz(lens));
-    for (size_t i = 0; i < ctxs.size(); ++i) {
-        ctxs[i].reset(new empty_req_context());
-        ctxs[i]->next = nullptr;
-        if (i)
-            ctxs[i - 1]->next = ctxs[i].get();
-        ctxs[i]->keep_alive = true;
-        ctxs[i]->exp_resp_len = lens[i];
-        ctxs[i]->d = &d;
-        ctxs[i]->loop = &loop;
+    make_chain(d, lens, true);
+    ctxs.back()->keep_alive = false;
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+/// After the last response client doesn't close persistent connection, but
+/// drains dispatcher.
+struct drain_context : empty_req_context {
+    drain_context() { read_cb = drain_on_read; }
+
+    static void drain_on_read(uv_stream_t *strm, ssize_t nread,
+            const uv_buf_t *buf)
+    {
+        context *ctx = reinterpret_cast<context *>(strm->data);
+        if (ctx->next)
+            return on_read(strm, nread, buf);
+        if (ctx->resp_len < ctx->exp_resp_len) {
+            ASSERT_TRUE(uv_ok(nread));
+            ctx->resp_len += nread;
+            EXPECT_GE(ctx->exp_resp_len, ctx->resp_len);
+            if (ctx->resp_len == ctx->exp_resp_len) {
+                ctx->check_response();
+                ctx->d->drain();
+            }
+        }
+        else if (nread) {
+            EXPECT_EQ(UV_EOF, nread);
+            uv_close((uv_handle_t *)strm, nullptr);
+        }
     }
+};
+
+TEST_F(persistent, drain)
+{
+    // The last persistent connection is closed by draining dispatcher, which
+    // stops when no connections are left.
+    common_dispatcher<test_context> d;
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {1, 10 * RESPONSE_CHUNK, 123};
+    make_chain<drain_context>(d, lens, true);
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(persistent, pooledbuffers)
+{
+    // Grown buffers are reused by size classes and trimmed by small limit.
+    common_dispatcher<test_context> d;
+    d.set_buffer_pool_limit(RESPONSE_CHUNK);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {10 * RESPONSE_CHUNK + 123, 1, 10 * RESPONSE_CHUNK,
+        4 * RESPONSE_CHUNK, 123, 40 * RESPONSE_CHUNK, RESPONSE_CHUNK, 1};
+    make_chain(d, lens, true);
+    ctxs.back()->keep_alive = false;
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(persistent, inlinemessages)
+{
+    // Small responses are inline, bigger ones are copied into buffers.
+    common_dispatcher<test_context> d;
+    d.set_inline_threshold(4096);
+    d.set_ring_transport(true);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t lens[] = {1, 2, 4096, 4097, 123, RESPONSE_CHUNK,
+        10 * RESPONSE_CHUNK + 123, 1};
+    make_chain(d, lens, true);
     ctxs.back()->keep_alive = false;
     connect(ctxs.front().get());
     ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
@@ -355,6 +730,12 @@ struct hash_req_context : context {
     {
         EXPECT_EQ(hash, *reinterpret_cast<const uint32_t *>(resp_data.data()));
     }
+
+    virtual void set_len(size_t len) override
+    {
+        gen_req_len = len;
+        exp_resp_len = sizeof(hash);
+    }
 };
 
 TEST_F(nonpersistent, varrequests)
@@ -366,18 +747,7 @@ TEST_F(nonpersistent, varrequests)
     size_t lens[] = {0, 1, 4096 - hdr, REQUEST_CHUNK - hdr, REQUEST_CHUNK,
         RESPONSE_CHUNK - hdr, RESPONSE_CHUNK,
         10 * RESPONSE_CHUNK - hdr, 123, 10 * RESPONSE_CHUNK + 123};
-    std::vector<std::unique_ptr<hash_req_context>> ctxs(ar_sz(lens));
-    for (size_t i = 0; i < ctxs.size(); ++i) {
-        ctxs[i].reset(new hash_req_context());
-        ctxs[i]->next = nullptr;
-        if (i)
-            ctxs[i - 1]->next = ctxs[i].get();
-        ctxs[i]->keep_alive = false;
-        ctxs[i]->gen_req_len = lens[i];
-        ctxs[i]->exp_resp_len = 4;
-        ctxs[i]->d = &d;
-        ctxs[i]->loop = &loop;
-    }
+    make_chain<hash_req_context>(d, lens, false);
     connect(ctxs.front().get());
     ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
     d.on_loop_exit();
@@ -392,22 +762,392 @@ TEST_F(persistent, varrequests)
     size_t lens[] = {0, 1, 4096 - hdr, REQUEST_CHUNK - hdr, REQUEST_CHUNK,
         RESPONSE_CHUNK - hdr, RESPONSE_CHUNK,
         10 * RESPONSE_CHUNK - hdr, 123, 10 * RESPONSE_CHUNK + 123};
-    std::vector<std::unique_ptr<hash_req_context>> ctxs(ar_sz(lens));
-    for (size_t i = 0; i < ctxs.size(); ++i) {
-        ctxs[i].reset(new hash_req_context());
-        ctxs[i]->next = nullptr;
-        if (i)
-            ctxs[i - 1]->next = ctxs[i].get();
-        ctxs[i]->keep_alive = true;
-        ctxs[i]->gen_req_len = lens[i];
-        ctxs[i]->exp_resp_len = 4;
-        ctxs[i]->d = &d;
-        ctxs[i]->loop = &loop;
-    }
+    make_chain<hash_req_context>(d, lens, true);
+    ctxs.back()->keep_alive = false;
+    connect(ctxs.front().get());
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+}
+
+TEST_F(persistent, ringtransport)
+{
+    common_dispatcher<test_context> d;
+    d.set_ring_transport(true);
+    const char *args[] = {"./pruv_test", "--worker", "hashrequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    size_t hdr = 2 * sizeof(size_t);
+    size_t lens[] = {0, 1, 4096 - hdr, REQUEST_CHUNK, RESPONSE_CHUNK, 123,
+        10 * RESPONSE_CHUNK + 123, 0, 1};
+    make_chain<hash_req_context>(d, lens, true);
     ctxs.back()->keep_alive = false;
     connect(ctxs.front().get());
     ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
     d.on_loop_exit();
 }
 
+constexpr size_t QUEUED_REQUESTS = 3;
+constexpr size_t QUEUED_RESP_LEN = 100;
+
+/// Defers requests and responds to them in reverse order when all concurrent
+/// requests are received. The first request is answered at once, so clients
+/// know that worker is started.
+struct deferring_worker : public onerequest_worker {
+    virtual int handle_request() noexcept override
+    {
+        if (first) {
+            first = false;
+            return onerequest_worker::handle_request();
+        }
+        if (!defer_request(ids[cnt++]))
+            return EXIT_FAILURE;
+        if (cnt < QUEUED_REQUESTS)
+            return EXIT_SUCCESS;
+        while (cnt) {
+            if (!resume_request(ids[--cnt]))
+                return EXIT_FAILURE;
+            int r = onerequest_worker::handle_request();
+            if (r != EXIT_SUCCESS)
+                return r;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    bool first = true;
+    uint32_t ids[QUEUED_REQUESTS];
+    size_t cnt = 0;
+};
+
+namespace {
+workers_reg::registrator<deferring_worker> reg3("deferring");
+
+struct queued_context : test_context {
+    queued_context()
+    {
+        exp_req_len = 3 * sizeof(size_t);
+        exp_resp_len = QUEUED_RESP_LEN;
+    }
+};
+
+struct queued_client {
+    uv_tcp_t con;
+    uv_connect_t rcon;
+    uv_write_t write;
+    size_t req[3] = {2 * sizeof(size_t), false, QUEUED_RESP_LEN};
+    /// Bytes of req sent. Less makes partial request.
+    size_t req_size = sizeof(req);
+    std::vector<char> resp;
+    size_t received = 0;
+    std::function<void ()> on_done;
+};
+
+void queued_alloc(uv_handle_t *h, size_t sz, uv_buf_t *buf)
+{
+    queued_client *c = reinterpret_cast<queued_client *>(h->data);
+    c->resp.resize(c->received + sz);
+    *buf = uv_buf_init(c->resp.data() + c->received, sz);
+}
+
+void queued_on_read(uv_stream_t *s, ssize_t nread, const uv_buf_t *)
+{
+    queued_client *c = reinterpret_cast<queued_client *>(s->data);
+    if (nread >= 0) {
+        c->received += nread;
+        return;
+    }
+    EXPECT_EQ(UV_EOF, nread);
+    c->resp.resize(c->received);
+    uv_close((uv_handle_t *)s, nullptr);
+    c->on_done();
+}
+
+void queued_on_connect(uv_connect_t *r, int status)
+{
+    ASSERT_TRUE(uv_ok(status));
+    queued_client *c = reinterpret_cast<queued_client *>(r->handle->data);
+    uv_buf_t buf = uv_buf_init((char *)c->req, c->req_size);
+    ASSERT_TRUE(uv_ok(uv_write(&c->write, r->handle, &buf, 1,
+            [](uv_write_t *, int status) { ASSERT_TRUE(uv_ok(status)); })));
+    ASSERT_TRUE(uv_ok(uv_read_start(r->handle, queued_alloc, queued_on_read)));
+}
+
+void queued_connect(queued_client *c, uv_loop_t *loop)
+{
+    c->con.data = c;
+    ASSERT_TRUE(uv_ok(uv_tcp_init(loop, &c->con)));
+    sockaddr_in6 addr;
+    ASSERT_TRUE(uv_ok(uv_ip6_addr("::1", 8000, &addr)));
+    ASSERT_TRUE(uv_ok(uv_tcp_connect(&c->rcon, &c->con, (sockaddr *)&addr,
+                    queued_on_connect)));
+}
+
+} // namespace
+
+TEST_F(nonpersistent, queuedepth)
+{
+    common_dispatcher<queued_context> d;
+    d.set_worker_queue_depth(QUEUED_REQUESTS);
+    const char *args[] = {"./pruv_test", "--worker", "deferring", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    queued_client warmup;
+    queued_client clients[QUEUED_REQUESTS];
+    size_t active = QUEUED_REQUESTS;
+    for (queued_client &c : clients)
+        c.on_done = [&] {
+            if (!--active)
+                d.stop();
+        };
+    warmup.on_done = [&] {
+        for (queued_client &c : clients)
+            queued_connect(&c, &loop);
+    };
+    queued_connect(&warmup, &loop);
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    for (const queued_client &c : clients) {
+        ASSERT_EQ(QUEUED_RESP_LEN, c.resp.size());
+        for (size_t i = 0; i < c.resp.size(); ++i)
+            EXPECT_EQ((char)i, c.resp[i]);
+    }
+}
+
+TEST_F(nonpersistent, requestbatch)
+{
+    // Waiting requests are sent to the only worker together.
+    common_dispatcher<queued_context> d;
+    d.set_worker_queue_depth(QUEUED_REQUESTS);
+    d.set_request_batch(QUEUED_REQUESTS);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    queued_client warmup;
+    queued_client clients[QUEUED_REQUESTS];
+    size_t active = QUEUED_REQUESTS;
+    for (queued_client &c : clients)
+        c.on_done = [&] {
+            if (!--active)
+                d.stop();
+        };
+    warmup.on_done = [&] {
+        for (queued_client &c : clients)
+            queued_connect(&c, &loop);
+    };
+    queued_connect(&warmup, &loop);
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    for (const queued_client &c : clients) {
+        ASSERT_EQ(QUEUED_RESP_LEN, c.resp.size());
+        for (size_t i = 0; i < c.resp.size(); ++i)
+            EXPECT_EQ((char)i, c.resp[i]);
+    }
+}
+
+TEST_F(nonpersistent, bufferbudget)
+{
+    // Connections wait for the only request buffer and requests wait in
+    // queue for the only response buffer.
+    common_dispatcher<queued_context> d;
+    d.set_buffer_budget(1, 0);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 2, "./pruv_test", args);
+    queued_client clients[QUEUED_REQUESTS];
+    size_t active = QUEUED_REQUESTS;
+    for (queued_client &c : clients) {
+        c.on_done = [&] {
+            if (!--active)
+                d.stop();
+        };
+        queued_connect(&c, &loop);
+    }
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    for (const queued_client &c : clients) {
+        ASSERT_EQ(QUEUED_RESP_LEN, c.resp.size());
+        for (size_t i = 0; i < c.resp.size(); ++i)
+            EXPECT_EQ((char)i, c.resp[i]);
+    }
+}
+
+TEST_F(persistent, draindeadline)
+{
+    // Connection with partial request isn't drained. It's closed when drain
+    // timeout expires.
+    common_dispatcher<queued_context> d;
+    d.set_drain_timeout(200);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    queued_client c;
+    c.req_size = sizeof(size_t);
+    uint64_t closed_at = 0;
+    c.on_done = [&] { closed_at = uv_now(&loop); };
+    queued_connect(&c, &loop);
+    uv_timer_t timer;
+    ASSERT_TRUE(uv_ok(uv_timer_init(&loop, &timer)));
+    timer.data = &d;
+    ASSERT_TRUE(uv_ok(uv_timer_start(&timer, [](uv_timer_t *t) {
+                reinterpret_cast<dispatcher *>(t->data)->drain();
+                uv_close((uv_handle_t *)t, nullptr);
+            }, 100, 0)));
+    uint64_t start = uv_now(&loop);
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_TRUE(c.resp.empty());
+    EXPECT_LE(start + 300, closed_at);
+}
+
+TEST_F(persistent, stopdraining)
+{
+    // stop() closes connections being drained without waiting for drain
+    // timeout, as the second SIGTERM does in pruvd.
+    common_dispatcher<queued_context> d;
+    d.set_drain_timeout(60'000);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    queued_client c;
+    c.req_size = sizeof(size_t);
+    uint64_t closed_at = 0;
+    c.on_done = [&] { closed_at = uv_now(&loop); };
+    queued_connect(&c, &loop);
+    struct drain_then_stop {
+        dispatcher *d;
+        size_t ticks;
+    } ds = {&d, 0};
+    uv_timer_t timer;
+    ASSERT_TRUE(uv_ok(uv_timer_init(&loop, &timer)));
+    timer.data = &ds;
+    ASSERT_TRUE(uv_ok(uv_timer_start(&timer, [](uv_timer_t *t) {
+                drain_then_stop *ds = (drain_then_stop *)t->data;
+                if (!ds->ticks++)
+                    return ds->d->drain();
+                ds->d->stop();
+                uv_close((uv_handle_t *)t, nullptr);
+            }, 100, 100)));
+    uint64_t start = uv_now(&loop);
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_TRUE(c.resp.empty());
+    EXPECT_LT(0u, closed_at);
+    EXPECT_GT(start + 5000, closed_at);
+}
+
+namespace {
+
+/// Checks options of accepted socket when the first request is read.
+struct sockopt_context : queued_context {
+    sockopt_context(size_t *checked) : checked(checked) {}
+
+    virtual bool parse_request(shmem_buffer *buf) noexcept override
+    {
+        if (buf && !done) {
+            done = true;
+            int fd = fileno();
+            auto opt = [fd](int level, int name) {
+                int v = -1;
+                socklen_t len = sizeof(v);
+                EXPECT_EQ(0, getsockopt(fd, level, name, &v, &len));
+                return v;
+            };
+            EXPECT_EQ(1, opt(IPPROTO_TCP, TCP_NODELAY));
+            EXPECT_EQ(16384, opt(IPPROTO_TCP, TCP_NOTSENT_LOWAT));
+            EXPECT_EQ(1, opt(SOL_SOCKET, SO_KEEPALIVE));
+            ++*checked;
+        }
+        return queued_context::parse_request(buf);
+    }
+
+    size_t *checked;
+    bool done = false;
+};
+
+} // namespace
+
+TEST_F(nonpersistent, socketoptions)
+{
+    // Listener and accepted connections have configured options.
+    size_t checked = 0;
+    common_dispatcher<sockopt_context> d(&checked);
+    socket_options opts;
+    opts.backlog = 128;
+    opts.defer_accept = 1;
+    opts.fastopen = 16;
+    opts.nodelay = true;
+    opts.notsent_lowat = 16384;
+    opts.keepalive = true;
+    d.set_socket_options(opts);
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    int defer = 0;
+    socklen_t len = sizeof(defer);
+    EXPECT_EQ(0, getsockopt(d.listen_socket(), IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &defer, &len));
+    EXPECT_LT(0, defer);
+    queued_client clients[QUEUED_REQUESTS];
+    size_t active = QUEUED_REQUESTS;
+    for (queued_client &c : clients) {
+        c.on_done = [&] {
+            if (!--active)
+                d.stop();
+        };
+        queued_connect(&c, &loop);
+    }
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    EXPECT_EQ(QUEUED_REQUESTS, checked);
+    for (const queued_client &c : clients) {
+        ASSERT_EQ(QUEUED_RESP_LEN, c.resp.size());
+        for (size_t i = 0; i < c.resp.size(); ++i)
+            EXPECT_EQ((char)i, c.resp[i]);
+    }
+}
+
+TEST_F(nonpersistent, reuseport)
+{
+    // Dispatchers in two threads accept connections on the same port.
+    struct dispatcher_thread {
+        uv_loop_t loop;
+        uv_async_t stop_async;
+        common_dispatcher<queued_context> d;
+    } t;
+    ASSERT_TRUE(uv_ok(uv_loop_init(&t.loop)));
+    ASSERT_TRUE(uv_ok(uv_async_init(&t.loop, &t.stop_async,
+            [](uv_async_t *a) {
+                dispatcher_thread *t = (dispatcher_thread *)a->data;
+                t->d.stop();
+                uv_close((uv_handle_t *)a, nullptr);
+            })));
+    t.stop_async.data = &t;
+    const char *args[] = {"./pruv_test", "--worker", "onerequest", nullptr};
+    t.d.set_reuse_port(true);
+    t.d.start(&t.loop, "::1", 8000, 1, "./pruv_test", args);
+    EXPECT_NE(-1, t.d.listen_socket());
+    uv_thread_t tid;
+    ASSERT_TRUE(uv_ok(uv_thread_create(&tid, [](void *arg) {
+                dispatcher_thread *t = (dispatcher_thread *)arg;
+                EXPECT_TRUE(uv_ok(uv_run(&t->loop, UV_RUN_DEFAULT)));
+                t->d.on_loop_exit();
+            }, &t)));
+    common_dispatcher<queued_context> d;
+    d.set_reuse_port(true);
+    d.start(&loop, "::1", 8000, 1, "./pruv_test", args);
+    EXPECT_NE(-1, d.listen_socket());
+    queued_client clients[8];
+    size_t active = ar_sz(clients);
+    for (queued_client &c : clients) {
+        c.on_done = [&] {
+            if (--active)
+                return;
+            d.stop();
+            uv_async_send(&t.stop_async);
+        };
+        queued_connect(&c, &loop);
+    }
+    ASSERT_TRUE(uv_ok(uv_run(&loop, UV_RUN_DEFAULT)));
+    d.on_loop_exit();
+    ASSERT_TRUE(uv_ok(uv_thread_join(&tid)));
+    EXPECT_TRUE(uv_ok(uv_loop_close(&t.loop)));
+    for (const queued_client &c : clients) {
+        ASSERT_EQ(QUEUED_RESP_LEN, c.resp.size());
+        for (size_t i = 0; i < c.resp.size(); ++i)
+            EXPECT_EQ((char)i, c.resp[i]);
+    }
+}
+
 } // namespace pruv